@@ -70,6 +70,15 @@ void* reallocf(void* p, size_t sz);
 # endif
 #endif
 
+/* Atomic operations, provided by the compiler */
+#define atomic_get(p)               __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_set(p, v)            __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_add(p, v)            __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_sub(p, v)            __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_cas(p, o, n)         __atomic_compare_exchange_n((p), (o), (n), 0, \
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define atomic_fence()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 #ifndef HAVE_STRLWR
 char* strlwr(char* s);
 #endif
@@ -47,7 +47,9 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
 
@@ -76,6 +78,9 @@
 
 #ifdef HAVE_LIBCAP
 #include <sys/capability.h>
+#endif
+
+#ifdef HAVE_SYS_PRCTL_H
 #include <sys/prctl.h>
 #endif
 
@@ -91,17 +96,122 @@
 #include "sock_any.h"
 #include "stringx.h"
 #include "sppriv.h"
+#include "spevent.h"
+#include "spwork.h"
+#include "spslab.h"
+#include "spcoro.h"
+#include "spspool.h"
+#include "spscan.h"
+#include "spuring.h"
+#include "spcpu.h"
+#include "spwheel.h"
+#include "sptrace.h"
 
 /* -----------------------------------------------------------------------
  *  STRUCTURES
  */
 
-typedef struct spthread
+/* Most commands a client can have waiting on the server at once */
+#define PIPELINE_MAX            64
+
+typedef struct spcommand
+{
+    char* line;                     /* As sent to the server, or our own reply */
+    int local;                      /* Answered by us rather than the server */
+}
+spcommand_t;
+
+/* Commands the client sent, in order, waiting for their responses */
+typedef struct sppipeline
+{
+    spcommand_t cmds[PIPELINE_MAX];
+    int head;                       /* The oldest, whose response is next */
+    int count;
+    int lines;                      /* Lines of that response read so far */
+    int offered;                    /* PIPELINING was passed on to the client */
+}
+sppipeline_t;
+
+/* A message sent with BDAT, spooled into the cache file as it comes */
+typedef struct spchunks
+{
+    unsigned long long size;        /* Bytes so far */
+    int tail;                       /* The last two of them */
+    struct spspool* spool;          /* Read back from once it's all in */
+    unsigned long long off;         /* How far it's been read */
+}
+spchunks_t;
+
+typedef struct spsession
+{
+    spctx_t* ctx;                   /* The context for the connection */
+
+    /* State for smtp_passthru */
+    char* helo;                     /* The HELO/EHLO the client sent */
+    int first_rsp;                  /* The first 220 response from server to be filtered */
+    int auth_started;               /* Started performing authentication */
+    int xclient_sup;                /* Is XCLIENT supported? */
+    int xclient_sent;               /* Have we sent an XCLIENT command? */
+    sppipeline_t pipe;              /* Commands waiting on the server */
+
+    int fd;                         /* The accepted client socket */
+    int queue;                      /* The worker queue we use */
+    int node;                       /* The NUMA node the session lives on */
+    spwork_t work;                  /* For running on a worker thread */
+
+    /* When running on an event loop */
+    spevloop_t* loop;               /* The loop the session belongs to */
+    spevrecv_t crecv;               /* Receives from the client socket */
+    spevrecv_t srecv;               /* Receives from the server socket */
+    int receiving;                  /* Which of those are outstanding */
+    int stopping;                   /* Waiting for them to stop, to block or end */
+    spevpost_t post;                /* For moving back onto the loop */
+    int blocked;                    /* Blocking step running as a coroutine or on a worker */
+    void (*step)(void*);            /* The blocking step */
+    void (*done)(void*);            /* And what to do back on the loop */
+    int linelen;                    /* Length of client line for blocking step */
+    int result;                     /* Result of blocking step */
+    spevtimer_t idle;               /* For timing out when nothing happens */
+    struct spsession* next;         /* Other sessions on the same loop */
+    struct spsession* prev;
+}
+spsession_t;
+
+typedef struct sppending
+{
+    int fd;                         /* The accepted client socket */
+    unsigned long long since;       /* When it started waiting, in msecs */
+}
+sppending_t;
+
+typedef struct spstats
+{
+    unsigned long queued;           /* Connections that had to wait for a slot */
+    unsigned long admitted;         /* Of those, ones that got one */
+    unsigned long expired;          /* And those that waited too long */
+    unsigned long refused;          /* Turned away because too many were waiting */
+    unsigned long long waited;      /* Total msecs that admitted connections waited */
+    unsigned long long max_wait;    /* Longest any of them waited */
+    int max_depth;                  /* Most that were waiting at once */
+}
+spstats_t;
+
+/* Looking up OutAddress, which may be done on a worker thread */
+typedef struct spresolve
+{
+    struct sockaddr_any* addrs;
+    int naddrs;                     /* Room for this many, then how many there were */
+}
+spresolve_t;
+
+typedef struct spacceptor
 {
-    pthread_t tid;      /* Written to by the main thread */
-    int fd;             /* The file descriptor or -1 */
+    pthread_t tid;                  /* Zero for the main thread */
+    int sock;                       /* The listening socket */
+    int index;                      /* Which acceptor this is */
+    unsigned int next;              /* Next of our worker queues to use */
 }
-spthread_t;
+spacceptor_t;
 
 /* -----------------------------------------------------------------------
  *  DATA
@@ -116,10 +226,15 @@ spthread_t;
 #define SMTP_FAILED         "451 Local Error" CRLF
 #define SMTP_NOTSUPP        "502 Command not implemented" CRLF
 #define SMTP_NOTAUTH        "554 Insufficient authorization" CRLF
+#define SMTP_NORCPT         "554 No valid recipients" CRLF
+#define SMTP_SPOOLFULL      "452 Insufficient system storage" CRLF
+#define SMTP_BADCHUNK       "501 Syntax error in BDAT" CRLF
+#define SMTP_CHUNKED        "250 %llu octets received" CRLF
 #define SMTP_OK             "250 Ok" CRLF
 #define SMTP_REJPREFIX      "550 Content Rejected; "
 
 #define SMTP_DATA           "DATA" CRLF
+#define SMTP_BDAT_LAST      "BDAT %llu LAST" CRLF
 #define SMTP_NOOP           "NOOP" CRLF
 #define SMTP_RSET           "RSET" CRLF
 #define SMTP_XCLIENT        "XCLIENT ADDR=%s" CRLF
@@ -127,6 +242,7 @@ spthread_t;
 #define SMTP_HELO_RSP       "250 smtp.passthru" CRLF
 #define SMTP_EHLO_RSP       "250-smtp.passthru" CRLF
 #define SMTP_FEAT_RSP       "250 XFILTERED" CRLF
+#define SMTP_CHUNK_RSP      "250-CHUNKING" CRLF
 #define SMTP_DELIMS         "\r\n\t :"
 #define SMTP_MULTI_DELIMS   " -"
 
@@ -146,6 +262,7 @@ spthread_t;
 #define RSET_CMD            "RSET"
 #define STARTTLS_CMD        "STARTTLS"
 #define BDAT_CMD            "BDAT"
+#define BDAT_LAST           "LAST"
 #define XCLIENT_CMD         "XCLIENT"
 #define XFORWARD_CMD        "XFORWARD"
 #define AUTH_CMD            "AUTH"
@@ -166,7 +283,41 @@ spthread_t;
 #define MAX_HEADER_LENGTH 	1024
 
 /* Maximum number of concurrent connections */
-#define TOP_MAX_CONNECTIONS     10240
+#define TOP_MAX_CONNECTIONS     65536
+
+/* Maximum number of event loop threads */
+#define TOP_EVENT_THREADS       256
+
+/* Maximum number of listening sockets */
+#define TOP_ACCEPTORS           64
+
+/* Smallest thread stack we allow, in kilobytes */
+#define BOTTOM_STACK_SIZE       64
+
+/* Number of sessions to allocate at once */
+#define SESSION_CHUNK           128
+
+/* Longest a connection can wait for a free slot, in seconds */
+#define TOP_PENDING_TIMEOUT     3600
+
+/* Maximum number of worker processes */
+#define TOP_PROCESSES           256
+
+/* Kilobytes of wire trace kept for a session */
+#define BOTTOM_TRACE_SIZE       4
+#define TOP_TRACE_SIZE          16384
+
+/* Kilobytes of a message that can be kept in memory */
+#define TOP_SPOOL_MEMORY        65536
+
+/* Megabytes all messages together can take up */
+#define TOP_SPOOL_LIMIT         1048576
+
+/* Seconds to wait before starting a worker that died right away */
+#define RESPAWN_DELAY           1
+
+/* Cache files are sent on a block at a time */
+#define REPLAY_BLOCK            (64 * 1024)
 
 /*
  * asctime_r manpage: "stores the string in a user-supplied buffer of
@@ -189,6 +340,7 @@ spthread_t;
 
 #define CFG_MAXTHREADS      "MaxConnections"
 #define CFG_TIMEOUT         "TimeOut"
+#define CFG_CONNECTTIMEOUT  "ConnectTimeout"
 #define CFG_OUTADDR         "OutAddress"
 #define CFG_LISTENADDR      "Listen"
 #define CFG_TRANSPARENT     "TransparentProxy"
@@ -198,6 +350,22 @@ spthread_t;
 #define CFG_PIDFILE         "PidFile"
 #define CFG_XCLIENT         "XClient"
 #define CFG_SKIP            "Skip"
+#define CFG_EVENTTHREADS    "EventThreads"
+#define CFG_WORKERTHREADS   "WorkerThreads"
+#define CFG_ACCEPTORS       "Acceptors"
+#define CFG_STACKSIZE       "StackSize"
+#define CFG_PENDING         "PendingConnections"
+#define CFG_PENDINGTIMEOUT  "PendingTimeout"
+#define CFG_IOURING         "IOUring"
+#define CFG_AFFINITY        "CPUAffinity"
+#define CFG_PROCESSES       "Processes"
+#define CFG_TRACESESSIONS   "TraceSessions"
+#define CFG_TRACECLIENT     "TraceClient"
+#define CFG_CHUNKING        "ServerChunking"
+#define CFG_TRACESIZE       "TraceSize"
+#define CFG_SPOOLMEMORY     "SpoolMemory"
+#define CFG_SPOOLSOFT       "SpoolSoftLimit"
+#define CFG_SPOOLHARD       "SpoolHardLimit"
 
 #define VAL_AUTHENTICATED   "authenticated"
 #define VAL_CLIENT          "client"
@@ -211,7 +379,18 @@ spthread_t;
 #define DEFAULT_PORT    10025
 #define DEFAULT_MAXTHREADS  64
 #define DEFAULT_TIMEOUT   180
+#define DEFAULT_CONNECTTIMEOUT 30
 #define DEFAULT_KEEPALIVES 0
+#define DEFAULT_EVENTTHREADS 0
+#define DEFAULT_WORKERTHREADS 8
+#define DEFAULT_ACCEPTORS 1
+#define DEFAULT_STACKSIZE 256
+#define DEFAULT_PENDING 64
+#define DEFAULT_PENDINGTIMEOUT 5
+#define DEFAULT_PROCESSES 1
+#define DEFAULT_TRACESIZE 64
+#define DEFAULT_CHUNKING 1
+#define DEFAULT_SPOOLMEMORY 256
 
 /* -----------------------------------------------------------------------
  *  GLOBALS
@@ -221,17 +400,53 @@ spstate_t g_state;                          /* The state and configuration of th
 unsigned int g_unique_id = 0x00100000;      /* For connection ids */
 pthread_mutex_t g_mutex;                    /* The main mutex */
 pthread_mutexattr_t g_mtxattr;
+spsession_t** g_evsessions = NULL;          /* Sessions on each event loop */
+int g_sessions = 0;                         /* Number of sessions, atomic */
+spslab_t** g_sessslabs = NULL;              /* Where sessions come from, by node */
+
+/* Connections waiting for a free slot, a ring */
+pthread_mutex_t g_pendmtx = PTHREAD_MUTEX_INITIALIZER;
+sppending_t* g_pending = NULL;
+int g_pendhead = 0;
+int g_npending = 0;                         /* Changed under lock, read atomically */
+spstats_t g_stats;                          /* Under g_pendmtx */
+
+/* Times a thread had to wait for a lock, atomic */
+unsigned long g_lockwaits = 0;
+unsigned long g_mainwaits = 0;              /* Of those, for the main mutex */
+
+unsigned long g_spoolfull = 0;             /* Messages refused with the spool full, atomic */
+
+unsigned int g_traced = 0;                  /* Sessions looked at for tracing, atomic */
 
 /* -----------------------------------------------------------------------
  *  FORWARD DECLARATIONS
  */
 
 static void on_quit(int signal);
+static void on_stats(int signal);
+static void on_trace(int signal);
 static void drop_privileges();
 static void pid_file(int write);
-static void connection_loop(int sock);
-static void* thread_main(void* arg);
-static int smtp_passthru(spctx_t* ctx);
+static int listen_socket();
+static void serve(spacceptor_t* accs, int index);
+static void supervise(spacceptor_t* accs);
+static void connection_loop(spacceptor_t* acc);
+static void* acceptor_main(void* arg);
+static void session_thread(spwork_t* work);
+static void session_start(spacceptor_t* acc, int fd);
+static void session_free(spsession_t* sess);
+static void pending_add(int fd);
+static void pending_drain(int queue);
+static int pending_expire(int all);
+static void refuse_connection(int fd, const char* rsp, size_t len);
+static void log_stats();
+static void trace_start(spctx_t* ctx);
+static void trace_dump(spctx_t* ctx, const char* why);
+static void session_tick(spevloop_t* loop, int index, int stopping);
+static int smtp_passthru(spsession_t* sess);
+static int passthru_server_line(spsession_t* sess, int r);
+static int passthru_chunk(spsession_t* sess);
 static int make_connections(spctx_t* ctx, int client);
 static int read_server_response(spctx_t* ctx);
 static int parse_config_file(const char* configfile);
@@ -239,6 +454,7 @@ static char* parse_address(char* line);
 static char* parse_xforward(char* line, const char* part);
 static const char* get_successful_rsp(const char* line, int* cont);
 static void do_server_noop(spctx_t* ctx);
+static void drop_cache(spctx_t* ctx);
 
 /* Used externally in some cases */
 int sp_parse_option(const char* name, const char* option);
@@ -261,7 +477,18 @@ void sp_init(const char* name)
     g_state.debug_level = -1;
     g_state.max_threads = DEFAULT_MAXTHREADS;
     g_state.timeout.tv_sec = DEFAULT_TIMEOUT;
+    g_state.connect_timeout = DEFAULT_CONNECTTIMEOUT;
     g_state.keepalives = DEFAULT_KEEPALIVES;
+    g_state.event_threads = DEFAULT_EVENTTHREADS;
+    g_state.worker_threads = DEFAULT_WORKERTHREADS;
+    g_state.acceptors = DEFAULT_ACCEPTORS;
+    g_state.stack_size = DEFAULT_STACKSIZE;
+    g_state.pending_max = DEFAULT_PENDING;
+    g_state.pending_timeout = DEFAULT_PENDINGTIMEOUT;
+    g_state.processes = DEFAULT_PROCESSES;
+    g_state.trace_size = DEFAULT_TRACESIZE;
+    g_state.chunking = DEFAULT_CHUNKING;
+    g_state.spool_memory = DEFAULT_SPOOLMEMORY;
     g_state.directory = _PATH_TMP;
     g_state.name = name;
 
@@ -280,8 +507,8 @@ void sp_init(const char* name)
 
 int sp_run(const char* configfile, const char* pidfile, int dbg_level)
 {
-    int sock;
-    int true = 1;
+    spacceptor_t* accs;
+    int i;
 
     ASSERT(configfile);
     ASSERT(g_state.name);
@@ -311,6 +538,10 @@ int sp_run(const char* configfile, const char* pidfile, int dbg_level)
     else if(g_state.outname != NULL && g_state.transparent)
         warnx("the " CFG_OUTADDR " option will be ignored when " CFG_TRANSPARENT " is enabled");
 
+    /* Only network sockets can be shared */
+    if(g_state.acceptors > 1 && SANY_TYPE(g_state.listenaddr) == AF_UNIX)
+        errx(2, "the " CFG_ACCEPTORS " option can't be used with a local " CFG_LISTENADDR " socket");
+
     sp_messagex(NULL, LOG_DEBUG, "starting up (%s)...", VERSION);
 
     /* Drop privileges before daemonizing */
@@ -338,10 +569,356 @@ int sp_run(const char* configfile, const char* pidfile, int dbg_level)
     signal(SIGHUP, SIG_IGN);
     signal(SIGINT, on_quit);
     signal(SIGTERM, on_quit);
+    signal(SIGUSR1, on_stats);
+    signal(SIGUSR2, on_trace);
 
     siginterrupt(SIGINT, 1);
     siginterrupt(SIGTERM, 1);
 
+    accs = (spacceptor_t*)calloc(g_state.acceptors, sizeof(spacceptor_t));
+    if(!accs)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        exit(1);
+    }
+
+    /* Unlink the socket file if it exists */
+    if(SANY_TYPE(g_state.listenaddr) == AF_UNIX)
+        unlink(g_state.listenname);
+
+    /* With more than one the kernel spreads connections between them */
+    for(i = 0; i < g_state.acceptors; i++)
+    {
+        accs[i].sock = listen_socket();
+        accs[i].index = i;
+    }
+
+    pid_file(1);
+
+    /* The worker processes share what their spools hold */
+    if(spspool_share(g_state.processes) == -1)
+    {
+        sp_message(NULL, LOG_CRIT, "couldn't allocate spool counters");
+        exit(1);
+    }
+
+    sp_messagex(NULL, LOG_DEBUG, "accepting connections");
+
+    if(g_state.processes > 1)
+        supervise(accs);
+    else
+        serve(accs, 0);
+
+    pid_file(0);
+    spspool_unshare();
+
+    /* Our listen sockets */
+    for(i = 0; i < g_state.acceptors; i++)
+        close(accs[i].sock);
+    free(accs);
+
+    sp_messagex(NULL, LOG_DEBUG, "stopped processing");
+    return 0;
+}
+
+/* Accept and handle connections until told to quit */
+static void serve(spacceptor_t* accs, int index)
+{
+    int nqueues, i, r;
+
+    if(spcpu_init(g_state.cpu_affinity, index, g_state.processes) == -1)
+        exit(1);
+
+    g_sessslabs = (spslab_t**)calloc(spcpu_nodes(), sizeof(spslab_t*));
+    if(g_state.pending_max > 0)
+        g_pending = (sppending_t*)calloc(g_state.pending_max, sizeof(sppending_t));
+    if(!g_sessslabs || (g_state.pending_max > 0 && !g_pending))
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        exit(1);
+    }
+
+    for(i = 0; i < spcpu_nodes(); i++)
+    {
+        g_sessslabs[i] = spslab_new(sizeof(spsession_t), SESSION_CHUNK);
+        if(!g_sessslabs[i])
+        {
+            sp_messagex(NULL, LOG_CRIT, "out of memory");
+            exit(1);
+        }
+
+        if(spcpu_nodes() > 1)
+            spslab_place(g_sessslabs[i], i);
+    }
+
+    if(spspool_init(g_state.directory, g_state.name, g_state.spool_memory * 1024UL,
+                    g_state.spool_soft * 1048576ULL, g_state.spool_hard * 1048576ULL,
+                    index) == -1)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        exit(1);
+    }
+
+    /* Threads don't survive daemonizing or forking, so start these here */
+    nqueues = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nqueues < 1)
+        nqueues = 1;
+
+    if(spwork_init(nqueues, g_state.worker_threads, g_state.max_threads) == -1)
+        exit(1);
+
+    if(g_state.event_threads > 0)
+    {
+        g_evsessions = (spsession_t**)calloc(g_state.event_threads, sizeof(spsession_t*));
+        if(!g_evsessions)
+        {
+            sp_messagex(NULL, LOG_CRIT, "out of memory");
+            exit(1);
+        }
+
+        if(spev_init(g_state.event_threads, g_state.io_uring, session_tick) == -1)
+            exit(1);
+    }
+
+    /* The main thread is the first acceptor */
+    for(i = 1; i < g_state.acceptors; i++)
+    {
+        r = sp_thread_create(&(accs[i].tid), acceptor_main, accs + i);
+        if(r != 0)
+        {
+            errno = r;
+            sp_message(NULL, LOG_CRIT, "couldn't create acceptor thread");
+            exit(1);
+        }
+    }
+
+    spcpu_pin(0);
+    connection_loop(accs);
+
+    /* Wake up the other acceptors */
+    for(i = 1; i < g_state.acceptors; i++)
+    {
+        shutdown(accs[i].sock, SHUT_RDWR);
+        pthread_join(accs[i].tid, NULL);
+    }
+
+    /* No more slots are handed out, so nobody needs to wait */
+    pending_expire(1);
+
+    /* Loops first, they may still be handing work to the workers */
+    if(spev_running())
+        spev_done();
+
+    spwork_done();
+
+    free(g_evsessions);
+    g_evsessions = NULL;
+
+    for(i = 0; i < spcpu_nodes(); i++)
+        spslab_free(g_sessslabs[i]);
+    free(g_sessslabs);
+    g_sessslabs = NULL;
+
+    spspool_done();
+
+    spcpu_done();
+
+    free(g_pending);
+    g_pending = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * WORKER PROCESSES
+ */
+
+/* Only here to wake up sigsuspend */
+static void on_child(int signal)
+{
+}
+
+/* Start up a worker process, which serves until told to quit */
+static pid_t start_process(spacceptor_t* accs, int index, sigset_t* mask)
+{
+    int n = g_state.processes;
+    pid_t pid;
+
+    pid = fork();
+    if(pid == -1)
+    {
+        sp_message(NULL, LOG_ERR, "couldn't fork worker process");
+        return -1;
+    }
+
+    if(pid != 0)
+        return pid;
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+#ifdef PR_SET_PDEATHSIG
+    /* Don't outlive the supervisor */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() == 1)
+        exit(0);
+#endif
+
+    /* Each process gets its share of the connections */
+    g_state.max_threads = max(1, (g_state.max_threads + n - 1 - index) / n);
+    g_state.pending_max = (g_state.pending_max + n - 1 - index) / n;
+
+    /* Keep connection ids apart in the logs */
+    g_unique_id ^= (unsigned int)index << 24;
+
+    sp_messagex(NULL, LOG_DEBUG, "worker process %d started", index);
+    serve(accs, index);
+    exit(0);
+}
+
+/* Keep the worker processes running, until told to quit */
+static void supervise(spacceptor_t* accs)
+{
+    sigset_t set, old;
+    pid_t* pids;
+    time_t* started;
+    int running = 0;
+    int traced = g_state.trace_dump;
+    int status, delay, i;
+    pid_t pid;
+
+    pids = (pid_t*)calloc(g_state.processes, sizeof(pid_t));
+    started = (time_t*)calloc(g_state.processes, sizeof(time_t));
+    if(!pids || !started)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        exit(1);
+    }
+
+    /* Signals are only taken while waiting, so none are missed */
+    signal(SIGCHLD, on_child);
+    signal(SIGALRM, on_child);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    for(;;)
+    {
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for(i = 0; i < g_state.processes && pids[i] != pid; i++)
+                ;
+            if(i == g_state.processes)
+                continue;
+
+            pids[i] = 0;
+            running--;
+
+            if(sp_is_quit())
+                continue;
+            else if(WIFSIGNALED(status))
+                sp_messagex(NULL, LOG_ERR, "worker process %d died from signal %d, restarting",
+                            i, WTERMSIG(status));
+            else
+                sp_messagex(NULL, LOG_ERR, "worker process %d exited with status %d, restarting",
+                            i, WEXITSTATUS(status));
+        }
+
+        if(sp_is_quit())
+            break;
+
+        if(g_state.stats)
+        {
+            g_state.stats = 0;
+            for(i = 0; i < g_state.processes; i++)
+            {
+                if(pids[i] > 0)
+                    kill(pids[i], SIGUSR1);
+            }
+        }
+
+        if(traced != g_state.trace_dump)
+        {
+            traced = g_state.trace_dump;
+            for(i = 0; i < g_state.processes; i++)
+            {
+                if(pids[i] > 0)
+                    kill(pids[i], SIGUSR2);
+            }
+        }
+
+        /* Start any that aren't running */
+        for(i = 0, delay = 0; i < g_state.processes; i++)
+        {
+            if(pids[i] > 0)
+                continue;
+
+            /* Don't spin when they die right away */
+            if(started[i] && time(NULL) - started[i] < RESPAWN_DELAY)
+            {
+                delay = 1;
+                continue;
+            }
+
+            started[i] = time(NULL);
+            pids[i] = start_process(accs, i, &old);
+            if(pids[i] > 0)
+                running++;
+            else
+                delay = 1;
+        }
+
+        if(delay)
+            alarm(RESPAWN_DELAY);
+
+        sigsuspend(&old);
+    }
+
+    alarm(0);
+
+    /* Pass on the quit, and wait for them to finish up */
+    for(i = 0; i < g_state.processes; i++)
+    {
+        if(pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+
+    while(running > 0)
+    {
+        pid = waitpid(-1, &status, 0);
+        if(pid == -1 && errno == EINTR)
+            continue;
+        if(pid == -1)
+            break;
+
+        for(i = 0; i < g_state.processes; i++)
+        {
+            if(pids[i] == pid)
+            {
+                pids[i] = 0;
+                running--;
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+
+    free(pids);
+    free(started);
+}
+
+static int listen_socket()
+{
+    int sock;
+    int true = 1;
+
     /* Create the socket */
     sock = socket(SANY_TYPE(g_state.listenaddr), SOCK_STREAM, 0);
     if(sock < 0)
@@ -353,9 +930,14 @@ int sp_run(const char* configfile, const char* pidfile, int dbg_level)
     fcntl(sock, F_SETFD, fcntl(sock, F_GETFD, 0) | FD_CLOEXEC);
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&true, sizeof(true));
 
-    /* Unlink the socket file if it exists */
-    if(SANY_TYPE(g_state.listenaddr) == AF_UNIX)
-        unlink(g_state.listenname);
+#ifdef SO_REUSEPORT
+    if(g_state.acceptors > 1 &&
+       setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&true, sizeof(true)) < 0)
+    {
+        sp_message(NULL, LOG_CRIT, "couldn't share listening socket");
+        exit(1);
+    }
+#endif
 
 #ifdef HAVE_IP_TRANSPARENT
     if(g_state.transparent == TRANSPARENT_FULL)
@@ -388,19 +970,7 @@ int sp_run(const char* configfile, const char* pidfile, int dbg_level)
         exit(1);
     }
 
-    pid_file(1);
-
-    sp_messagex(NULL, LOG_DEBUG, "accepting connections");
-
-    connection_loop(sock);
-
-    pid_file(0);
-
-    /* Our listen socket */
-    close(sock);
-
-    sp_messagex(NULL, LOG_DEBUG, "stopped processing");
-    return 0;
+    return sock;
 }
 
 void sp_quit()
@@ -423,6 +993,8 @@ void sp_done()
     if(g_state._p)
         free(g_state._p);
 
+    free(g_state.trace_clients);
+
     memset(&g_state, 0, sizeof(g_state));
 }
 
@@ -431,6 +1003,16 @@ static void on_quit(int signal)
     g_state.quit = 1;
 }
 
+static void on_stats(int signal)
+{
+    g_state.stats = 1;
+}
+
+static void on_trace(int signal)
+{
+    g_state.trace_dump++;
+}
+
 static void drop_privileges()
 {
 	char* t;
@@ -534,142 +1116,186 @@ static void pid_file(int write)
     }
 }
 
-static void connection_loop(int sock)
+/* Returns -1 when the acceptor should stop */
+static int accept_failed(spacceptor_t* acc)
 {
-    spthread_t* threads = NULL;
-    int fd, i, x, r;
+    /* Other acceptors are woken by shutting down their socket */
+    if(sp_is_quit())
+        return -1;
 
-    /* Create the thread buffers */
-    threads = (spthread_t*)calloc(g_state.max_threads, sizeof(spthread_t));
-    if(!threads)
+    switch(errno)
     {
-        sp_messagex(NULL, LOG_CRIT, "out of memory");
-        return;
-    }
+    case EINTR:
+    case EAGAIN:
+        break;
 
-    /* Now loop and accept the connections */
-    while(!sp_is_quit())
-    {
-        fd = accept(sock, NULL, NULL);
-        if(fd == -1)
-        {
-            switch(errno)
-            {
-            case EINTR:
-            case EAGAIN:
-                break;
+    case ECONNABORTED:
+        sp_message(NULL, LOG_ERR, "couldn't accept a connection");
+        break;
 
-            case ECONNABORTED:
-                sp_message(NULL, LOG_ERR, "couldn't accept a connection");
-                break;
+    default:
+        sp_message(NULL, LOG_ERR, "couldn't accept a connection");
+        break;
+    };
 
-            default:
-                sp_message(NULL, LOG_ERR, "couldn't accept a connection");
-                break;
-            };
+    return sp_is_quit() ? -1 : 0;
+}
 
-            if(sp_is_quit())
-                break;
+static void accepted(spacceptor_t* acc, int fd)
+{
+#ifndef HAVE_ACCEPT4
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+#endif
 
-            continue;
-        }
+    /* Hand it off to a worker or an event loop */
+    session_start(acc, fd);
+}
 
-        /* Set timeouts on client */
-        if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &(g_state.timeout), sizeof(g_state.timeout)) < 0 ||
-           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &(g_state.timeout), sizeof(g_state.timeout)) < 0)
-            sp_message(NULL, LOG_DEBUG, "couldn't set timeouts on incoming connection");
+/* Every now and then, and for SIGUSR1 */
+static int accept_timeout(spacceptor_t* acc)
+{
+    if(acc->index == 0 && g_state.stats)
+    {
+        g_state.stats = 0;
+        log_stats();
+    }
 
-        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+    /* Wake up now and then to turn away connections that waited too long */
+    return pending_expire(0);
+}
 
-        /* Look for thread and also clean up others */
-        for(i = 0; i < g_state.max_threads; i++)
+#ifdef HAVE_IO_URING
+
+/*
+ * One request on the ring accepts connections as they come, until the
+ * kernel stops it. Returns -1 if the ring can't accept at all.
+ */
+static int uring_connection_loop(spacceptor_t* acc, spuring_t* ring)
+{
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    unsigned int flags;
+    int accepting = 0;
+    int any = 0;
+    int res;
+
+    while(!sp_is_quit())
+    {
+        if(!accepting)
         {
-            /* Find a thread to run or clean up old threads */
-            if(threads[i].tid != 0)
-            {
-                sp_lock();
-                    x = threads[i].fd;
-                sp_unlock();
+            sqe = spuring_get(ring);
+            if(!sqe)
+                return -1;
+
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = acc->sock;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = 1;
+            accepting = 1;
+        }
 
-                if(x == -1)
-                {
-                    sp_messagex(NULL, LOG_DEBUG, "cleaning up completed thread");
-                    pthread_join(threads[i].tid, NULL);
-                    threads[i].tid = 0;
-                }
-#ifdef _DEBUG
-                else
-                {
-                    /* For debugging connection problems: */
-                    sp_messagex(NULL, LOG_DEBUG, "active connection thread: %x", (int)threads[i].tid);
-                }
-#endif
-            }
+        if(spuring_wait(ring, accept_timeout(acc)) == -1 && errno != EINTR)
+            return -1;
 
-            /* Start a new thread if neccessary */
-            if(fd != -1 && threads[i].tid == 0)
-            {
-                threads[i].fd = fd;
-                r = pthread_create(&(threads[i].tid), NULL, thread_main,
-                                   (void*)(threads + i));
-                if(r != 0)
-                {
-                    errno = r;
-                    sp_message(NULL, LOG_ERR, "couldn't create thread");
-
-                    write(fd, SMTP_STARTFAILED, KL(SMTP_STARTFAILED));
-                    shutdown(fd, SHUT_RDWR);
-                    close(fd);
-                    fd = -1;
-                    break;
-                }
+        while((cqe = spuring_peek(ring)) != NULL)
+        {
+            res = cqe->res;
+            flags = cqe->flags;
+            spuring_seen(ring);
 
-                sp_messagex(NULL, LOG_DEBUG, "created thread for connection");
-                fd = -1;
-                break;
+            if(!(flags & IORING_CQE_F_MORE))
+                accepting = 0;
+
+            if(res >= 0)
+            {
+                any = 1;
+                accepted(acc, res);
+                continue;
             }
-        }
 
-        /* Check to make sure we have a thread */
-        if(fd != -1)
-        {
-            sp_messagex(NULL, LOG_ERR, "too many connections open (max %d). sent busy response", g_state.max_threads);
-            write(fd, SMTP_STARTBUSY, KL(SMTP_STARTBUSY));
-            shutdown(fd, SHUT_RDWR);
-            close(fd);
-            fd = -1;
+            /* Kernel can't do multishot accept */
+            if(!any && res == -EINVAL && !sp_is_quit())
+                return -1;
+
+            errno = -res;
+            if(accept_failed(acc) == -1)
+                return 0;
         }
     }
 
-    sp_messagex(NULL, LOG_DEBUG, "waiting for threads to quit");
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+static void connection_loop(spacceptor_t* acc)
+{
+    struct pollfd pfd;
+    int fd, r;
+
+#ifdef HAVE_IO_URING
+    spuring_t* ring;
 
-    /* Quit all threads here */
-    for(i = 0; i < g_state.max_threads; i++)
+    if(g_state.io_uring)
     {
-        /* Clean up quit threads */
-        if(threads[i].tid != 0)
-        {
-            if(threads[i].fd != -1)
-            {
-                sp_lock();
-                    fd = threads[i].fd;
-                    threads[i].fd = -1;
-                sp_unlock();
+        ring = spuring_new(64);
+        r = ring ? uring_connection_loop(acc, ring) : -1;
+        spuring_free(ring);
 
-                shutdown(fd, SHUT_RDWR);
-                close(fd);
-            }
+        if(r == 0)
+            return;
+
+        sp_messagex(NULL, LOG_WARNING, "couldn't accept with io_uring, using poll instead");
+    }
+#endif
+
+    /* Now loop and accept the connections */
+    while(!sp_is_quit())
+    {
+        pfd.fd = acc->sock;
+        pfd.events = POLLIN;
+        r = poll(&pfd, 1, accept_timeout(acc));
+
+        if(r <= 0)
+            continue;
 
-            sp_messagex(NULL, LOG_DEBUG, "cleaning up completed thread");
-            pthread_join(threads[i].tid, NULL);
-            threads[i].tid = 0;
+#ifdef HAVE_ACCEPT4
+        fd = accept4(acc->sock, NULL, NULL, SOCK_CLOEXEC);
+#else
+        fd = accept(acc->sock, NULL, NULL);
+#endif
+        if(fd == -1)
+        {
+            if(accept_failed(acc) == -1)
+                break;
+            continue;
         }
+
+        accepted(acc, fd);
     }
+}
 
-    free(threads);
+static void* acceptor_main(void* arg)
+{
+    spacceptor_t* acc = (spacceptor_t*)arg;
+    sigset_t set;
+
+    /* Leave the signals to the main thread, which wakes us up */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    sp_messagex(NULL, LOG_DEBUG, "accepting connections on acceptor %d", acc->index);
+    spcpu_pin(acc->index);
+    connection_loop(acc);
+    return NULL;
 }
 
-static spctx_t* init_thread(int fd)
+static spctx_t* init_thread(spsession_t* sess)
 {
     spctx_t* ctx;
 
@@ -680,24 +1306,29 @@ static spctx_t* init_thread(int fd)
 
         spio_init(&(ctx->server), "SERVER");
         spio_init(&(ctx->client), "CLIENT");
+        spscan_init(&(ctx->_scan), 0, 1);
+        ctx->_pipe = &(sess->pipe);
 
-        sp_lock();
-            /* Assign a unique id to the connection */
-            ctx->id = g_unique_id++;
-
-            /* We don't care about wraps, but we don't want zero */
-            if(g_unique_id == 0)
-                g_unique_id++;
-        sp_unlock();
+        /* Assign a unique id to the connection. We don't care about
+         * wraps, but we don't want zero */
+        do
+            ctx->id = atomic_add(&g_unique_id, 1) - 1;
+        while(ctx->id == 0);
 
-        sp_messagex(ctx, LOG_DEBUG, "processing %d on thread %x", fd, (int)pthread_self());
+        sp_messagex(ctx, LOG_DEBUG, "processing %d on thread %x", sess->fd, (int)pthread_self());
 
         /* Connect to the outgoing server ... */
-        if(make_connections(ctx, fd) == -1)
+        if(make_connections(ctx, sess->fd) == -1)
         {
+            spio_free(&(ctx->client));
+            spio_free(&(ctx->server));
             cb_del_context(ctx);
             ctx = NULL;
         }
+        else
+        {
+            trace_start(ctx);
+        }
     }
 
     return ctx;
@@ -707,17 +1338,7 @@ static void cleanup_context(spctx_t* ctx)
 {
     ASSERT(ctx);
 
-    if(ctx->cachefile)
-    {
-        fclose(ctx->cachefile);
-        ctx->cachefile = NULL;
-    }
-
-    if(ctx->cachename[0])
-    {
-        unlink(ctx->cachename);
-        ctx->cachename[0] = 0;
-    }
+    drop_cache(ctx);
 
     if(ctx->helo)
     {
@@ -749,8 +1370,21 @@ static void cleanup_context(spctx_t* ctx)
     	ctx->xforwardhelo = NULL;
     }
 
+    ctx->_chunkfail = NULL;
+
+    if(ctx->_chunks)
+    {
+        if(ctx->_chunks->spool)
+        {
+            spspool_close(ctx->_chunks->spool);
+            free(ctx->_chunks->spool);
+        }
+        free(ctx->_chunks);
+        ctx->_chunks = NULL;
+    }
+
     ctx->logline[0] = 0;
-    sp_add_log(ctx, "client=", ctx->client.peername);
+    sp_add_log(ctx, "client=", spio_peername(&(ctx->client)));
 }
 
 
@@ -763,40 +1397,48 @@ static void done_thread(spctx_t* ctx)
 
     /* Clean up file stuff */
     cleanup_context(ctx);
+
+    if(ctx->_spare)
+    {
+        spspool_close(ctx->_spare);
+        free(ctx->_spare);
+        ctx->_spare = NULL;
+    }
+
+    spio_free(&(ctx->client));
+    spio_free(&(ctx->server));
+    sptrace_free(ctx->trace);
     cb_del_context(ctx);
 }
 
-static void* thread_main(void* arg)
+/* A whole connection on a worker thread */
+static void session_thread(spwork_t* work)
 {
-    spthread_t* thread = (spthread_t*)arg;
+    spsession_t* sess = (spsession_t*)work->arg;
     spctx_t* ctx = NULL;
     int processing = 0;
     int ret = 0;
-    int fd;
 
-    ASSERT(thread);
+    ASSERT(sess);
 
     siginterrupt(SIGINT, 1);
     siginterrupt(SIGTERM, 1);
 
-    sp_lock();
-        /* Get the client socket */
-        fd = thread->fd;
-    sp_unlock();
-
     /* Sometimes we get to this point and then quit is noted */
-    if(sp_is_quit() || (ctx = init_thread(fd)) == NULL)
+    if(sp_is_quit() || (ctx = init_thread(sess)) == NULL)
     {
         /* Special case. We don't have a context so clean up descriptor */
-        close(fd);
+        close(sess->fd);
 
         /* new_context() should have already logged reason */
         RETURN(-1);
     }
 
     /* call the processor */
+    sess->ctx = ctx;
+
     processing = 1;
-    ret = smtp_passthru(ctx);
+    ret = smtp_passthru(sess);
 
 cleanup:
 
@@ -809,12 +1451,15 @@ cleanup:
         done_thread(ctx);
     }
 
-    /* mark this as done */
-    sp_lock();
-        thread->fd = -1;
-    sp_unlock();
+    session_free(sess);
+}
+
+static void resolve_outaddr(void* arg)
+{
+    spresolve_t* res = (spresolve_t*)arg;
 
-    return (void*)(ret == 0 ? (size_t)0 : (size_t)1);
+    res->naddrs = sock_any_pton_all(g_state.outname, res->addrs, res->naddrs,
+                                    SANY_OPT_DEFPORT(25));
 }
 
 static int make_connections(spctx_t* ctx, int client)
@@ -822,8 +1467,11 @@ static int make_connections(spctx_t* ctx, int client)
     struct sockaddr_any peeraddr;
     struct sockaddr_any peersrc;
     struct sockaddr_any addr;
+    struct sockaddr_any addrs[SP_CONNECT_MAX];
+    spresolve_t res;
     struct sockaddr_any* dstaddr;
     struct sockaddr_any* srcaddr;
+    int ndst = 1;
     char buf[MAXPATHLEN];
     const char* dstname;
     const char* srcname;
@@ -837,7 +1485,7 @@ static int make_connections(spctx_t* ctx, int client)
 
     /* Setup the incoming connection. This also fills in peeraddr for us */
     spio_attach(ctx, &(ctx->client), client, &peeraddr);
-    sp_messagex(ctx, LOG_INFO, "accepted connection from: %s", ctx->client.peername);
+    sp_messagex(ctx, LOG_INFO, "accepted connection from: %s", spio_peername(&(ctx->client)));
 
     /* Create the server connection address */
     dstaddr = &(g_state.outaddr);
@@ -916,7 +1564,7 @@ static int make_connections(spctx_t* ctx, int client)
 #if defined(HAVE_IP_TRANSPARENT) || defined(HAVE_IP_BINDANY)
         sock_any_cpy (&peersrc, &peeraddr, SANY_OPT_NOPORT);
         srcaddr = &peersrc;
-        srcname = ctx->client.peername;
+        srcname = spio_peername(&(ctx->client));
 #endif
     }
 
@@ -943,17 +1591,30 @@ static int make_connections(spctx_t* ctx, int client)
 #endif
 
     /* Not transparent proxy or loopback */
-    else
+    else if(dstaddr == &(g_state.outaddr))
     {
-        /* Resolve any DNS name again */
-        if(sock_any_pton(g_state.outname, &addr, SANY_OPT_DEFPORT(25)) != -1)
-            memcpy(&(g_state.outaddr), &addr, sizeof(g_state.outaddr));
+        /*
+         * Resolve any DNS name again, it may have several addresses. That
+         * can block for a while, so not on an event loop thread.
+         */
+        res.addrs = addrs;
+        res.naddrs = SP_CONNECT_MAX;
+        sp_call(resolve_outaddr, &res);
+
+        ndst = res.naddrs;
+        if(ndst > 0)
+        {
+            dstaddr = addrs;
+        }
         else
+        {
             sp_messagex(ctx, LOG_WARNING, "couldn't resolve " CFG_OUTADDR ": %s", g_state.outname);
+            ndst = 1;
+        }
     }
 
     /* Reparse name if needed */
-    if(dstaddr != &(g_state.outaddr))
+    if(dstaddr == &addr)
     {
         if(sock_any_ntop(dstaddr, buf, MAXPATHLEN, 0) != -1)
             dstname = buf;
@@ -962,7 +1623,7 @@ static int make_connections(spctx_t* ctx, int client)
     }
 
     /* Connect to the server */
-    if(spio_connect(ctx, &(ctx->server), dstaddr, dstname, srcaddr, srcname) == -1)
+    if(spio_connect(ctx, &(ctx->server), dstaddr, ndst, dstname, srcaddr, srcname) == -1)
         return -1;
 
     return 0;
@@ -982,413 +1643,1589 @@ static int should_skip_processing(spctx_t* ctx)
 	return 0;
 }
 
-static int smtp_passthru(spctx_t* ctx)
+#define C_LINE  ctx->client.line
+#define S_LINE  ctx->server.line
+
+/*
+ * With PIPELINING a client sends several commands without waiting. They're
+ * passed on to the server straight away, and noted here so each response
+ * can be matched up with the command it's for. Replies we make ourselves
+ * wait their turn behind the commands sent before them.
+ */
+
+static void pipeline_shift(sppipeline_t* pipe)
+{
+    free(pipe->cmds[pipe->head].line);
+    pipe->cmds[pipe->head].line = NULL;
+    pipe->head = (pipe->head + 1) % PIPELINE_MAX;
+    pipe->count--;
+}
+
+static int pipeline_push(spctx_t* ctx, const char* line, int local)
 {
-    char* t;
-    const char* p;
-    int r, cont, ret = 0;
-    unsigned int mask;
-    int neterror = 0;
+    sppipeline_t* pipe = ctx->_pipe;
+    spcommand_t* cmd;
+
+    ASSERT(pipe->count < PIPELINE_MAX);
 
-    int first_rsp = 1;      /* The first 220 response from server to be filtered */
-    char* helo = NULL;
-    int filter_host = 0;    /* Next response is 250 hostname, which we change */
-    int auth_started = 0;   /* Started performing authentication */
+    cmd = &(pipe->cmds[(pipe->head + pipe->count) % PIPELINE_MAX]);
+    cmd->line = strdup(line);
+    if(!cmd->line)
+    {
+        sp_messagex(ctx, LOG_CRIT, "out of memory");
+        return -1;
+    }
 
-    /* XCLIENT is for use in access control */
-    int xclient_sup = 0;    /* Is XCLIENT supported? */
-    int xclient_sent = 0;   /* Have we sent an XCLIENT command? */
+    cmd->local = local;
+    pipe->count++;
+    return 0;
+}
 
-    ASSERT(spio_valid(&(ctx->client)) &&
-           spio_valid(&(ctx->server)));
+/* The oldest command has its whole response. Returns -1 on failure */
+static int pipeline_pop(spctx_t* ctx)
+{
+    sppipeline_t* pipe = ctx->_pipe;
+    int ret = 0;
 
-    #define C_LINE  ctx->client.line
-    #define S_LINE  ctx->server.line
+    pipeline_shift(pipe);
+    pipe->lines = 0;
 
-    while(!sp_is_quit())
+    /* Our own replies that were waiting on it */
+    while(pipe->count > 0 && pipe->cmds[pipe->head].local)
     {
-        mask = spio_select(ctx);
+        if(ret == 0 && spio_write_data(ctx, &(ctx->client), pipe->cmds[pipe->head].line) == -1)
+            ret = -1;
+        pipeline_shift(pipe);
+    }
 
-        if(mask == ~0)
-        {
-            neterror = 1;
-            RETURN(-1);
-		}
+    return ret;
+}
 
-        /* Client has data available, read a line and process */
-        if(mask & 1)
+static void pipeline_clear(sppipeline_t* pipe)
+{
+    while(pipe->count > 0)
+        pipeline_shift(pipe);
+    pipe->lines = 0;
+}
+
+/* Whether a HELO or EHLO is still waiting on its response */
+static int pipeline_hello(sppipeline_t* pipe)
+{
+    spcommand_t* cmd;
+    int i;
+
+    for(i = 0; i < pipe->count; i++)
+    {
+        cmd = &(pipe->cmds[(pipe->head + i) % PIPELINE_MAX]);
+        if(!cmd->local && (is_first_word(cmd->line, EHLO_CMD, KL(EHLO_CMD)) ||
+                           is_first_word(cmd->line, HELO_CMD, KL(HELO_CMD))))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Reply to the client ourselves, once it has the responses it's waiting on */
+static int reply_client(spctx_t* ctx, const char* rsp)
+{
+    if(ctx->_pipe && ctx->_pipe->count > 0)
+        return pipeline_push(ctx, rsp, 1);
+
+    return spio_write_data(ctx, &(ctx->client), rsp);
+}
+
+/* Whether the last line of a response */
+static int is_last_rsp(const char* line)
+{
+    return strlen(line) < 4 || line[3] != '-';
+}
+
+/*
+ * Whether the responses to what the client sent earlier have to be handled
+ * before the line it just sent. Only a few commands are a point where the
+ * client waits for them, the rest are passed on without waiting.
+ */
+static int passthru_must_drain(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
+    sppipeline_t* pipe = &(sess->pipe);
+
+    if(pipe->count == 0)
+        return 0;
+
+    /* DATA always comes last, and the data may be looked at before the server sees it */
+    if(is_first_word(C_LINE, DATA_CMD, KL(DATA_CMD)) ||
+       is_first_word(C_LINE, BDAT_CMD, KL(BDAT_CMD)))
+        return 1;
+
+    /* The server might yet tell us it wants XCLIENT */
+    if(g_state.xclient && !sess->xclient_sent && pipeline_hello(pipe))
+        return 1;
+
+    return pipe->count >= PIPELINE_MAX;
+}
+
+/* Handle the server's responses to everything sent so far. Only off the event loop */
+static int passthru_drain(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
+    int r;
+
+    while(sess->pipe.count > 0)
+    {
+        if((r = spio_read_line(ctx, &(ctx->server), SPIO_DISCARD)) == -1)
+            return -1;
+
+        if(r == 0)
         {
-            if((r = spio_read_line(ctx, &(ctx->client), SPIO_DISCARD)) == -1)
-                RETURN(-1);
+            sp_messagex(ctx, LOG_ERR, "server disconnected unexpectedly");
+            return -1;
+        }
 
-            /* Client disconnected, we're done */
-            if(r == 0)
-                RETURN(0);
+        if(passthru_server_line(sess, r) == -1)
+            return -1;
+    }
 
-            /* We don't let clients send really long lines */
-            if(LINE_TOO_LONG(r))
-            {
-                if(spio_write_data(ctx, &(ctx->client), SMTP_TOOLONG) == -1)
-                    RETURN(-1);
+    return 0;
+}
 
-                continue;
-            }
+/*
+ * Whether handling the line the client just sent needs a synchronous
+ * exchange with the server or a filter. These are run off the event loop.
+ */
+static int passthru_will_block(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
 
-            /* Only valid after EHLO or HELO commands */
-            filter_host = 0;
+    if(passthru_must_drain(sess))
+        return 1;
 
-            /*
-             * At this point we may want to send our XCLIENT. This is a per
-             * connection command.
-             */
-            if(xclient_sup && !xclient_sent && g_state.xclient)
-            {
-                sp_messagex(ctx, LOG_DEBUG, "sending XCLIENT");
+    /* We'll send our XCLIENT and wait for the response */
+    if(sess->xclient_sup && !sess->xclient_sent && g_state.xclient)
+        return 1;
+
+    return is_first_word(C_LINE, DATA_CMD, KL(DATA_CMD)) ||
+           is_first_word(C_LINE, BDAT_CMD, KL(BDAT_CMD));
+}
+
+/*
+ * With BDAT the client gives the length of each chunk up front. The chunks
+ * are read into the cache file as they are, without looking for lines or
+ * dots, and the last one sends the message through the filter like DATA.
+ */
+static int passthru_chunk(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
+    spchunks_t* chunks;
+    unsigned long long len;
+    const char* data;
+    char* p;
+    int discard, full, last = 0;
+    int r;
 
-                if(spio_write_dataf(ctx, &(ctx->server), SMTP_XCLIENT, ctx->client.peername) == -1)
-                    RETURN(-1);
+    /* BDAT <size> [LAST] */
+    p = trim_start(C_LINE + KL(BDAT_CMD));
+    if(!isdigit(*p))
+        p = NULL;
+    else
+    {
+        errno = 0;
+        len = strtoull(p, &p, 10);
+        if(errno != 0)
+            p = NULL;
+        else if((r = check_first_word(p = trim_start(p), BDAT_LAST, KL(BDAT_LAST), SMTP_DELIMS)) > 0)
+        {
+            last = 1;
+            p += r;
+        }
+    }
 
-                if(read_server_response(ctx) == -1)
-                    RETURN(-1);
+    /* Without the length there's no telling where the chunk ends */
+    if(!p || *p)
+    {
+        sp_messagex(ctx, LOG_DEBUG, "couldn't parse BDAT command");
+        return spio_write_data(ctx, &(ctx->client), SMTP_BADCHUNK);
+    }
 
-                if(!get_successful_rsp(S_LINE, NULL))
-                    sp_messagex(ctx, LOG_WARNING, "server didn't accept XCLIENT");
+    /*
+     * The chunk is read whatever happens, but only kept when there's
+     * somewhere to send it. Once a chunk is refused, the ones a client
+     * pipelined after it are refused too (RFC 3030).
+     */
+    discard = ctx->_chunkfail || (!should_skip_processing(ctx) && !ctx->recipients);
 
-                xclient_sent = 1;
-            }
+    /* A message that hasn't started isn't taken in past the hard limit, as with DATA */
+    full = !discard && !ctx->_chunks && spspool_full();
 
-            /* Handle the DATA section via our AV checker */
-            if(is_first_word(C_LINE, DATA_CMD, KL(DATA_CMD)))
-            {
-                if(should_skip_processing (ctx))
-                {
-                    if(sp_pass_data(ctx) < 0)
-                        RETURN(-1);
-                }
-                else
-                {
-                    /*
-                     * Now go into scan mode. This also handles the eventual
-                     * sending of the data to the server, making the av check
-                     * transparent
-                     */
-		    if (helo) ctx->helo = strdup(helo);
-                    if(cb_check_data(ctx) == -1)
-                        RETURN(-1);
-                }
+    if(!discard && !full && !ctx->_chunks)
+    {
+        ctx->_chunks = (spchunks_t*)malloc(sizeof(spchunks_t));
+        if(!ctx->_chunks)
+        {
+            sp_messagex(ctx, LOG_CRIT, "out of memory");
+            return -1;
+        }
 
-                /* Print the log out for this email */
-                sp_messagex(ctx, LOG_INFO, "%s", ctx->logline);
+        ctx->_chunks->size = 0;
+        ctx->_chunks->tail = 0;
+        ctx->_chunks->spool = NULL;
+        ctx->_chunks->off = 0;
+    }
 
-                /* Done with that email */
-                cleanup_context(ctx);
+    chunks = ctx->_chunks;
 
-                /* Command handled */
-                continue;
-            }
+    /* Big reads while the data comes in */
+    if(len > 0 && spio_reserve(ctx, &(ctx->client), SP_DATA_LENGTH) == -1)
+        return -1;
 
-            /*
-             * We need our response to HELO and EHLO to be modified in order
-             * to prevent complaints about mail loops
-             */
-            else if(is_first_word(C_LINE, EHLO_CMD, KL(EHLO_CMD)))
-            {
-                free(helo);
-                char* _helo = helo = strdup(trim_start(C_LINE + KL(EHLO_CMD)));
-                strsep(&_helo, "\r\n\t ");
+    while(len > 0)
+    {
+        r = spio_read_count(ctx, &(ctx->client), min(len, SP_DATA_LENGTH), &data);
+        if(r < 0)
+            return -1;  /* Message already printed */
 
-                /* EHLO can have multline responses so we set a flag */
-                filter_host = 1;
-            }
+        len -= r;
+        if(discard || full)
+            continue;
 
-            /*
-             * We always support XCLIENT on a HELO type connection. We do this
-             * for security reasons, so that a client can't get around filtering
-             * by backing up one on the protocol.
-             */
-            else if(is_first_word(C_LINE, HELO_CMD, KL(HELO_CMD)))
-            {
-                free(helo);
-                char* _helo = helo = strdup(trim_start(C_LINE + KL(HELO_CMD)));
-                strsep(&_helo, "\r\n\t ");
+        /*
+         * Kept as it came, so a chunk may hold what looks like the end of
+         * data. Whatever sends the cache on with DATA stuffs it first.
+         */
+        if(sp_write_data(ctx, data, r) < 0)
+            return -1;  /* Message already printed */
 
-                sp_messagex(ctx, LOG_DEBUG, "XCLIENT support assumed");
-                xclient_sup = 1;
+        chunks->size += r;
+        if(r >= 2)
+            chunks->tail = ((unsigned char)data[r - 2] << 8) | (unsigned char)data[r - 1];
+        else
+            chunks->tail = ((chunks->tail << 8) | (unsigned char)data[0]) & 0xFFFF;
 
-                /* Filter host as with EHLO above */
-                filter_host = 1;
-            }
+        /* See sp_read_data_block */
+        if(g_state.keepalives > 0 &&
+           ctx->server.last_action + g_state.keepalives * 1000ULL < ctx->client.last_action)
+            do_server_noop(ctx);
+    }
 
-            /*
-             * We don't like these commands. Filter them out. We should have
-             * filtered out their service extensions earlier in the EHLO response.
-             * This is just for errant clients.
-             */
-            else if(is_first_word(C_LINE, STARTTLS_CMD, KL(STARTTLS_CMD)) ||
-                    is_first_word(C_LINE, BDAT_CMD, KL(BDAT_CMD)))
-            {
-                sp_messagex(ctx, LOG_DEBUG, "ESMTP feature not supported");
+    spio_compact(&(ctx->client));
 
-                if(spio_write_data(ctx, &(ctx->client), SMTP_NOTSUPP) == -1)
-                    RETURN(-1);
+    if(ctx->_chunkfail)
+    {
+        sp_messagex(ctx, LOG_DEBUG, "discarded chunk of a failed message");
+        return spio_write_data(ctx, &(ctx->client), ctx->_chunkfail);
+    }
 
-                /* Command handled */
-                continue;
-            }
+    if(discard)
+    {
+        sp_messagex(ctx, LOG_DEBUG, "no valid recipients for data");
+        ctx->_chunkfail = SMTP_NORCPT;
+        return spio_write_data(ctx, &(ctx->client), SMTP_NORCPT);
+    }
 
-            /*
-             * For security reasons we're not about to forward any XCLIENTs
-             * from our client through. This could lead to a client using our
-             * privileged IP address to change an audit trail or relay etc...
-             */
-            else if(is_first_word(C_LINE, XCLIENT_CMD, KL(XCLIENT_CMD)))
-            {
-                sp_messagex(ctx, LOG_WARNING, "client attempted use of privileged XCLIENT feature");
+    if(full)
+    {
+        sp_messagex(ctx, LOG_WARNING, "spool is full, refusing data");
+        atomic_add(&g_spoolfull, 1);
+        ctx->_chunkfail = SMTP_SPOOLFULL;
+        return spio_write_data(ctx, &(ctx->client), SMTP_SPOOLFULL);
+    }
 
-                if(spio_write_data(ctx, &(ctx->client), SMTP_NOTAUTH) == -1)
-                    RETURN(-1);
+    if(!last)
+        return spio_write_dataf(ctx, &(ctx->client), SMTP_CHUNKED, chunks->size);
 
-                /* Command handled */
-                continue;
-            }
+    /* The message has to end with a line, as it would have with DATA */
+    if(chunks->size > 0 && chunks->tail != ('\r' << 8 | '\n'))
+    {
+        if(sp_write_data(ctx, CRLF, KL(CRLF)) < 0)
+            return -1;
+        chunks->size += KL(CRLF);
+    }
+
+    /* Even an empty message has a cache file */
+    if(sp_write_data(ctx, "", 0) < 0 || sp_write_data(ctx, NULL, 0) < 0)
+        return -1;
+
+    /*
+     * A pipe filter writes what it sends back into a new cache, so the
+     * message is read back from this one, which is kept until the end.
+     */
+    chunks->spool = ctx->_spool;
+    sp_messagex(ctx, LOG_DEBUG, "received %llu bytes with BDAT", chunks->size);
+
+    if(should_skip_processing(ctx))
+    {
+        if(sp_done_data(ctx, NULL) < 0)
+            return -1;
+
+        sp_add_log(ctx, "status=", "SKIPPED");
+    }
+    else
+    {
+        if (sess->helo) ctx->helo = strdup(sess->helo);
+        if(cb_check_data(ctx) == -1)
+            return -1;
+    }
+
+    /* Print the log out for this email */
+    sp_messagex(ctx, LOG_INFO, "%s", ctx->logline);
+
+    /* Done with that email */
+    cleanup_context(ctx);
+
+    /* Command handled */
+    return 0;
+}
+
+/* Process a line that was read from the client. Returns -1 on failure */
+static int passthru_client_line(spsession_t* sess, int r)
+{
+    spctx_t* ctx = sess->ctx;
+    char* _helo;
+    int pipelined;
+
+    /* We don't let clients send really long lines */
+    if(LINE_TOO_LONG(r))
+    {
+        if(reply_client(ctx, SMTP_TOOLONG) == -1)
+            return -1;
+
+        return 0;
+    }
+
+    /* Sent before the client had the responses to what came before it */
+    pipelined = sess->pipe.count > 0;
+
+    /* Catch up with the server, when this line has to wait on it */
+    if(passthru_must_drain(sess) && passthru_drain(sess) == -1)
+        return -1;
+
+    /*
+     * At this point we may want to send our XCLIENT. This is a per
+     * connection command.
+     */
+    if(sess->xclient_sup && !sess->xclient_sent && g_state.xclient)
+    {
+        sp_messagex(ctx, LOG_DEBUG, "sending XCLIENT");
+
+        if(spio_write_dataf(ctx, &(ctx->server), SMTP_XCLIENT, spio_peername(&(ctx->client))) == -1)
+            return -1;
+
+        if(read_server_response(ctx) == -1)
+            return -1;
+
+        if(!get_successful_rsp(S_LINE, NULL))
+            sp_messagex(ctx, LOG_WARNING, "server didn't accept XCLIENT");
+
+        sess->xclient_sent = 1;
+    }
+
+    /* A new transaction, so a failed chunked one is over. See passthru_chunk */
+    if(ctx->_chunkfail &&
+       (is_first_word(C_LINE, RSET_CMD, KL(RSET_CMD)) ||
+        is_first_word(C_LINE, EHLO_CMD, KL(EHLO_CMD)) ||
+        is_first_word(C_LINE, HELO_CMD, KL(HELO_CMD)) ||
+        check_first_word(C_LINE, FROM_CMD, KL(FROM_CMD), SMTP_DELIMS) > 0))
+        ctx->_chunkfail = NULL;
+
+    /* Handle the DATA section via our AV checker */
+    if(is_first_word(C_LINE, DATA_CMD, KL(DATA_CMD)))
+    {
+        if(should_skip_processing (ctx))
+        {
+            if(sp_pass_data(ctx) < 0)
+                return -1;
+        }
+        /*
+         * A pipelining client sends DATA before it knows all recipients
+         * failed, and would follow a 354 with the message (RFC 2920).
+         */
+        else if(pipelined && !ctx->recipients)
+        {
+            sp_messagex(ctx, LOG_DEBUG, "no valid recipients for data");
+
+            if(spio_write_data(ctx, &(ctx->client), SMTP_NORCPT) == -1)
+                return -1;
+
+            /* Command handled */
+            return 0;
+        }
+
+        /* Past the hard limit no more messages are taken in, until others are done */
+        else if(spspool_full())
+        {
+            sp_messagex(ctx, LOG_WARNING, "spool is full, refusing data");
+            atomic_add(&g_spoolfull, 1);
+
+            if(spio_write_data(ctx, &(ctx->client), SMTP_SPOOLFULL) == -1)
+                return -1;
+
+            /* Command handled */
+            return 0;
+        }
+
+        else
+        {
+            /*
+             * Now go into scan mode. This also handles the eventual
+             * sending of the data to the server, making the av check
+             * transparent
+             */
+            if (sess->helo) ctx->helo = strdup(sess->helo);
+            if(cb_check_data(ctx) == -1)
+                return -1;
+        }
+
+        /* Print the log out for this email */
+        sp_messagex(ctx, LOG_INFO, "%s", ctx->logline);
+
+        /* Done with that email */
+        cleanup_context(ctx);
+
+        /* Command handled */
+        return 0;
+    }
+
+    /* A chunk of the message, which is read here rather than passed on */
+    else if(is_first_word(C_LINE, BDAT_CMD, KL(BDAT_CMD)))
+    {
+        return passthru_chunk(sess);
+    }
+
+    /*
+     * We need our response to HELO and EHLO to be modified in order
+     * to prevent complaints about mail loops
+     */
+    else if(is_first_word(C_LINE, EHLO_CMD, KL(EHLO_CMD)))
+    {
+        free(sess->helo);
+        _helo = sess->helo = strdup(trim_start(C_LINE + KL(EHLO_CMD)));
+        strsep(&_helo, "\r\n\t ");
+    }
+
+    /*
+     * We always support XCLIENT on a HELO type connection. We do this
+     * for security reasons, so that a client can't get around filtering
+     * by backing up one on the protocol.
+     */
+    else if(is_first_word(C_LINE, HELO_CMD, KL(HELO_CMD)))
+    {
+        free(sess->helo);
+        _helo = sess->helo = strdup(trim_start(C_LINE + KL(HELO_CMD)));
+        strsep(&_helo, "\r\n\t ");
+
+        sp_messagex(ctx, LOG_DEBUG, "XCLIENT support assumed");
+        sess->xclient_sup = 1;
+    }
+
+    /*
+     * We don't like these commands. Filter them out. We should have
+     * filtered out their service extensions earlier in the EHLO response.
+     * This is just for errant clients.
+     */
+    else if(is_first_word(C_LINE, STARTTLS_CMD, KL(STARTTLS_CMD)))
+    {
+        sp_messagex(ctx, LOG_DEBUG, "ESMTP feature not supported");
+
+        if(reply_client(ctx, SMTP_NOTSUPP) == -1)
+            return -1;
+
+        /* Command handled */
+        return 0;
+    }
+
+    /*
+     * For security reasons we're not about to forward any XCLIENTs
+     * from our client through. This could lead to a client using our
+     * privileged IP address to change an audit trail or relay etc...
+     */
+    else if(is_first_word(C_LINE, XCLIENT_CMD, KL(XCLIENT_CMD)))
+    {
+        sp_messagex(ctx, LOG_WARNING, "client attempted use of privileged XCLIENT feature");
+
+        if(reply_client(ctx, SMTP_NOTAUTH) == -1)
+            return -1;
+
+        /* Command handled */
+        return 0;
+    }
+
+    else if(is_first_word(C_LINE, AUTH_CMD, KL(AUTH_CMD)))
+    {
+        sess->auth_started = 1;
+    }
+
+    else if(check_first_word(C_LINE, FROM_CMD, KL(FROM_CMD), SMTP_DELIMS) > 0 ||
+            check_first_word(C_LINE, TO_CMD, KL(TO_CMD), SMTP_DELIMS) > 0)
+    {
+        if(!should_skip_processing(ctx))
+        {
+            r = cb_check_pre(ctx);
+            if(r < 0)
+            {
+                return -1;
+            }
+            else if(r == 0)
+            {
+                cleanup_context(ctx);
+                return 0;
+            }
+        }
+    }
+
+    /* All other commands just get passed through to server */
+    if(pipeline_push(ctx, C_LINE, 0) == -1 ||
+       spio_write_data(ctx, &(ctx->server), C_LINE) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Process a line that was read from the server. Returns -1 on failure */
+static int passthru_server_line(spsession_t* sess, int r)
+{
+    spctx_t* ctx = sess->ctx;
+    sppipeline_t* pipe = &(sess->pipe);
+    char* cmd = "";
+    const char* p;
+    char* t;
+    int first, cont;
+    int ret = 0;
+
+    if(LINE_TOO_LONG(r))
+        sp_messagex(ctx, LOG_WARNING, "SMTP response line too long. discarded extra");
+
+    /*
+     * We intercept the first response we get from the server.
+     * This allows us to change header so that it doesn't look
+     * to the client server that we're in a wierd loop.
+     *
+     * In different situations using the local hostname or
+     * 'localhost' don't work because the receiving mail server
+     * expects one of those to be its own name. We use 'clamsmtp'
+     * instead. No properly configured server would have this
+     * as their domain name, and RFC 2821 allows us to use
+     * an arbitrary but identifying string.
+     */
+#if 0
+    /* Disable loopback protection, in order to be more transparent */
+    if(sess->first_rsp)
+    {
+        sess->first_rsp = 0;
+
+        if(is_first_word(S_LINE, START_RSP, KL(START_RSP)))
+        {
+            sp_messagex(ctx, LOG_DEBUG, "intercepting initial response");
+
+            if(spio_write_data(ctx, &(ctx->client), SMTP_BANNER) == -1)
+                return -1;
+
+            /* Command handled */
+            return 0;
+        }
+    }
+#endif
+
+    /* The response is for the oldest command waiting. The greeting isn't for any */
+    if(!sess->first_rsp && pipe->count > 0)
+        cmd = pipe->cmds[pipe->head].line;
+    first = (pipe->lines++ == 0);
+
+    if((p = get_successful_rsp(S_LINE, &cont)) != NULL)
+    {
+        /*
+         * Certain mail servers (Postfix 1.x in particular) do a loop check
+         * on the 250 response after a EHLO or HELO. This is where we
+         * filter that to prevent loopback errors.
+         */
+        if(first && (is_first_word(cmd, EHLO_CMD, KL(EHLO_CMD)) ||
+                     is_first_word(cmd, HELO_CMD, KL(HELO_CMD))))
+        {
+            /* Can have multi-line responses, and we want to be
+             * sure to only replace the first one. */
+            sp_messagex(ctx, LOG_DEBUG, "intercepting host response");
+
+#if 1
+            /* Send the line to the client */
+            if(spio_write_data(ctx, &(ctx->client), S_LINE) == -1)
+                RETURN(-1);
+#else
+            /* Disable loopback protection, in order to be more transparent */
+            if(spio_write_data(ctx, &(ctx->client),
+                   cont ? SMTP_EHLO_RSP : SMTP_HELO_RSP) == -1)
+                RETURN(-1);
+#endif
+
+            /* A new email so cleanup */
+            cleanup_context(ctx);
+            pipe->offered = 0;
+            ctx->_bdat = 0;
+
+            RETURN(0);
+        }
+
+        /*
+         * Filter out any EHLO responses that we can't or don't want
+         * to support. For example TLS.
+         */
+        if(is_first_word(cmd, EHLO_CMD, KL(EHLO_CMD)))
+        {
+            /*
+             * On ESMTP connections we let the server tell us whether it
+             * wants XCLIENTs or not. (In contrast to old SMTP above).
+             */
+            if(is_first_word(p, ESMTP_XCLIENT, KL(ESMTP_XCLIENT)))
+            {
+                sp_messagex(ctx, LOG_DEBUG, "XCLIENT supported");
+                sess->xclient_sup = 1;
+            }
+
+            /* Commands are matched up with their responses, so we can pipeline too */
+            if(is_first_word(p, ESMTP_PIPELINE, KL(ESMTP_PIPELINE)))
+                pipe->offered = 1;
+
+            /* Messages go on to the server with BDAT, see send_chunked */
+            if(is_first_word(p, ESMTP_CHUNK, KL(ESMTP_CHUNK)) && g_state.chunking)
+            {
+                sp_messagex(ctx, LOG_DEBUG, "CHUNKING supported");
+                ctx->_bdat = 1;
+            }
+
+            /*
+             * We take BDAT ourselves whatever the server does, so the
+             * server's CHUNKING is filtered and ours goes before its last line.
+             */
+            if(!cont && spio_write_data(ctx, &(ctx->client), SMTP_CHUNK_RSP) == -1)
+                RETURN(-1);
+
+            if(is_first_word(p, ESMTP_TLS, KL(ESMTP_TLS)) ||
+               is_first_word(p, ESMTP_CHUNK, KL(ESMTP_CHUNK)) ||
+               is_first_word(p, ESMTP_BINARY, KL(ESMTP_BINARY)) ||
+               is_first_word(p, ESMTP_CHECK, KL(ESMTP_CHECK)) ||
+               is_first_word(p, ESMTP_XCLIENT, KL(ESMTP_XCLIENT)) ||
+               is_first_word(p, ESMTP_XEXCH50, KL(ESMTP_XEXCH50)))
+            {
+                sp_messagex(ctx, LOG_DEBUG, "filtered ESMTP feature: %s", trim_space((char*)p));
+
+                /*
+                 * If this is the last line in the EHLO response we need
+                 * to replace it with something else
+                 */
+                if(!cont)
+                {
+                    if(spio_write_data(ctx, &(ctx->client), SMTP_FEAT_RSP) == -1)
+                        RETURN(-1);
+                }
+
+                RETURN(0);
+            }
+        }
+
+        /* MAIL FROM (that the server accepted) */
+        if((r = check_first_word(cmd, FROM_CMD, KL(FROM_CMD), SMTP_DELIMS)) > 0)
+        {
+            t = parse_address(cmd + r);
+            sp_add_log(ctx, "from=", t);
+
+            /* Make note of the sender for later */
+            ctx->sender = (char*)reallocf(ctx->sender, strlen(t) + 1);
+            if(ctx->sender)
+                strcpy(ctx->sender, t);
+        }
+
+        /* RCPT TO (that the server accepted) */
+        else if((r = check_first_word(cmd, TO_CMD, KL(TO_CMD), SMTP_DELIMS)) > 0)
+        {
+            t = parse_address(cmd + r);
+            sp_add_log(ctx, "to=", t);
+
+            /* Make note of the recipient for later */
+            r = ctx->recipients ? strlen(ctx->recipients) : 0;
+            ctx->recipients = (char*)reallocf(ctx->recipients, r + strlen(t) + 2);
+            if(ctx->recipients)
+            {
+                /* Recipients are separated by lines */
+                if(r != 0)
+                    strcat(ctx->recipients, "\n");
+                else
+                    ctx->recipients[0] = 0;
+
+                strcat(ctx->recipients, t);
+            }
+        }
+
+        /*
+         * If the client sends an XFORWARD, and the server accepted it,
+         * we store address for use in our forked process environment
+         * variables (see sp_setup_forked).
+         */
+        else if(is_first_word(cmd, XFORWARD_CMD, KL(XFORWARD_CMD)))
+        {
+            if((t = parse_xforward (cmd + KL(XFORWARD_CMD), "ADDR")))
+            {
+                ctx->xforwardaddr = (char*)reallocf(ctx->xforwardaddr, strlen(t) + 1);
+                if(ctx->xforwardaddr)
+                    strcpy(ctx->xforwardaddr, t);
+            }
+
+            if((t = parse_xforward (cmd + KL(XFORWARD_CMD), "HELO")))
+            {
+                ctx->xforwardhelo = (char*)reallocf(ctx->xforwardhelo, strlen(t) + 1);
+                if(ctx->xforwardhelo)
+                    strcpy(ctx->xforwardhelo, t);
+            }
+
+        }
+
+        /* RSET */
+        else if(is_first_word(cmd, RSET_CMD, KL(RSET_CMD)))
+        {
+            cleanup_context(ctx);
+        }
+
+        /* Successful authentication */
+        else if(is_first_word(S_LINE, AUTH_SUCCESS_RSP, KL(AUTH_SUCCESS_RSP)))
+        {
+            if(sess->auth_started)
+            {
+                sp_messagex(ctx, LOG_DEBUG, "Client authenticated successfully");
+                ctx->authenticated = 1;
+            }
+            else
+            {
+                sp_messagex(ctx, LOG_WARNING, "Authentication success code without AUTH");
+            }
+        }
+    }
+
+    /* Send the line to the client */
+    if(spio_write_data(ctx, &(ctx->client), S_LINE) == -1)
+        RETURN(-1);
+
+cleanup:
+    /* With the whole response, the next command's is due */
+    if(ret == 0 && is_last_rsp(S_LINE))
+    {
+        if(sess->first_rsp)
+        {
+            sess->first_rsp = 0;
+            pipe->lines = 0;
+        }
+        else if(pipe->count > 0)
+        {
+            ret = pipeline_pop(ctx);
+        }
+        else
+        {
+            pipe->lines = 0;
+        }
+    }
+
+    return ret;
+}
+
+/* Called when the connection is done, to let the client know about errors */
+static void passthru_finish(spsession_t* sess, int ret, int neterror)
+{
+    spctx_t* ctx = sess->ctx;
+
+    if(!neterror && ret == -1 && spio_valid(&(ctx->client)))
+       spio_write_data(ctx, &(ctx->client), SMTP_FAILED);
+
+    if(ctx->trace && ret == -1)
+        trace_dump(ctx, "failed");
+    else if(ctx->trace && ctx->_traced != g_state.trace_dump)
+        trace_dump(ctx, "requested");
+
+    free(sess->helo);
+    sess->helo = NULL;
+
+    pipeline_clear(&(sess->pipe));
+}
+
+static int smtp_passthru(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
+    unsigned int mask;
+    int neterror = 0;
+    int r, ret = 0;
+
+    ASSERT(spio_valid(&(ctx->client)) &&
+           spio_valid(&(ctx->server)));
+
+    while(!sp_is_quit())
+    {
+        mask = spio_select(ctx);
+
+        if(mask == ~0)
+        {
+            neterror = 1;
+            RETURN(-1);
+        }
+
+        /* Client has data available, read a line and process */
+        if(mask & 1)
+        {
+            if((r = spio_read_line(ctx, &(ctx->client), SPIO_DISCARD)) == -1)
+                RETURN(-1);
+
+            /* Client disconnected, we're done */
+            if(r == 0)
+                RETURN(0);
+
+            if(passthru_client_line(sess, r) == -1)
+                RETURN(-1);
+
+            continue;
+        }
+
+        /* Server has data available, read a line and forward */
+        if(mask & 2)
+        {
+            if((r = spio_read_line(ctx, &(ctx->server), SPIO_DISCARD)) == -1)
+                RETURN(-1);
+
+            if(r == 0)
+                RETURN(0);
+
+            if(passthru_server_line(sess, r) == -1)
+                RETURN(-1);
+
+            continue;
+        }
+    }
+
+cleanup:
+
+    passthru_finish(sess, ret, neterror);
+    return ret;
+}
+
+/* ----------------------------------------------------------------------------------
+ *  EVENT LOOP SESSIONS
+ *
+ * Instead of a worker thread per connection, sessions can sit on a few event
+ * loops while they wait on the client or server. The loop receives the data
+ * (with io_uring, into buffers the kernel picks) and feeds it to the session,
+ * where each line is handled on the loop thread. Anything that would block for a long time (connecting,
+ * the DATA section and filtering, XCLIENT) is run as a coroutine on the loop,
+ * so the usual sequential code yields to the loop whenever it waits. If no
+ * coroutine can be had, the step is run on a worker thread instead, and the
+ * session is then handed back to its loop.
+ */
+
+/* Which receives are outstanding */
+#define RECV_CLIENT         0x01
+#define RECV_SERVER         0x02
+
+/* Why we're stopping the receives */
+#define STOP_BLOCK          1
+#define STOP_END            2
+
+static void session_unlink(spsession_t* sess)
+{
+    int index = spev_loop_index(sess->loop);
+
+    spev_untimer(sess->loop, &(sess->idle));
+
+    if(sess->prev)
+        sess->prev->next = sess->next;
+    else if(g_evsessions[index] == sess)
+        g_evsessions[index] = sess->next;
+    if(sess->next)
+        sess->next->prev = sess->prev;
+
+    sess->next = sess->prev = NULL;
+}
+
+static void session_free(spsession_t* sess)
+{
+    spevloop_t* loop = sess->loop;
+    int queue = sess->queue;
+
+    atomic_sub(&g_sessions, 1);
+    spslab_release(g_sessslabs[sess->node], sess);
+
+    /* Our slot can go to a connection that's waiting */
+    pending_drain(queue);
+
+    if(loop)
+        spev_unref(loop);
+}
+
+static int run_blocking(spsession_t* sess, void (*func)(spwork_t*))
+{
+    sess->work.func = func;
+    sess->work.arg = sess;
+    sess->work.fd = sess->fd;
+
+    return spwork_push(sess->queue, &(sess->work));
+}
+
+static void session_worker(spwork_t* work)
+{
+    spsession_t* sess = (spsession_t*)work->arg;
+
+    (sess->step)(sess);
+
+    sess->post.func = sess->done;
+    sess->post.arg = sess;
+    spev_post(sess->loop, &(sess->post));
+}
+
+/* Whether writes wait on the sockets. Not on the loop thread itself */
+static void session_defer(spsession_t* sess, int defer)
+{
+    spctx_t* ctx = sess->ctx;
+
+    if(ctx)
+    {
+        spio_defer(&(ctx->client), defer);
+        spio_defer(&(ctx->server), defer);
+    }
+}
+
+/* Run a step that waits on the network or a filter. On the loop thread */
+static void session_block(spsession_t* sess, void (*step)(void*), void (*done)(void*))
+{
+    sess->blocked = 1;
+    session_defer(sess, 0);
+
+    if(spcoro_run(sess->loop, step, done, sess) == 0)
+        return;
+
+    sess->step = step;
+    sess->done = done;
+
+    /* When we can't get a worker either, we have to do it here */
+    if(run_blocking(sess, session_worker) == -1)
+    {
+        (step)(sess);
+        (done)(sess);
+    }
+}
+
+static void session_received(spevrecv_t* r, const char* data, int len);
+static void session_idle(spevtimer_t* t);
+static void session_line(void* arg);
+static void session_flush(void* arg);
+static void session_resume(void* arg);
+static void session_close(void* arg);
+
+/* Once nothing more will be received, go on to block or end */
+static void session_stopped(spsession_t* sess)
+{
+    if(sess->receiving)
+        return;
+
+    if(sess->stopping == STOP_BLOCK)
+    {
+        sess->stopping = 0;
+        session_block(sess, sess->step, sess->done);
+    }
+
+    else
+    {
+        session_unlink(sess);
+        done_thread(sess->ctx);
+        session_free(sess);
+    }
+}
+
+/* Stop receiving on both sockets. Only on the loop thread */
+static void session_stop(spsession_t* sess, int why)
+{
+    spctx_t* ctx = sess->ctx;
+
+    sess->stopping = why;
+
+    if(spev_unrecv(sess->loop, &(sess->crecv)) == 0)
+        sess->receiving &= ~RECV_CLIENT;
+    if(spev_unrecv(sess->loop, &(sess->srecv)) == 0)
+        sess->receiving &= ~RECV_SERVER;
+
+    /* The blocking step reads what we haven't yet */
+    if(why == STOP_BLOCK)
+    {
+        spio_keep(ctx, &(ctx->client));
+        spio_keep(ctx, &(ctx->server));
+    }
+
+    session_stopped(sess);
+}
+
+/* Stop receiving, and run a blocking step followed by done. On the loop thread */
+static void session_wait(spsession_t* sess, void (*step)(void*), void (*done)(void*))
+{
+    sess->step = step;
+    sess->done = done;
+    session_stop(sess, STOP_BLOCK);
+}
+
+/* Only called on the loop thread */
+static void session_end(spsession_t* sess, int ret, int neterror)
+{
+    spctx_t* ctx = sess->ctx;
+
+    ASSERT(!sess->blocked);
+
+    if(sess->stopping == STOP_END)
+        return;
+
+    passthru_finish(sess, ret, neterror);
+
+    /* The last replies are worth waiting for, if the client is slow to take them */
+    if(!neterror && spio_flush(ctx, &(ctx->client)) != -1 && spio_held(&(ctx->client)))
+    {
+        session_wait(sess, session_flush, session_close);
+        return;
+    }
+
+    session_stop(sess, STOP_END);
+}
+
+/*
+ * Send what's held back, as much as the sockets take without waiting.
+ * If some is left, it's sent by a blocking step, and nothing more is
+ * received meanwhile. Returns -1 if no longer on the loop.
+ */
+static int session_send(spsession_t* sess)
+{
+    spctx_t* ctx = sess->ctx;
+
+    if(spio_flush(ctx, &(ctx->client)) == -1 ||
+       spio_flush(ctx, &(ctx->server)) == -1)
+    {
+        session_end(sess, -1, 0);
+        return -1;
+    }
+
+    if(spio_held(&(ctx->client)) || spio_held(&(ctx->server)))
+    {
+        sp_messagex(ctx, LOG_DEBUG, "waiting for a peer to take what was sent");
+        session_wait(sess, session_flush, session_resume);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read and handle lines until we run out. Returns -1 if no longer on the loop */
+static int session_pump(spsession_t* sess, int client)
+{
+    spctx_t* ctx = sess->ctx;
+    spio_t* io = client ? &(ctx->client) : &(ctx->server);
+    int r;
+
+    for(;;)
+    {
+        r = spio_read_line(ctx, io, SPIO_DISCARD | SPIO_NONBLOCK | SPIO_BUFFERED);
+
+        if(r == SPIO_AGAIN)
+            return session_send(sess);
+
+        if(r == -1 || r == 0)
+        {
+            session_end(sess, r, 0);
+            return -1;
+        }
+
+        if(client && passthru_will_block(sess))
+        {
+            sess->linelen = r;
+            session_wait(sess, session_line, session_resume);
+            return -1;
+        }
+
+        if(client)
+            r = passthru_client_line(sess, r);
+        else
+            r = passthru_server_line(sess, r);
+
+        if(r == -1)
+        {
+            session_end(sess, -1, 0);
+            return -1;
+        }
+    }
+}
+
+/* Start receiving on the sockets given, unless already */
+static int session_recv(spsession_t* sess, int which)
+{
+    spctx_t* ctx = sess->ctx;
+
+    if((which & RECV_CLIENT) && !(sess->receiving & RECV_CLIENT))
+    {
+        sess->crecv.fd = ctx->client.fd;
+        if(sess->crecv.fd == -1 || spev_recv(sess->loop, &(sess->crecv)) == -1)
+            return -1;
+        sess->receiving |= RECV_CLIENT;
+    }
+
+    if((which & RECV_SERVER) && !(sess->receiving & RECV_SERVER))
+    {
+        sess->srecv.fd = ctx->server.fd;
+        if(sess->srecv.fd == -1 || spev_recv(sess->loop, &(sess->srecv)) == -1)
+            return -1;
+        sess->receiving |= RECV_SERVER;
+    }
+
+    return 0;
+}
+
+static void session_received(spevrecv_t* r, const char* data, int len)
+{
+    spsession_t* sess = (spsession_t*)r->arg;
+    spctx_t* ctx = sess->ctx;
+    int client = (r == &(sess->crecv));
+    spio_t* io = client ? &(ctx->client) : &(ctx->server);
+
+    sess->receiving &= ~(client ? RECV_CLIENT : RECV_SERVER);
+
+    if(len != -ECANCELED)
+        spio_feed(io, data, len);
+
+    /* Waiting for the other receive to finish */
+    if(sess->stopping)
+    {
+        if(sess->stopping == STOP_BLOCK)
+            spio_keep(ctx, io);
+        session_stopped(sess);
+        return;
+    }
+
+    if(session_pump(sess, client) == -1)
+        return;
+
+    if(session_recv(sess, client ? RECV_CLIENT : RECV_SERVER) == -1)
+        session_end(sess, -1, 0);
+}
+
+/* Back on the loop thread after a blocking step */
+static void session_resume(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+
+    sess->blocked = 0;
+    session_defer(sess, 1);
+
+    if(sess->result == -1 || sp_is_quit())
+    {
+        session_end(sess, sess->result, sp_is_quit());
+        return;
+    }
+
+    /* There may already be lines buffered, the loop won't hear about them */
+    if(session_pump(sess, 1) == -1 || session_pump(sess, 0) == -1)
+        return;
+
+    if(session_recv(sess, RECV_CLIENT | RECV_SERVER) == -1)
+        session_end(sess, -1, 0);
+}
+
+static void session_line(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+    sess->result = passthru_client_line(sess, sess->linelen);
+}
+
+static void session_flush(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+    spctx_t* ctx = sess->ctx;
+
+    sess->result = 0;
+    if(spio_flush(ctx, &(ctx->client)) == -1 ||
+       spio_flush(ctx, &(ctx->server)) == -1)
+        sess->result = -1;
+}
+
+/* Back on the loop once the last replies are out, or couldn't be */
+static void session_close(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+
+    sess->blocked = 0;
+    session_defer(sess, 1);
+    session_stop(sess, STOP_END);
+}
+
+/* On the loop thread once the connections are made */
+static void session_attach(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+    int index = spev_loop_index(sess->loop);
+
+    sess->blocked = 0;
+
+    if(!sess->ctx)
+    {
+        session_free(sess);
+        return;
+    }
+
+    /* From here on the loop thread writes, and that mustn't wait */
+    session_defer(sess, 1);
+
+    sess->next = g_evsessions[index];
+    if(sess->next)
+        sess->next->prev = sess;
+    g_evsessions[index] = sess;
+
+    if(sp_is_quit())
+    {
+        session_end(sess, -1, 1);
+        return;
+    }
+
+    sess->crecv.callback = sess->srecv.callback = session_received;
+    sess->crecv.arg = sess->srecv.arg = sess;
+
+    sess->idle.callback = session_idle;
+    sess->idle.arg = sess;
+    spev_timer(sess->loop, &(sess->idle), g_state.timeout.tv_sec * 1000);
+
+    if(session_recv(sess, RECV_CLIENT | RECV_SERVER) == -1)
+    {
+        session_end(sess, -1, 0);
+        return;
+    }
+
+    sp_messagex(sess->ctx, LOG_DEBUG, "processing on event loop %d", index);
+}
+
+static void session_setup(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+
+    /* Sometimes we get to this point and then quit is noted */
+    if(!sp_is_quit())
+        sess->ctx = init_thread(sess);
+
+    /* new_context() should have already logged reason */
+    if(!sess->ctx)
+        close(sess->fd);
+}
+
+/* On the loop thread for a new connection */
+static void session_begin(void* arg)
+{
+    spsession_t* sess = (spsession_t*)arg;
+    session_block(sess, session_setup, session_attach);
+}
+
+/* Start a session for a connection that already has a slot */
+static void session_admit(int fd, int queue)
+{
+    spevloop_t* loop = NULL;
+    spsession_t* sess;
+    int node;
+
+    /* Keep a loop's work together */
+    if(spev_running())
+    {
+        loop = spev_next_loop();
+        queue = spev_loop_index(loop) % spwork_queues();
+    }
+
+    /* Memory from the node the session runs on */
+    node = spcpu_node(loop ? spev_loop_index(loop) : queue);
+
+    sess = (spsession_t*)spslab_alloc(g_sessslabs[node]);
+    if(!sess)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        atomic_sub(&g_sessions, 1);
+        refuse_connection(fd, SMTP_STARTFAILED, KL(SMTP_STARTFAILED));
+        return;
+    }
+
+    sess->fd = fd;
+    sess->node = node;
+    sess->queue = queue;
+    sess->first_rsp = 1;
+    sess->crecv.fd = sess->srecv.fd = -1;
+
+    if(loop)
+    {
+        sess->loop = loop;
+        sess->blocked = 1;
+        spev_ref(sess->loop);
+
+        /* Connecting to the server happens on the loop */
+        sess->post.func = session_begin;
+        sess->post.arg = sess;
+        spev_post(sess->loop, &(sess->post));
+        return;
+    }
+
+    /* Connecting to the server can take a while */
+    if(run_blocking(sess, session_thread) == -1)
+    {
+        refuse_connection(fd, SMTP_STARTFAILED, KL(SMTP_STARTFAILED));
+        session_free(sess);
+    }
+}
+
+/* Called on an accepting thread for each new connection */
+static void session_start(spacceptor_t* acc, int fd)
+{
+    int nqueues = spwork_queues();
+    int queue;
+
+    /* Spread them around this acceptor's share of the queues */
+    queue = (acc->index + acc->next * g_state.acceptors) % nqueues;
+    acc->next++;
+    if(acc->index + acc->next * g_state.acceptors >= nqueues)
+        acc->next = 0;
+
+    if(atomic_add(&g_sessions, 1) > g_state.max_threads)
+    {
+        atomic_sub(&g_sessions, 1);
+        pending_add(fd);
+
+        /* A slot may have come free meanwhile */
+        pending_drain(queue);
+        return;
+    }
+
+    session_admit(fd, queue);
+}
+
+/*
+ * On the loop thread when a session may have been idle too long. Activity
+ * doesn't touch the timer, it's just put back for when the time would
+ * be up counting from the last thing that happened.
+ */
+static void session_idle(spevtimer_t* t)
+{
+    spsession_t* sess = (spsession_t*)t->arg;
+    spctx_t* ctx = sess->ctx;
+    unsigned long long limit = g_state.timeout.tv_sec * 1000ULL;
+    unsigned long long last, now;
+
+    /* Already on the way out */
+    if(sess->stopping == STOP_END)
+        return;
+
+    /* Blocking steps time out on their own */
+    if(sess->blocked || sess->stopping)
+    {
+        spev_timer(sess->loop, t, limit);
+        return;
+    }
+
+    now = spwheel_clock();
+    last = max(ctx->client.last_action, ctx->server.last_action);
+    if(now - last < limit)
+    {
+        spev_timer(sess->loop, t, last + limit - now);
+        return;
+    }
+
+    sp_messagex(ctx, LOG_ERR, "network operation timed out");
+    session_end(sess, -1, 1);
+}
+
+/* On the loop thread about once a second, ends sessions when stopping */
+static void session_tick(spevloop_t* loop, int index, int stopping)
+{
+    spsession_t* sess;
+    spsession_t* next;
+
+    if(!stopping)
+        return;
+
+    for(sess = g_evsessions[index]; sess; sess = next)
+    {
+        next = sess->next;
+
+        /* Already on the way out */
+        if(sess->stopping == STOP_END)
+            continue;
+
+        /*
+         * Blocking steps finish up on their own once the client
+         * socket is gone, as with connection threads.
+         */
+        if(sess->blocked)
+            shutdown(sess->fd, SHUT_RDWR);
+        else
+            session_end(sess, -1, 1);
+    }
+}
+
+/* ----------------------------------------------------------------------------------
+ *  ADMISSION
+ *
+ * When MaxConnections are already open, new connections wait a little while
+ * for another to finish rather than being turned away right off. They get a
+ * busy response once they've waited PendingTimeout, or straight away if too
+ * many are already waiting.
+ */
+
+static unsigned long long now_msecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-            else if(is_first_word(C_LINE, AUTH_CMD, KL(AUTH_CMD)))
-            {
-                auth_started = 1;
-            }
+static void refuse_connection(int fd, const char* rsp, size_t len)
+{
+    /* Never hold up the thread, this fits in any socket buffer */
+    send(fd, rsp, len, MSG_DONTWAIT);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
 
-            else if(check_first_word(C_LINE, FROM_CMD, KL(FROM_CMD), SMTP_DELIMS) > 0 ||
-                    check_first_word(C_LINE, TO_CMD, KL(TO_CMD), SMTP_DELIMS) > 0)
-            {
-                if(!should_skip_processing(ctx))
-                {
-                    r = cb_check_pre(ctx);
-                    if(r < 0)
-                    {
-                        RETURN(-1);
-                    }
-                    else if(r == 0)
-                    {
-                        cleanup_context(ctx);
-                        continue;
-                    }
-                }
-            }
+static void pending_add(int fd)
+{
+    sppending_t* p;
+    int full;
 
-            /* All other commands just get passed through to server */
-            if(spio_write_data(ctx, &(ctx->server), C_LINE) == -1)
-                RETURN(-1);
+    sp_mutex_lock(&g_pendmtx);
 
-            continue;
+        full = (g_npending >= g_state.pending_max);
+        if(full)
+        {
+            g_stats.refused++;
         }
-
-        /* Server has data available, read a line and forward */
-        if(mask & 2)
+        else
         {
-            if((r = spio_read_line(ctx, &(ctx->server), SPIO_DISCARD)) == -1)
-                RETURN(-1);
+            p = g_pending + (g_pendhead + g_npending) % g_state.pending_max;
+            p->fd = fd;
+            p->since = now_msecs();
+
+            atomic_add(&g_npending, 1);
+            g_stats.queued++;
+            if(g_npending > g_stats.max_depth)
+                g_stats.max_depth = g_npending;
+        }
 
-            if(r == 0)
-                RETURN(0);
+    pthread_mutex_unlock(&g_pendmtx);
 
-            if(LINE_TOO_LONG(r))
-                sp_messagex(ctx, LOG_WARNING, "SMTP response line too long. discarded extra");
+    if(full)
+    {
+        sp_messagex(NULL, LOG_ERR, "too many connections open (max %d). sent busy response", g_state.max_threads);
+        refuse_connection(fd, SMTP_STARTBUSY, KL(SMTP_STARTBUSY));
+    }
+}
 
-            /*
-             * We intercept the first response we get from the server.
-             * This allows us to change header so that it doesn't look
-             * to the client server that we're in a wierd loop.
-             *
-             * In different situations using the local hostname or
-             * 'localhost' don't work because the receiving mail server
-             * expects one of those to be its own name. We use 'clamsmtp'
-             * instead. No properly configured server would have this
-             * as their domain name, and RFC 2821 allows us to use
-             * an arbitrary but identifying string.
-             */
-#if 0
-            /* Disable loopback protection, in order to be more transparent */
-            if(first_rsp)
-            {
-                first_rsp = 0;
+/* Give waiting connections any free slots */
+static void pending_drain(int queue)
+{
+    unsigned long long waited;
+    int fd;
 
-                if(is_first_word(S_LINE, START_RSP, KL(START_RSP)))
-                {
-                    sp_messagex(ctx, LOG_DEBUG, "intercepting initial response");
+    while(atomic_get(&g_npending) > 0 && !sp_is_quit())
+    {
+        /* Claim a slot first, just like a new connection */
+        if(atomic_add(&g_sessions, 1) > g_state.max_threads)
+        {
+            atomic_sub(&g_sessions, 1);
+            return;
+        }
 
-                    if(spio_write_data(ctx, &(ctx->client), SMTP_BANNER) == -1)
-                        RETURN(-1);
+        fd = -1;
 
-                    /* Command handled */
-                    continue;
-                }
-            }
-#endif
+        sp_mutex_lock(&g_pendmtx);
 
-            if((p = get_successful_rsp(S_LINE, &cont)) != NULL)
+            if(g_npending > 0)
             {
-                /*
-                 * Certain mail servers (Postfix 1.x in particular) do a loop check
-                 * on the 250 response after a EHLO or HELO. This is where we
-                 * filter that to prevent loopback errors.
-                 */
-                if(filter_host)
-                {
-                    /* Can have multi-line responses, and we want to be
-                     * sure to only replace the first one. */
-                    filter_host = 0;
-
-                    sp_messagex(ctx, LOG_DEBUG, "intercepting host response");
-
-#if 1
-                    /* Send the line to the client */
-                    if(spio_write_data(ctx, &(ctx->client), S_LINE) == -1)
-                        RETURN(-1);
-#else
-                    /* Disable loopback protection, in order to be more transparent */
-                    if(spio_write_data(ctx, &(ctx->client),
-                           cont ? SMTP_EHLO_RSP : SMTP_HELO_RSP) == -1)
-                        RETURN(-1);
-#endif
-
-                    /* A new email so cleanup */
-                    cleanup_context(ctx);
-
-                    continue;
-                }
+                fd = g_pending[g_pendhead].fd;
+                waited = now_msecs() - g_pending[g_pendhead].since;
+                g_pendhead = (g_pendhead + 1) % g_state.pending_max;
+                atomic_sub(&g_npending, 1);
+
+                g_stats.admitted++;
+                g_stats.waited += waited;
+                if(waited > g_stats.max_wait)
+                    g_stats.max_wait = waited;
+            }
 
-                /*
-                 * Filter out any EHLO responses that we can't or don't want
-                 * to support. For example pipelining or TLS.
-                 */
-                if(is_first_word(C_LINE, EHLO_CMD, KL(EHLO_CMD)))
-                {
-                    /*
-                     * On ESMTP connections we let the server tell us whether it
-                     * wants XCLIENTs or not. (In contrast to old SMTP above).
-                     */
-                    if(is_first_word(p, ESMTP_XCLIENT, KL(ESMTP_XCLIENT)))
-                    {
-                        sp_messagex(ctx, LOG_DEBUG, "XCLIENT supported");
-                        xclient_sup = 1;
-                    }
-
-                    if(is_first_word(p, ESMTP_PIPELINE, KL(ESMTP_PIPELINE)) ||
-                       is_first_word(p, ESMTP_TLS, KL(ESMTP_TLS)) ||
-                       is_first_word(p, ESMTP_CHUNK, KL(ESMTP_CHUNK)) ||
-                       is_first_word(p, ESMTP_BINARY, KL(ESMTP_BINARY)) ||
-                       is_first_word(p, ESMTP_CHECK, KL(ESMTP_CHECK)) ||
-                       is_first_word(p, ESMTP_XCLIENT, KL(ESMTP_XCLIENT)) ||
-                       is_first_word(p, ESMTP_XEXCH50, KL(ESMTP_XEXCH50)))
-                    {
-                        sp_messagex(ctx, LOG_DEBUG, "filtered ESMTP feature: %s", trim_space((char*)p));
-
-                        /*
-                         * If this is the last line in the EHLO response we need
-                         * to replace it with something else
-                         */
-                        if(!cont)
-                        {
-                            if(spio_write_data(ctx, &(ctx->client), SMTP_FEAT_RSP) == -1)
-                                RETURN(-1);
-                        }
-
-                        continue;
-                    }
-                }
+        pthread_mutex_unlock(&g_pendmtx);
 
-                /* MAIL FROM (that the server accepted) */
-                if((r = check_first_word(C_LINE, FROM_CMD, KL(FROM_CMD), SMTP_DELIMS)) > 0)
-                {
-                    t = parse_address(C_LINE + r);
-                    sp_add_log(ctx, "from=", t);
+        /* Someone else got to it, see if there's more */
+        if(fd == -1)
+        {
+            atomic_sub(&g_sessions, 1);
+            continue;
+        }
 
-                    /* Make note of the sender for later */
-                    ctx->sender = (char*)reallocf(ctx->sender, strlen(t) + 1);
-                    if(ctx->sender)
-                        strcpy(ctx->sender, t);
-                }
+        session_admit(fd, queue);
+    }
+}
 
-                /* RCPT TO (that the server accepted) */
-                else if((r = check_first_word(C_LINE, TO_CMD, KL(TO_CMD), SMTP_DELIMS)) > 0)
-                {
-                    t = parse_address(C_LINE + r);
-                    sp_add_log(ctx, "to=", t);
-
-                    /* Make note of the recipient for later */
-                    r = ctx->recipients ? strlen(ctx->recipients) : 0;
-                    ctx->recipients = (char*)reallocf(ctx->recipients, r + strlen(t) + 2);
-                    if(ctx->recipients)
-                    {
-                        /* Recipients are separated by lines */
-                        if(r != 0)
-                            strcat(ctx->recipients, "\n");
-                        else
-                            ctx->recipients[0] = 0;
-
-                        strcat(ctx->recipients, t);
-                    }
-                }
+/*
+ * Turn away connections that have waited too long, or all of them. Returns
+ * the msecs until the next one is due, for the accepting threads to wait.
+ */
+static int pending_expire(int all)
+{
+    unsigned long long limit = (unsigned long long)g_state.pending_timeout * 1000;
+    unsigned long long now, waited;
+    int next = 1000;
+    int fd;
 
-                /*
-                 * If the client sends an XFORWARD, and the server accepted it,
-                 * we store address for use in our forked process environment
-                 * variables (see sp_setup_forked).
-                 */
-                else if(is_first_word(C_LINE, XFORWARD_CMD, KL(XFORWARD_CMD)))
-                {
-                    if((t = parse_xforward (C_LINE + KL(XFORWARD_CMD), "ADDR")))
-                    {
-                        ctx->xforwardaddr = (char*)reallocf(ctx->xforwardaddr, strlen(t) + 1);
-                        if(ctx->xforwardaddr)
-                            strcpy(ctx->xforwardaddr, t);
-                    }
-
-                    if((t = parse_xforward (C_LINE + KL(XFORWARD_CMD), "HELO")))
-                    {
-                        ctx->xforwardhelo = (char*)reallocf(ctx->xforwardhelo, strlen(t) + 1);
-                        if(ctx->xforwardhelo)
-                            strcpy(ctx->xforwardhelo, t);
-                    }
+    for(;;)
+    {
+        fd = -1;
+        now = now_msecs();
 
-                }
+        sp_mutex_lock(&g_pendmtx);
 
-                /* RSET */
-                else if(is_first_word(C_LINE, RSET_CMD, KL(RSET_CMD)))
+            if(g_npending > 0)
+            {
+                waited = now - g_pending[g_pendhead].since;
+                if(all || waited >= limit)
                 {
-                    cleanup_context(ctx);
+                    fd = g_pending[g_pendhead].fd;
+                    g_pendhead = (g_pendhead + 1) % g_state.pending_max;
+                    atomic_sub(&g_npending, 1);
+                    g_stats.expired++;
                 }
-
-                /* Successful authentication */
-                else if(is_first_word(S_LINE, AUTH_SUCCESS_RSP, KL(AUTH_SUCCESS_RSP)))
+                else
                 {
-                    if(auth_started)
-                    {
-                        sp_messagex(ctx, LOG_DEBUG, "Client authenticated successfully");
-                        ctx->authenticated = 1;
-                    }
-                    else
-                    {
-                        sp_messagex(ctx, LOG_WARNING, "Authentication success code without AUTH");
-                    }
+                    next = min(next, (int)(limit - waited));
                 }
             }
 
-            /* Send the line to the client */
-            if(spio_write_data(ctx, &(ctx->client), S_LINE) == -1)
-                RETURN(-1);
+        pthread_mutex_unlock(&g_pendmtx);
 
-            continue;
-        }
-    }
+        if(fd == -1)
+            break;
 
-cleanup:
+        sp_messagex(NULL, LOG_ERR, "no free connection slot (max %d). sent busy response", g_state.max_threads);
+        refuse_connection(fd, SMTP_STARTBUSY, KL(SMTP_STARTBUSY));
+    }
 
-    if(!neterror && ret == -1 && spio_valid(&(ctx->client)))
-       spio_write_data(ctx, &(ctx->client), SMTP_FAILED);
-    free(helo);
+    return next;
+}
 
-    return ret;
+/* On SIGUSR1, so MaxConnections and friends can be sized */
+static void log_stats()
+{
+    spstats_t stats;
+    unsigned long long memory, files;
+    int depth;
+
+    sp_mutex_lock(&g_pendmtx);
+        memcpy(&stats, &g_stats, sizeof(stats));
+        depth = g_npending;
+    pthread_mutex_unlock(&g_pendmtx);
+
+    spspool_usage(&memory, &files);
+
+    sp_messagex(NULL, LOG_INFO, "stats: connections=%d/%d waiting=%d most-waiting=%d "
+                "queued=%lu admitted=%lu expired=%lu refused=%lu avg-wait=%llums max-wait=%llums "
+                "lock-waits=%lu main-lock-waits=%lu spool-memory=%lluK spool-files=%lluK "
+                "spool-full=%lu",
+                atomic_get(&g_sessions), g_state.max_threads, depth, stats.max_depth,
+                stats.queued, stats.admitted, stats.expired, stats.refused,
+                stats.admitted ? stats.waited / stats.admitted : 0ULL, stats.max_wait,
+                atomic_get(&g_lockwaits), atomic_get(&g_mainwaits),
+                memory / 1024, files / 1024, atomic_get(&g_spoolfull));
 }
 
 /* -----------------------------------------------------------------------------
@@ -1475,7 +3312,7 @@ static const char* get_successful_rsp(const char* line, int* cont)
     return NULL;
 }
 
-void sp_add_log(spctx_t* ctx, char* prefix, char* line)
+void sp_add_log(spctx_t* ctx, char* prefix, const char* line)
 {
     char* t = ctx->logline;
     int l = strlen(t);
@@ -1510,106 +3347,146 @@ void sp_add_log(spctx_t* ctx, char* prefix, char* line)
 
 int sp_start_data(spctx_t* ctx)
 {
+	/* With BDAT the client didn't wait to be asked */
+	if(ctx->_chunks)
+		return 0;
+
 	/* Send back the intermediate response to the client */
 	return spio_write_data(ctx, &(ctx->client), SMTP_DATAINTERMED);
 }
 
-int sp_read_data(spctx_t* ctx, const char** data)
+int sp_read_data_block(spctx_t* ctx, const char** data)
 {
     int r;
 
     ASSERT(ctx);
     ASSERT(data);
 
-    *data = NULL;
-
-    switch(r = spio_read_line(ctx, &(ctx->client), SPIO_QUIET))
+    /* A message sent with BDAT is all in already */
+    if(ctx->_chunks)
     {
-    case 0:
-        sp_messagex(ctx, LOG_ERR, "unexpected end of data from client");
-        return -1;
-    case -1:
-        /* Message already printed */
+        ASSERT(ctx->_chunks->spool);
+
+        r = spspool_view(ctx->_chunks->spool, ctx->_chunks->off, SP_DATA_LENGTH, data);
+        if(r == -1)
+            sp_message(ctx, LOG_ERR, "couldn't read from cache");
+        else
+            ctx->_chunks->off += r;
+        return r;
+    }
+
+    /* Big reads while the data comes in */
+    if(spio_reserve(ctx, &(ctx->client), SP_DATA_LENGTH) == -1)
         return -1;
-    };
+
+    r = spio_read_data(ctx, &(ctx->client), &(ctx->_scan), data);
+    if(r == -1)
+        return -1;  /* Message already printed */
+
+    if(r == 0)
+    {
+        spscan_init(&(ctx->_scan), 0, 1);
+        spio_compact(&(ctx->client));
+        return 0;
+    }
 
     if(g_state.keepalives > 0)
     {
         /*
          * During this time we're just reading from the client. If we haven't
          * had any interaction with the server recently then send something
-         * to let it know we're still around.
+         * to let it know we're still around. The client was just read from,
+         * so its last action is as good as the time now.
          */
-        if((ctx->server.last_action + g_state.keepalives) < time(NULL))
+        if(ctx->server.last_action + g_state.keepalives * 1000ULL < ctx->client.last_action)
             do_server_noop(ctx);
     }
 
-    if(ctx->_crlf && strcmp(ctx->client.line, DATA_END_SIG) == 0)
-        return 0;
-
-    /* Check if this line ended with a CRLF */
-    ctx->_crlf = (strcmp(CRLF, ctx->client.line + (r - KL(CRLF))) == 0);
-    *data = ctx->client.line;
     return r;
 }
 
+/* Drop the cache, unless the message sent with BDAT is still read from it */
+static void drop_cache(spctx_t* ctx)
+{
+    if(ctx->_spool && !(ctx->_chunks && ctx->_chunks->spool == ctx->_spool))
+    {
+        /* One is kept for the next message, along with its file */
+        if(!ctx->_spare)
+        {
+            spspool_reset(ctx->_spool);
+            ctx->_spare = ctx->_spool;
+        }
+        else
+        {
+            spspool_close(ctx->_spool);
+            free(ctx->_spool);
+        }
+    }
+
+    ctx->_spool = NULL;
+    ctx->cachename = NULL;
+}
+
 int sp_write_data(spctx_t* ctx, const char* buf, int len)
 {
     int r = 0;
+    int found;
 
     ASSERT(ctx);
 
-    /* When a null buffer close the cache file */
+    /* When a null buffer the cache is finished */
     if(!buf)
     {
-        if(ctx->cachefile)
+        if(ctx->_spool && !ctx->_spool->done &&
+           spspool_finish(ctx->_spool) == -1)
         {
-            if(fclose(ctx->cachefile) == EOF)
-            {
-                sp_message(ctx, LOG_ERR, "couldn't write to cache file: %s", ctx->cachename);
-                r = -1;
-            }
-
-            ctx->cachefile = NULL;
+            sp_message(ctx, LOG_ERR, "couldn't write to cache file");
+            r = -1;
         }
 
         return r;
     }
 
-    /* Make sure we have a file open */
-    if(!ctx->cachefile)
+    /* Make sure we have a cache to write to */
+    if(!ctx->_spool || ctx->_spool->done)
     {
-        int tfd;
-
-        /* Make sure afore mentioned file is gone */
-        if(ctx->cachename[0])
-            unlink(ctx->cachename);
+        drop_cache(ctx);
 
-        snprintf(ctx->cachename, MAXPATHLEN, "%s/%s.XXXXXX",
-                 g_state.directory, g_state.name);
-
-        if((tfd = mkstemp(ctx->cachename)) == -1 ||
-           (ctx->cachefile = fdopen(tfd, "w")) == NULL)
+        if(ctx->_spare)
+        {
+            ctx->_spool = ctx->_spare;
+            ctx->_spare = NULL;
+        }
+        else
         {
-            if(tfd != -1)
-                close(tfd);
+            ctx->_spool = (spspool_t*)malloc(sizeof(spspool_t));
+            if(!ctx->_spool)
+            {
+                sp_messagex(ctx, LOG_CRIT, "out of memory");
+                return -1;
+            }
 
-            sp_message(ctx, LOG_ERR, "couldn't open cache file");
-            return -1;
+            spspool_open(ctx->_spool);
         }
+        sp_messagex(ctx, LOG_DEBUG, "started cache");
 
-        fcntl(tfd, F_SETFD, fcntl(tfd, F_GETFD, 0) | FD_CLOEXEC);
-        sp_messagex(ctx, LOG_DEBUG, "created cache file: %s", ctx->cachename);
+        spscan_init(&(ctx->_cache.scan), 0, 1);
+        ctx->_cache.dots = 0;
     }
 
-    fwrite(buf, 1, len, ctx->cachefile);
-
-    if(ferror(ctx->cachefile))
+    if(spspool_write(ctx->_spool, buf, len) == -1)
     {
-        sp_message(ctx, LOG_ERR, "couldn't write to cache file: %s", ctx->cachename);
+        sp_message(ctx, LOG_ERR, "couldn't write to cache file");
         return -1;
     }
 
+    /* Until a line starts with a dot, the data can go out with DATA as it is */
+    if(!ctx->_cache.dots)
+    {
+        spscan_block(&(ctx->_cache.scan), buf, len, 0, &found);
+        ctx->_cache.dots = (found != SPSCAN_NONE);
+    }
+
     return len;
 }
 
@@ -1618,7 +3495,14 @@ int sp_cache_data(spctx_t* ctx)
     int r, count = 0;
     const char* data;
 
-    while((r = sp_read_data(ctx, &data)) != 0)
+    /* A message sent with BDAT went straight into the cache */
+    if(ctx->_chunks)
+    {
+        sp_messagex(ctx, LOG_DEBUG, "message already in cache");
+        return (int)ctx->_chunks->size;
+    }
+
+    while((r = sp_read_data_block(ctx, &data)) != 0)
     {
         if(r < 0)
             return -1;  /* Message already printed */
@@ -1637,6 +3521,26 @@ int sp_cache_data(spctx_t* ctx)
     return count;
 }
 
+const char* sp_cache_file(spctx_t* ctx)
+{
+    ASSERT(ctx);
+    ASSERT(ctx->_spool && ctx->_spool->done);
+
+    if(!ctx->cachename)
+    {
+        ctx->cachename = spspool_name(ctx->_spool);
+        if(!ctx->cachename)
+        {
+            sp_message(ctx, LOG_ERR, "couldn't write cache file");
+            return NULL;
+        }
+
+        sp_messagex(ctx, LOG_DEBUG, "cache file is: %s", ctx->cachename);
+    }
+
+    return ctx->cachename;
+}
+
 /* Important: |date| should be at least MAX_DATE_LENGTH long */
 static void make_date(spctx_t* ctx, char* date)
 {
@@ -1751,14 +3655,14 @@ static int make_header(spctx_t* ctx, const char* format_str, char* header)
             switch(*(++f))
             {
             case 'i':
-                l = strlen(ctx->client.peername);
-                strncpy(p, ctx->client.peername, remaining);
+                l = strlen(spio_peername(&(ctx->client)));
+                strncpy(p, spio_peername(&(ctx->client)), remaining);
                 remaining -= l;
                 p += l;
                 break;
             case 'l':
-                l = strlen(ctx->client.localname);
-                strncpy(p, ctx->client.localname, remaining);
+                l = strlen(spio_localname(&(ctx->client)));
+                strncpy(p, spio_localname(&(ctx->client)), remaining);
                 remaining -= l;
                 p += l;
                 break;
@@ -1777,90 +3681,274 @@ static int make_header(spctx_t* ctx, const char* format_str, char* header)
             default:
                 sp_messagex(ctx, LOG_WARNING, "invalid header symbol: %%%c", *f);
                 break;
-            };
+            };
+        }
+
+        else
+        {
+            *(p++) = *f;
+            remaining--;
+        }
+    }
+
+    if((p + 1) < (header + MAX_HEADER_LENGTH))
+        p[1] = 0;
+    header[MAX_HEADER_LENGTH - 1] = 0;
+    l = p - header;
+    return l >= MAX_HEADER_LENGTH ? MAX_HEADER_LENGTH - 1 : l;
+}
+
+//#define HALON_REPORT_RATE "./rate.py"
+#ifdef HALON_REPORT_RATE
+int rate_report(char* entry)
+{
+       pid_t pid = fork();
+       if (pid == -1)
+       {
+               return -1;
+       }
+       if (pid == 0)
+       {
+               execl(HALON_REPORT_RATE, HALON_REPORT_RATE, entry, NULL);
+               _exit(EXIT_FAILURE);
+       }
+       int status;
+       waitpid(pid, &status, 0);
+       return 0;
+}
+#endif
+
+/*
+ * Send the cache file with dots stuffed and our header put in. Everything
+ * but the few lines that need changing goes on as it is. Returns -1 on
+ * failure.
+ */
+static int send_dotted(spctx_t* ctx, spspool_t* spool, char* block, char* header,
+                       size_t header_len, int header_prepend)
+{
+    spscan_t scan;
+    unsigned long long pos = 0;
+    size_t have, off, n;
+    ssize_t r;
+    int found, final;
+
+    /* If we have to prepend the header, do it */
+    if(header[0] != '\0' && header_prepend)
+    {
+        if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)header, header_len) == -1 ||
+           spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)CRLF, KL(CRLF)) == -1)
+            return -1;
+        header[0] = '\0';
+    }
+
+    spscan_init(&scan, header[0] != '\0', 1);
+    have = 0;
+
+    for(;;)
+    {
+        r = spspool_read(spool, pos, block + have, REPLAY_BLOCK - have);
+        if(r == -1)
+        {
+            sp_message(ctx, LOG_ERR, "error reading cache");
+            return -1;
+        }
+
+        pos += r;
+        final = (r == 0);
+        have += r;
+
+        if(have == 0)
+            break;
+
+        for(off = 0; off < have; )
+        {
+            n = spscan_block(&scan, block + off, have - off, final, &found);
+            if(n > 0 && spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)block + off, n) == -1)
+                return -1;
+            off += n;
+
+            /*
+             * The cache holds the message as it is, so lines starting
+             * with a dot get another one in front. That way a lone dot
+             * doesn't end the email.
+             */
+            if(found == SPSCAN_END || found == SPSCAN_DOT)
+            {
+                if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)".." CRLF, KL(".." CRLF)) == -1)
+                    return -1;
+                off += SPSCAN_DOT_LEN;
+            }
+
+            else if(found == SPSCAN_STUFF)
+            {
+                if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)"..", 2) == -1)
+                    return -1;
+                off += 1;
+            }
+
+            /*
+             * The first blank line we see means the headers are done.
+             * At this point we add in our virus checked header.
+             */
+            else if(found == SPSCAN_BLANK)
+            {
+                if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)header, header_len) == -1 ||
+                   spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)CRLF, KL(CRLF)) == -1)
+                    return -1;
+                header[0] = '\0';
+            }
+
+            /* Nothing more here, or a line to finish with the next block */
+            else
+            {
+                break;
+            }
+        }
+
+        /* Nothing's left over once the file has ended */
+        ASSERT(!final || off == have);
+        memmove(block, block + off, have - off);
+        have -= off;
+
+        if(final)
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * Where our header goes in the cache: at the front, or before the blank
+ * line that ends the other headers. Only the headers are read. Returns
+ * -1 when there's no such line, and the header isn't put in.
+ */
+static off_t header_offset(spctx_t* ctx, spspool_t* spool, char* block, int header_prepend)
+{
+    spscan_t scan;
+    off_t pos = 0, ret = -1;
+    size_t have = 0, off, n;
+    ssize_t r;
+    int found, final;
+
+    if(header_prepend)
+        return 0;
+
+    spscan_init(&scan, 1, 0);
+
+    for(;;)
+    {
+        r = spspool_read(spool, pos + have, block + have, REPLAY_BLOCK - have);
+        final = (r <= 0);
+        if(r > 0)
+            have += r;
+        found = SPSCAN_NONE;
+
+        for(off = 0; off < have; )
+        {
+            n = spscan_block(&scan, block + off, have - off, final, &found);
+            off += n;
+
+            if(found == SPSCAN_END || found == SPSCAN_DOT)
+                off += SPSCAN_DOT_LEN;
+            else
+                break;
         }
 
-        else
+        if(found == SPSCAN_BLANK)
         {
-            *(p++) = *f;
-            remaining--;
+            ret = pos + off;
+            break;
         }
+
+        if(final)
+            break;
+
+        memmove(block, block + off, have - off);
+        have -= off;
+        pos += off;
     }
 
-    if((p + 1) < (header + MAX_HEADER_LENGTH))
-        p[1] = 0;
-    header[MAX_HEADER_LENGTH - 1] = 0;
-    l = p - header;
-    return l >= MAX_HEADER_LENGTH ? MAX_HEADER_LENGTH - 1 : l;
+    return ret;
 }
 
-//#define HALON_REPORT_RATE "./rate.py"
-#ifdef HALON_REPORT_RATE
-int rate_report(char* entry)
+/* Send part of the cache as it is, from the file or straight from memory */
+static int send_range(spctx_t* ctx, spspool_t* spool, unsigned long long off,
+                      unsigned long long len)
 {
-       pid_t pid = fork();
-       if (pid == -1)
-       {
-               return -1;
-       }
-       if (pid == 0)
-       {
-               execl(HALON_REPORT_RATE, HALON_REPORT_RATE, entry, NULL);
-               _exit(EXIT_FAILURE);
-       }
-       int status;
-       waitpid(pid, &status, 0);
-       return 0;
+    const char* data;
+    ssize_t r;
+
+    if(spool->fd != -1)
+        return spio_write_file(ctx, &(ctx->server), spool->fd, off, len);
+
+    while(len > 0)
+    {
+        r = spspool_view(spool, off, len, &data);
+        if(r <= 0)
+        {
+            sp_message(ctx, LOG_ERR, "error reading cache");
+            return -1;
+        }
+
+        if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)data, r) == -1)
+            return -1;
+
+        off += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+/* Send the cache as it is, with our header put in at off. Returns -1 on failure */
+static int send_spool(spctx_t* ctx, spspool_t* spool, const char* header,
+                      size_t header_len, off_t off)
+{
+    if(off < 0)
+        off = 0;
+
+    /* Held back, to go out with what's before it */
+    else if(send_range(ctx, spool, 0, off) == -1 ||
+            spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)header, header_len) == -1 ||
+            spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)CRLF, KL(CRLF)) == -1)
+        return -1;
+
+    return send_range(ctx, spool, off, spool->size - off);
 }
-#endif
 
 int sp_done_data(spctx_t* ctx, const char *headertmpl)
 {
-    FILE* file = 0;
+    spspool_t* spool = ctx->_spool;
     int ret = 0;
-    char *line;
+    char* block = NULL;
     char header[MAX_HEADER_LENGTH] = "";
-    size_t header_len = 0, line_len;
+    size_t header_len = 0;
     int header_prepend = 0;
-    ssize_t rc;
+    unsigned long long size;
+    off_t at = -1;
+    char last = '\n';
+    int changed, plain, r;
 
-    ASSERT(ctx->cachename[0]);  /* Must still be around */
-    ASSERT(!ctx->cachefile);    /* File must be closed */
+    ASSERT(spool);              /* Must still be around */
+    ASSERT(spool->done);        /* Must be finished */
 
     memset(header, 0, sizeof(header));
 
-    /* Alloc line buffer */
-    line_len = SP_LINE_LENGTH;
-    if((line = (char *)malloc(line_len)) == NULL)
-        RETURN(-1);
-
-    /* Open the file */
-    file = fopen(ctx->cachename, "r");
-    if(file == NULL)
-    {
-        sp_message(ctx, LOG_ERR, "couldn't open cache file: %s", ctx->cachename);
-        RETURN(-1);
-    }
-
-    /* Ask the server for permission to send data */
-    if(spio_write_data(ctx, &(ctx->server), SMTP_DATA) == -1)
+    if((block = (char*)malloc(REPLAY_BLOCK)) == NULL)
         RETURN(-1);
 
-    if(read_server_response(ctx) == -1)
-        RETURN(-1);
+    /* A file filter may have changed the file */
+    changed = spspool_changed(spool);
 
-    /* If server returns an error then tell the client */
-    if(!is_first_word(ctx->server.line, DATA_RSP, KL(DATA_RSP)))
+    /* The last line has to end, or it would run into what comes after */
+    if(changed == -1 ||
+       (spool->size > 0 && spspool_read(spool, spool->size - 1, &last, 1) != 1))
     {
-        if(spio_write_data(ctx, &(ctx->client), ctx->server.line) == -1)
-            RETURN(-1);
-
-        sp_messagex(ctx, LOG_DEBUG, "server refused data transfer");
-
-        RETURN(0);
+        sp_message(ctx, LOG_ERR, "couldn't read cache");
+        RETURN(-1);
     }
 
-    sp_messagex(ctx, LOG_DEBUG, "sending from cache file: %s", ctx->cachename);
+    size = spool->size;
 
     if(headertmpl)
     {
@@ -1869,54 +3957,66 @@ int sp_done_data(spctx_t* ctx, const char *headertmpl)
             header_prepend = 1;
     }
 
+    /*
+     * With BDAT nothing in the message changes, and with DATA only lines
+     * starting with a dot. Otherwise the file goes across as it is, and
+     * where our header goes is all that's looked for.
+     */
+    plain = ctx->_bdat || (!ctx->_cache.dots && !changed);
+    if(plain && header[0] != '\0')
+        at = header_offset(ctx, spool, block, header_prepend);
 
-    /* If we have to prepend the header, do it */
-    if(header[0] != '\0' && header_prepend)
+    if(ctx->_bdat)
     {
-        if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)header, header_len) == -1 ||
-           spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)CRLF, KL(CRLF)) == -1)
+        if(at >= 0)
+            size += header_len + KL(CRLF);
+        if(last != '\n')
+            size += KL(CRLF);
+
+        if(spio_write_dataf(ctx, &(ctx->server), SMTP_BDAT_LAST, size) == -1)
             RETURN(-1);
-        header[0] = '\0';
     }
-
-    /* Transfer actual file data */
-    while((rc = getline(&line, &line_len, file)) != -1)
+    else
     {
-        /*
-         * If the line is <CRLF>.<CRLF> we need to change it so that
-         * it doesn't end the email. We do this by adding a space.
-         * This won't occur much in clamsmtpd, but proxsmtpd might
-         * have filters that accidentally put this in.
-         */
-        if(strcmp(line, "." CRLF) == 0)
-            strncpy(line, ". " CRLF, SP_LINE_LENGTH);
+        /* Ask the server for permission to send data */
+        if(spio_write_data(ctx, &(ctx->server), SMTP_DATA) == -1)
+            RETURN(-1);
+
+        if(read_server_response(ctx) == -1)
+            RETURN(-1);
 
-        if(header[0] != '\0')
+        /* If server returns an error then tell the client */
+        if(!is_first_word(ctx->server.line, DATA_RSP, KL(DATA_RSP)))
         {
-            /*
-             * The first blank line we see means the headers are done.
-             * At this point we add in our virus checked header.
-             */
-            if(is_blank_line(line))
-            {
-                if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)header, header_len) == -1 ||
-                   spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)CRLF, KL(CRLF)) == -1)
-                    RETURN(-1);
-                header[0] = '\0';
-            }
-        }
+            if(spio_write_data(ctx, &(ctx->client), ctx->server.line) == -1)
+                RETURN(-1);
 
-        if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)line, rc) == -1)
-            RETURN(-1);
+            sp_messagex(ctx, LOG_DEBUG, "server refused data transfer");
+
+            RETURN(0);
+        }
     }
 
-    if(ferror(file))
-        sp_message(ctx, LOG_ERR, "error reading cache file: %s", ctx->cachename);
+    sp_messagex(ctx, LOG_DEBUG, "sending from cache %s%s",
+                spool->fd != -1 ? "file" : "in memory", plain ? " as it is" : "");
+
+    if(plain)
+        r = send_spool(ctx, spool, header, header_len, at);
+    else
+        r = send_dotted(ctx, spool, block, header, header_len, header_prepend);
 
-    if(ferror(file) || spio_write_data(ctx, &(ctx->server), DATA_END_SIG) == -1)
+    if(r == -1 ||
+       (last != '\n' && spio_write_data(ctx, &(ctx->server), CRLF) == -1) ||
+       (!ctx->_bdat && spio_write_data(ctx, &(ctx->server), DATA_END_SIG) == -1) ||
+       spio_flush(ctx, &(ctx->server)) == -1)
     {
         /* Tell the client it went wrong */
         spio_write_data(ctx, &(ctx->client), SMTP_FAILED);
+
+        /* The server took a size and is still waiting on that much */
+        if(ctx->_bdat)
+            spio_disconnect(ctx, &(ctx->server));
+
         RETURN(-1);
     }
 
@@ -1939,10 +4039,8 @@ int sp_done_data(spctx_t* ctx, const char *headertmpl)
 
 cleanup:
 
-	if(line)
-		free(line);
-    if(file)
-        fclose(file); /* read-only so no error check */
+    if(block)
+        free(block);
 
     return ret;
 }
@@ -1950,8 +4048,6 @@ cleanup:
 int sp_pass_data(spctx_t* ctx)
 {
 	int count = 0;
-	const char *data;
-	ssize_t rc;
 
 	/* Ask the server for permission to send data */
 	if(spio_write_data(ctx, &(ctx->server), SMTP_DATA) < 0)
@@ -1971,16 +4067,16 @@ int sp_pass_data(spctx_t* ctx)
 		return 0;
 	}
 
-	while((rc = sp_read_data(ctx, &data)) != 0)
-	{
-		if(rc < 0)
-			return -1;  /* Message already printed */
-		count += rc;
-		if(spio_write_data_raw(ctx, &(ctx->server), (unsigned char*)data, rc) < 0)
-			return -1;
-	}
+	/* The data goes across as it is, without being looked over */
+	count = spio_relay_data(ctx, &(ctx->client), &(ctx->server),
+	                        ctx->_pipe && ctx->_pipe->offered ? SPIO_PIPELINED : 0);
+	if(count < 0)
+		return -1;  /* Message already printed */
+
+	spio_compact(&(ctx->client));
 
-	if(spio_write_data(ctx, &(ctx->server), DATA_END_SIG) < 0)
+	if(spio_write_data(ctx, &(ctx->server), DATA_END_SIG) < 0 ||
+	   spio_flush(ctx, &(ctx->server)) < 0)
 	{
 		/* Tell the client it went wrong */
 		spio_write_data(ctx, &(ctx->client), SMTP_FAILED);
@@ -2044,7 +4140,7 @@ int sp_fail_msg(spctx_t* ctx, const char* smtp_status)
         smtp_status = buf;
     }
 
-    if(spio_write_data(ctx, &(ctx->client), smtp_status) == -1)
+    if(reply_client(ctx, smtp_status) == -1)
         return -1;
 
     return 0;
@@ -2084,15 +4180,26 @@ static void do_server_noop(spctx_t* ctx)
 
 void sp_setup_forked(spctx_t* ctx, int file)
 {
+    sigset_t set;
+
+    /* Stay on our node, but not the one CPU the thread was pinned to */
+    spcpu_unpin();
+
     /* Signals we've messed with */
     signal(SIGPIPE, SIG_DFL);
     signal(SIGHUP,  SIG_DFL);
     signal(SIGINT,  SIG_DFL);
     signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
 
     siginterrupt(SIGINT, 0);
     siginterrupt(SIGTERM, 0);
 
+    /* The thread we forked from may have had some blocked */
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
     if(ctx->helo)
         setenv("HELO", ctx->helo, 1);
 
@@ -2102,11 +4209,11 @@ void sp_setup_forked(spctx_t* ctx, int file)
     if(ctx->recipients)
         setenv("RECIPIENTS", ctx->recipients, 1);
 
-    if(file && ctx->cachename[0])
+    if(file && ctx->cachename)
         setenv("EMAIL", ctx->cachename, 1);
 
     if(spio_valid(&(ctx->client)))
-        setenv("CLIENT", ctx->client.peername, 1);
+        setenv("CLIENT", spio_peername(&(ctx->client)), 1);
 
     if(ctx->xforwardaddr)
         setenv("REMOTE", ctx->xforwardaddr, 1);
@@ -2115,12 +4222,91 @@ void sp_setup_forked(spctx_t* ctx, int file)
         setenv("REMOTE_HELO", ctx->xforwardhelo, 1);
 
     if(spio_valid(&(ctx->server)))
-        setenv("SERVER", ctx->server.peername, 1);
+        setenv("SERVER", spio_peername(&(ctx->server)), 1);
 
     setenv("TMPDIR", g_state.directory, 1);
 }
 
 
+/* ----------------------------------------------------------------------------------
+ *  WIRE TRACES
+ *
+ * Some sessions keep what went across their sockets, for looking into
+ * problems without debug logging. The trace is written to a file in the
+ * temp directory when the session fails, or on SIGUSR2. Since only the
+ * session touches its trace, it's written out by the session itself, the
+ * next time it sends or receives anything or when it ends.
+ */
+
+static void trace_start(spctx_t* ctx)
+{
+    unsigned int n;
+    int i, want = 0;
+
+    for(i = 0; i < g_state.trace_nclients && !want; i++)
+    {
+        if(sock_any_cmp(&(ctx->client.peeraddr), &(g_state.trace_clients[i]),
+                        SANY_OPT_NOPORT) == 0)
+            want = 1;
+    }
+
+    /* Spread the sampled sessions out evenly */
+    if(!want && g_state.trace_sessions > 0)
+    {
+        n = atomic_add(&g_traced, 1);
+        want = (n * g_state.trace_sessions) / 100 !=
+               ((n - 1) * g_state.trace_sessions) / 100;
+    }
+
+    if(!want)
+        return;
+
+    ctx->trace = sptrace_new((size_t)g_state.trace_size * 1024);
+    ctx->_traced = g_state.trace_dump;
+
+    if(ctx->trace)
+        sp_messagex(ctx, LOG_DEBUG, "tracing connection");
+    else
+        sp_messagex(ctx, LOG_WARNING, "out of memory, connection isn't traced");
+}
+
+static void trace_dump(spctx_t* ctx, const char* why)
+{
+    char name[MAXPATHLEN];
+    int fd;
+
+    ASSERT(ctx->trace);
+
+    ctx->_traced = g_state.trace_dump;
+
+    snprintf(name, sizeof(name), "%s/%s-trace.%08X.XXXXXX",
+             g_state.directory, g_state.name, ctx->id);
+
+    if((fd = mkstemp(name)) == -1)
+    {
+        sp_message(ctx, LOG_ERR, "couldn't create trace file");
+        return;
+    }
+
+    if(sptrace_write(ctx->trace, ctx->id, fd) == -1)
+        sp_message(ctx, LOG_ERR, "couldn't write trace file: %s", name);
+    else
+        sp_messagex(ctx, LOG_INFO, "wrote %s trace: %s", why, name);
+
+    close(fd);
+}
+
+void sp_trace(spctx_t* ctx, spio_t* io, int flags, const void* data, size_t len)
+{
+    if(io == &(ctx->server))
+        flags |= SPTRACE_SERVER;
+
+    sptrace_record(ctx->trace, flags, data, len);
+
+    if(ctx->_traced != g_state.trace_dump)
+        trace_dump(ctx, "requested");
+}
+
 /* ----------------------------------------------------------------------------------
  *  LOGGING
  */
@@ -2132,6 +4318,8 @@ static void vmessage(spctx_t* ctx, int level, int err,
                      const char* msg, va_list ap)
 {
     char buf[MAX_MSGLEN];
+    char ebuf[256];
+    const char* estr;
     int e = errno;
 
     if(g_state.daemonized)
@@ -2154,13 +4342,15 @@ static void vmessage(spctx_t* ctx, int level, int err,
 
     if(err)
     {
-        /* strerror_r doesn't want to work for us for some reason
-        len = strlen(buf);
-        strerror_r(e, buf + len, MAX_MSGLEN - len); */
-
-        sp_lock();
-            strncat(buf, strerror(e), MAX_MSGLEN - strlen(buf) - 1);
-        sp_unlock();
+        /* glibc has its own idea of what strerror_r returns */
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+        estr = strerror_r(e, ebuf, sizeof(ebuf));
+#else
+        if(strerror_r(e, ebuf, sizeof(ebuf)) != 0)
+            snprintf(ebuf, sizeof(ebuf), "error %d", e);
+        estr = ebuf;
+#endif
+        strncat(buf, estr, MAX_MSGLEN - strlen(buf) - 1);
     }
 
     /* As a precaution */
@@ -2196,27 +4386,23 @@ void sp_message(spctx_t* ctx, int level, const char* msg, ...)
  * LOCKING
  */
 
-void sp_lock()
+int sp_mutex_lock(pthread_mutex_t* mtx)
 {
-    int r;
-
-#ifdef _DEBUG
     int wait = 0;
-#endif
+    int r;
 
-#ifdef _DEBUG
-    r = pthread_mutex_trylock(&g_mutex);
+    r = pthread_mutex_trylock(mtx);
     if(r == EBUSY)
     {
+        /* Counted so we can tell when threads get in each other's way */
         wait = 1;
-        sp_message(NULL, LOG_DEBUG, "thread will block: %d", pthread_self());
-        r = pthread_mutex_lock(&g_mutex);
-    }
-
-#else
-    r = pthread_mutex_lock(&g_mutex);
+        atomic_add(&g_lockwaits, 1);
 
+#ifdef _DEBUG
+        sp_messagex(NULL, LOG_DEBUG, "thread will block: %x", (int)pthread_self());
 #endif
+        r = pthread_mutex_lock(mtx);
+    }
 
     if(r != 0)
     {
@@ -2224,12 +4410,13 @@ void sp_lock()
         sp_message(NULL, LOG_CRIT, "threading problem. couldn't lock mutex");
     }
 
-#ifdef _DEBUG
-    else if(wait)
-    {
-        sp_message(NULL, LOG_DEBUG, "thread unblocked: %d", pthread_self());
-    }
-#endif
+    return wait;
+}
+
+void sp_lock()
+{
+    if(sp_mutex_lock(&g_mutex))
+        atomic_add(&g_mainwaits, 1);
 }
 
 void sp_unlock()
@@ -2242,6 +4429,44 @@ void sp_unlock()
     }
 }
 
+/* -----------------------------------------------------------------------
+ * THREADS
+ */
+
+int sp_thread_create(pthread_t* tid, void* (*func)(void*), void* arg)
+{
+    pthread_attr_t attr;
+    int r;
+
+    pthread_attr_init(&attr);
+
+    /* Most of the memory an idle thread uses is its stack */
+    if(g_state.stack_size > 0)
+    {
+        r = pthread_attr_setstacksize(&attr, (size_t)g_state.stack_size * 1024);
+        if(r != 0)
+            sp_messagex(NULL, LOG_WARNING, "couldn't set thread stack size");
+    }
+
+    r = pthread_create(tid, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+int sp_poll(struct pollfd* fds, int nfds, int timeout)
+{
+    /* Coroutines give up the loop thread while they wait */
+    if(spcoro_self())
+        return spcoro_poll(fds, nfds, timeout);
+
+    return poll(fds, nfds, timeout);
+}
+
+void sp_call(void (*func)(void*), void* arg)
+{
+    spcoro_call(func, arg);
+}
+
 /* -----------------------------------------------------------------------------
  * CONFIG FILE
  */
@@ -2268,6 +4493,14 @@ int sp_parse_option(const char* name, const char* value)
         ret = 1;
     }
 
+    else if(strcasecmp(CFG_CONNECTTIMEOUT, name) == 0)
+    {
+        g_state.connect_timeout = strtol(value, &t, 10);
+        if(*t || g_state.connect_timeout <= 0)
+            errx(2, "invalid setting: " CFG_CONNECTTIMEOUT);
+        ret = 1;
+    }
+
     else if(strcasecmp(CFG_KEEPALIVES, name) == 0)
     {
         g_state.keepalives = strtol(value, &t, 10);
@@ -2276,6 +4509,155 @@ int sp_parse_option(const char* name, const char* value)
         ret = 1;
     }
 
+    else if(strcasecmp(CFG_EVENTTHREADS, name) == 0)
+    {
+        g_state.event_threads = strtol(value, &t, 10);
+        if(*t || g_state.event_threads < 0 || g_state.event_threads > TOP_EVENT_THREADS)
+            errx(2, "invalid setting: " CFG_EVENTTHREADS " (must be between 0 and %d)",
+                 TOP_EVENT_THREADS);
+#ifndef HAVE_SYS_EPOLL_H
+        if(g_state.event_threads > 0)
+            errx(2, "invalid setting: " CFG_EVENTTHREADS ": was not built with event loop support");
+#endif
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_WORKERTHREADS, name) == 0)
+    {
+        g_state.worker_threads = strtol(value, &t, 10);
+        if(*t || g_state.worker_threads < 0 || g_state.worker_threads >= TOP_MAX_CONNECTIONS)
+            errx(2, "invalid setting: " CFG_WORKERTHREADS " (must be between 0 and %d)",
+                 TOP_MAX_CONNECTIONS);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_ACCEPTORS, name) == 0)
+    {
+        g_state.acceptors = strtol(value, &t, 10);
+        if(*t || g_state.acceptors < 1 || g_state.acceptors > TOP_ACCEPTORS)
+            errx(2, "invalid setting: " CFG_ACCEPTORS " (must be between 1 and %d)",
+                 TOP_ACCEPTORS);
+#ifndef SO_REUSEPORT
+        if(g_state.acceptors > 1)
+            errx(2, "invalid setting: " CFG_ACCEPTORS ": sockets can't be shared on this system");
+#endif
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_STACKSIZE, name) == 0)
+    {
+        g_state.stack_size = strtol(value, &t, 10);
+        if(*t || (g_state.stack_size != 0 && g_state.stack_size < BOTTOM_STACK_SIZE))
+            errx(2, "invalid setting: " CFG_STACKSIZE " (must be 0 or at least %d)",
+                 BOTTOM_STACK_SIZE);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_PENDING, name) == 0)
+    {
+        g_state.pending_max = strtol(value, &t, 10);
+        if(*t || g_state.pending_max < 0 || g_state.pending_max >= TOP_MAX_CONNECTIONS)
+            errx(2, "invalid setting: " CFG_PENDING " (must be between 0 and %d)",
+                 TOP_MAX_CONNECTIONS);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_PENDINGTIMEOUT, name) == 0)
+    {
+        g_state.pending_timeout = strtol(value, &t, 10);
+        if(*t || g_state.pending_timeout <= 0 || g_state.pending_timeout > TOP_PENDING_TIMEOUT)
+            errx(2, "invalid setting: " CFG_PENDINGTIMEOUT " (must be between 1 and %d)",
+                 TOP_PENDING_TIMEOUT);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_IOURING, name) == 0)
+    {
+        if((g_state.io_uring = strtob(value)) == -1)
+            errx(2, "invalid value for " CFG_IOURING);
+#ifndef HAVE_IO_URING
+        if(g_state.io_uring)
+            errx(2, "invalid setting: " CFG_IOURING ": was not built with io_uring support");
+#endif
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_PROCESSES, name) == 0)
+    {
+        g_state.processes = strtol(value, &t, 10);
+        if(*t || g_state.processes < 1 || g_state.processes > TOP_PROCESSES)
+            errx(2, "invalid setting: " CFG_PROCESSES " (must be between 1 and %d)",
+                 TOP_PROCESSES);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_TRACESESSIONS, name) == 0)
+    {
+        g_state.trace_sessions = strtol(value, &t, 10);
+        if(*t || g_state.trace_sessions < 0 || g_state.trace_sessions > 100)
+            errx(2, "invalid setting: " CFG_TRACESESSIONS " (must be between 0 and 100)");
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_TRACESIZE, name) == 0)
+    {
+        g_state.trace_size = strtol(value, &t, 10);
+        if(*t || g_state.trace_size < BOTTOM_TRACE_SIZE || g_state.trace_size > TOP_TRACE_SIZE)
+            errx(2, "invalid setting: " CFG_TRACESIZE " (must be between %d and %d)",
+                 BOTTOM_TRACE_SIZE, TOP_TRACE_SIZE);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_SPOOLMEMORY, name) == 0)
+    {
+        g_state.spool_memory = strtol(value, &t, 10);
+        if(*t || g_state.spool_memory < 0 || g_state.spool_memory > TOP_SPOOL_MEMORY)
+            errx(2, "invalid setting: " CFG_SPOOLMEMORY " (must be between 0 and %d)",
+                 TOP_SPOOL_MEMORY);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_SPOOLSOFT, name) == 0)
+    {
+        g_state.spool_soft = strtol(value, &t, 10);
+        if(*t || g_state.spool_soft < 0 || g_state.spool_soft > TOP_SPOOL_LIMIT)
+            errx(2, "invalid setting: " CFG_SPOOLSOFT " (must be between 0 and %d)",
+                 TOP_SPOOL_LIMIT);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_SPOOLHARD, name) == 0)
+    {
+        g_state.spool_hard = strtol(value, &t, 10);
+        if(*t || g_state.spool_hard < 0 || g_state.spool_hard > TOP_SPOOL_LIMIT)
+            errx(2, "invalid setting: " CFG_SPOOLHARD " (must be between 0 and %d)",
+                 TOP_SPOOL_LIMIT);
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_TRACECLIENT, name) == 0)
+    {
+        struct sockaddr_any* clients;
+
+        clients = (struct sockaddr_any*)realloc(g_state.trace_clients,
+                        sizeof(struct sockaddr_any) * (g_state.trace_nclients + 1));
+        if(!clients)
+            errx(1, "out of memory");
+        g_state.trace_clients = clients;
+
+        if(sock_any_pton(value, &(clients[g_state.trace_nclients]), SANY_OPT_DEFPORT(0)) == -1)
+            errx(2, "invalid " CFG_TRACECLIENT " ip: %s", value);
+        g_state.trace_nclients++;
+        ret = 1;
+    }
+
+    else if(strcasecmp(CFG_AFFINITY, name) == 0)
+    {
+        if((g_state.cpu_affinity = strtob(value)) == -1)
+            errx(2, "invalid value for " CFG_AFFINITY);
+        ret = 1;
+    }
+
     else if(strcasecmp(CFG_XCLIENT, name) == 0)
     {
         if((g_state.xclient = strtob(value)) == -1)
@@ -2283,6 +4665,13 @@ int sp_parse_option(const char* name, const char* value)
         ret = 1;
     }
 
+    else if(strcasecmp(CFG_CHUNKING, name) == 0)
+    {
+        if((g_state.chunking = strtob(value)) == -1)
+            errx(2, "invalid value for " CFG_CHUNKING);
+        ret = 1;
+    }
+
     else if(strcasecmp(CFG_OUTADDR, name) == 0)
     {
         if(sock_any_pton(value, &(g_state.outaddr), SANY_OPT_DEFPORT(25)) == -1)
@@ -39,9 +39,13 @@
 #ifndef __SMTPPASS_H__
 #define __SMTPPASS_H__
 
+#include "spscan.h"
+
 /* Forward declarations */
 struct sockaddr_any;
 struct spctx;
+struct sptrace;
+struct sppipeline;
 
 /* -----------------------------------------------------------------------------
  * BUFFERED MULTIPLEXING IO
@@ -62,18 +66,47 @@ struct spctx;
     #define SP_LINE_LENGTH (MAXPATHLEN + 128)
 #endif
 
+/* Line buffers start out this size, and grow up to SP_LINE_LENGTH */
+#define SP_LINE_MIN 256
+
+/* Room for many lines at once, for reading lots of them */
+#define SP_READ_LENGTH (SP_LINE_LENGTH * 8)
+
+/* Message data is read in blocks of up to this much */
+#define SP_DATA_LENGTH (64 * 1024)
+
+/* Output is held back until there's this much, or a peer is waited on */
+#define SP_WRITE_LENGTH (16 * 1024)
+
 typedef struct spio
 {
     int fd;                             /* The file descriptor wrapped */
     const char* name;                   /* The name for logging */
-    time_t last_action;                 /* Time of last action on descriptor */
-    char peername[MAXPATHLEN];          /* Name of the peer on other side of socket */
-    char localname[MAXPATHLEN];         /* Address where we accepted the connection */
+    unsigned long long last_action;     /* Time of last action on descriptor, see spwheel_clock() */
+    struct sockaddr_any peeraddr;       /* Address of the peer on other side of socket */
+    struct sockaddr_any localaddr;      /* Address where we accepted the connection */
+
+    char* line;                         /* The last line read, in _buf */
 
     /* Internal use only */
-    char line[SP_LINE_LENGTH];
-    char* _nx;
+    char* _buf;                         /* Points to _small unless it's grown */
+    size_t _sz;
+    size_t _st;                         /* Data after the last line, in _buf */
     size_t _ln;
+    int _sv;                            /* What the line's terminator covers, or -1 */
+    char* _peername;                    /* Formatted when first asked for */
+    char* _localname;
+    const char* _in;                    /* Received elsewhere and fed to us */
+    int _inlen;
+    int _inerr;                         /* Fed end of stream (-1) or an errno */
+    char* _inbuf;                       /* Our own copy of _in, once kept */
+    char* _out;                         /* Written but not sent, _osmall unless grown */
+    size_t _outsz;
+    size_t _outlen;
+    int _eager;                         /* Sent on after the end of data without a reply */
+    int _defer;                         /* Writes don't wait, see spio_defer() */
+    char _small[SP_LINE_MIN];
+    char _osmall[SP_LINE_MIN];
 }
 spio_t;
 
@@ -82,28 +115,101 @@ spio_t;
 /* Setup the io structure (allocated elsewhere) */
 void spio_init(spio_t* io, const char* name);
 
+/* Free the buffers held by the io structure */
+void spio_free(spio_t* io);
+
+/* The peer and local addresses as text, or "UNKNOWN" */
+const char* spio_peername(spio_t* io);
+const char* spio_localname(spio_t* io);
+
+/* Make room for reading up to size at once, or give back the room */
+int spio_reserve(struct spctx* ctx, spio_t* io, size_t size);
+void spio_compact(spio_t* io);
+
 /* Attach an open descriptor to a socket, optionally returning the peer */
 void spio_attach(struct spctx* ctx, spio_t* io, int fd, struct sockaddr_any* peer);
 
-/* Connect and disconnect from sockets */
-int  spio_connect(struct spctx* ctx, spio_t* io, const struct sockaddr_any* sdst,
+/* Most addresses of the server that are tried */
+#define SP_CONNECT_MAX      8
+
+/*
+ * Connect to one of ndst addresses, and disconnect. When there are several
+ * they're tried a little apart without waiting for the others to fail, and
+ * the first to connect is used.
+ */
+int  spio_connect(struct spctx* ctx, spio_t* io, const struct sockaddr_any* sdst, int ndst,
                   const char* dstname, const struct sockaddr_any* ssrc, const char* srcname);
 void spio_disconnect(struct spctx* ctx, spio_t* io);
 
 #define SPIO_TRIM           0x00000001
 #define SPIO_DISCARD        0x00000002
 #define SPIO_QUIET          0x00000004
+#define SPIO_NONBLOCK       0x00000008
+#define SPIO_BUFFERED       0x00000010  /* Only what's been fed, with SPIO_NONBLOCK */
+#define SPIO_PIPELINED      0x00000020  /* More can follow the end of data, see below */
+
+/* Returned when SPIO_NONBLOCK and a full line isn't available yet */
+#define SPIO_AGAIN          -2
 
 /* Read a line from a socket. Use options above. Line
  * will be found in io->line */
 int spio_read_line(struct spctx* ctx, spio_t* io, int opts);
 
+/*
+ * Read message data in blocks of whatever has arrived, left where it was
+ * received. Stuffed dots are taken out, and the scan keeps track of lines
+ * between calls. Returns the length of the block in data, which is valid
+ * until the next read, zero once the end of data line has been read, or
+ * -1 on failure, including the connection ending early.
+ */
+int spio_read_data(struct spctx* ctx, spio_t* io, spscan_t* scan, const char** data);
+
+/*
+ * Read up to len bytes as they are, for data whose length was given up
+ * front. Returns how many are in data, which is valid until the next read,
+ * or -1 on failure, including the connection ending early.
+ */
+int spio_read_count(struct spctx* ctx, spio_t* io, size_t len, const char** data);
+
 /* Write data to socket (must supply line endings if needed).
- * Guaranteed to accept all data or fail. */
+ * Guaranteed to accept all data or fail. Small writes are held back,
+ * and sent before either socket is waited on, or when flushed. */
 int spio_write_data(struct spctx* ctx, spio_t* io, const char* data);
 int spio_write_dataf(struct spctx* ctx, spio_t* io, const char* fmt, ...);
 int spio_write_data_raw(struct spctx* ctx, spio_t* io, const unsigned char* buf, int len);
 
+/* Send anything held back. A failure closes the socket */
+int spio_flush(struct spctx* ctx, spio_t* io);
+
+/*
+ * While set, writes never wait on the socket, and what it won't take
+ * yet stays held back. For an event loop thread, which mustn't block.
+ * spio_held() says whether anything is, for a flush without it set.
+ */
+void spio_defer(spio_t* io, int defer);
+int spio_held(spio_t* io);
+
+/* Send len bytes of a file from off, after anything held back. This
+ * is done without copying where the system can. A failure closes the
+ * socket, as does the file ending early */
+int spio_write_file(struct spctx* ctx, spio_t* io, int fd, off_t off, size_t len);
+
+/*
+ * Pass message data on from io to another socket as it is, up to the
+ * end of data line which isn't passed on. Where it can, this is spliced
+ * across without the data being copied, which relies on the peer waiting
+ * for a reply after the end. SPIO_PIPELINED says it mightn't, and then
+ * all of the data is looked over, as it is once the peer has been seen
+ * not to wait. Anything sent after the end is read as usual. Returns the
+ * number of bytes passed on, or -1.
+ */
+int spio_relay_data(struct spctx* ctx, spio_t* io, spio_t* to, int opts);
+
+/* Hand over data received for the socket elsewhere, zero for the end of
+ * the stream, or a negative errno. Data is borrowed until spio_keep() */
+int spio_feed(spio_t* io, const char* data, int len);
+int spio_keep(struct spctx* ctx, spio_t* io);
+
 /* Empty the given socket */
 void spio_read_junk(struct spctx* sp, spio_t* io);
 
@@ -119,6 +225,14 @@ unsigned int  spio_select(struct spctx* ctx);
  * they get truncated by syslog. */
 #define SP_LOG_LINE_LEN  768
 
+/* Noted as the cache is written, so it needn't be looked at again */
+typedef struct spcachenote
+{
+    spscan_t scan;
+    int dots;                       /* A line starts with a dot, to be stuffed */
+}
+spcachenote_t;
+
 typedef struct spctx
 {
     unsigned int id;                /* Identifier for the connection */
@@ -126,8 +240,7 @@ typedef struct spctx
     spio_t client;                  /* Connection to client */
     spio_t server;                  /* Connection to server */
 
-    FILE* cachefile;                /* The file handle for the cached file */
-    char cachename[MAXPATHLEN];     /* The name of the file that we cache into */
+    const char* cachename;          /* The cache file, once there is one */
     char logline[SP_LOG_LINE_LEN];  /* Log line */
 
     char* helo;                     /* The HELO/EHLO the client sent */
@@ -136,8 +249,17 @@ typedef struct spctx
     char* xforwardaddr;             /* The IP address proxied for */
     char* xforwardhelo;             /* The HELO/EHLO proxied for */
     int authenticated;              /* Whether the client authenticated successfully */
-
-    int _crlf;                      /* Private data */
+    struct sptrace* trace;          /* What went across, when the session is traced */
+
+    spscan_t _scan;                 /* Private data */
+    int _traced;
+    struct sppipeline* _pipe;
+    struct spchunks* _chunks;
+    const char* _chunkfail;
+    int _bdat;
+    struct spspool* _spool;
+    struct spspool* _spare;
+    spcachenote_t _cache;
 }
 spctx_t;
 
@@ -189,37 +311,51 @@ int sp_parse_option(const char* name, const char* option);
 /*
  * Adds a piece of info to the log line
  */
-void sp_add_log(spctx_t* ctx, char* prefix, char* line);
+void sp_add_log(spctx_t* ctx, char* prefix, const char* line);
 
 /*
  * Tells client to start sending data. Sends appropriate
- * response code.
+ * response code. A message sent with BDAT is already in
+ * the cache, and nothing is sent.
  */
 int sp_start_data(spctx_t* ctx);
 
 /*
- * Reads a line of DATA from client. Or less than a line if
- * line is longer than LINE_LENGTH. No trimming or anything
- * is done on the read line. This will end automatically
- * when <CRLF>.<CRLF> is detected (in which case 0 will
- * be returned). The data is returned in data.
+ * Reads a block of DATA from client, as much as has come in
+ * and up to SP_DATA_LENGTH. Dots the client stuffed in are
+ * taken back out. This will end automatically when
+ * <CRLF>.<CRLF> is detected (in which case 0 will be
+ * returned), and the marker isn't part of the data. The
+ * data is returned in data, until the next call. A message
+ * sent with BDAT is read back from the cache instead.
  */
-int sp_read_data(spctx_t* ctx, const char** data);
+int sp_read_data_block(spctx_t* ctx, const char** data);
 
 /*
- * Writes a line (or piece) of data to a file buffer which is
- * later sent to the client using sp_done_data. Calling it with
- * a NULL buffer closes the cache file. Guaranteed to accept
- * all data given to it or fail.
+ * Writes a block of data to the cache which is later sent
+ * to the client using sp_done_data. Calling it with a NULL
+ * buffer finishes the cache. Guaranteed to accept all data
+ * given to it or fail.
  */
 int sp_write_data(spctx_t* ctx, const char* buf, int buflen);
 
 /*
- * Sends all DATA from the client into the cache. The cache
- * file is then available (in spctx_t->cachename) for use.
+ * Sends all DATA from the client into the cache. Small
+ * messages are kept in memory. A message sent with BDAT
+ * is there already, with its chunks as they came, which
+ * may hold lone dot lines. See sp_cache_file.
  */
 int sp_cache_data(spctx_t* ctx);
 
+/*
+ * Puts the finished cache in a file, if it isn't already,
+ * and returns its name (also in spctx_t->cachename). For
+ * when something outside needs to open it. NULL on failure.
+ * The file holds the message without dot stuffing, so what
+ * sends it on over SMTP has to stuff it again.
+ */
+const char* sp_cache_file(spctx_t* ctx);
+
 /*
  * Sends the data in file buffer off to server. This is
  * completes a successful mail transfer.
@@ -266,6 +402,21 @@ void sp_messagex(spctx_t* ctx, int level, const char* msg, ...);
 void sp_lock();
 void sp_unlock();
 
+/*
+ * Wait on descriptors just like poll(). Use this rather than
+ * poll() or sleeping, so that connections running on an event
+ * loop let others run while they wait.
+ */
+struct pollfd;
+int sp_poll(struct pollfd* fds, int nfds, int timeout);
+
+/*
+ * Call func, for something that blocks without a descriptor
+ * to wait on, like forking. Connections on an event loop
+ * have it run on another thread, and let others run.
+ */
+void sp_call(void (*func)(void*), void* arg);
+
 
 /* -----------------------------------------------------------------------------
  * CALLBACKS IMPLMEMENTED BY PROGRAM
@@ -290,7 +441,7 @@ extern int cb_check_pre(spctx_t* ctx);
 /*
  * Called when the data section of an email is being transferred.
  * Once inside this function you can transfer files using
- * sp_read_data, sp_write_data.
+ * sp_read_data_block, sp_write_data.
  *
  * After scanning or figuring out the status call either
  * sp_done_data or sp_fail_data. Most failures should be handled
@@ -52,7 +52,7 @@
 
 #define LOCALHOST_ADDR  0x7F000001
 
-int sock_any_pton(const char* addr, struct sockaddr_any* any, int opts)
+static int pton_literal(const char* addr, struct sockaddr_any* any, int opts)
 {
   size_t l;
   char buf[256];
@@ -242,65 +242,106 @@ int sock_any_pton(const char* addr, struct sockaddr_any* any, int opts)
   }
   while(0);
 
-  /* A DNS name and a port? */
-  do
-  {
-    struct addrinfo* res;
-    int port = 0;
-    t = NULL;
+  return -1;
+}
 
-    l = strlen(addr);
-    if(l >= 255 || !isalpha(addr[0]))
-      break;
+/* Resolve a DNS name and a port into at most max addresses */
+static int pton_name(const char* addr, struct sockaddr_any* anys, int max, int opts)
+{
+  struct addrinfo hints;
+  struct addrinfo* res;
+  struct addrinfo* ai;
+  size_t l;
+  char buf[256];
+  char* t;
+  char* t2;
+  int defport = (opts & 0xFFFF);
+  int port = 0;
+  int n = 0;
 
-    /* Some basic illegal character checks */
-    if(strcspn(addr, " /\\") != l)
-      break;
+  l = strlen(addr);
+  if(l >= 255 || !isalpha(addr[0]))
+    return -1;
 
-    strcpy(buf, addr);
+  /* Some basic illegal character checks */
+  if(strcspn(addr, " /\\") != l)
+    return -1;
 
-    /* Find the last set that contains just numbers */
-    t = strchr(buf, ':');
-    if(t)
-    {
-      *t = 0;
-      t++;
-    }
+  strcpy(buf, addr);
 
-    if(t)
-    {
-      port = strtol(t, &t2, 10);
-      if(*t2 || port <= 0 || port >= 65536)
-        break;
-    }
+  /* Find the last set that contains just numbers */
+  t = strchr(buf, ':');
+  if(t)
+  {
+    *t = 0;
+    t++;
+  }
 
-    /* Try and resolve the domain name */
-    if(getaddrinfo(buf, NULL, NULL, &res) != 0 || !res)
-      break;
+  if(t)
+  {
+    port = strtol(t, &t2, 10);
+    if(*t2 || port <= 0 || port >= 65536)
+      return -1;
+  }
+
+  /* Try and resolve the domain name, once for each address */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(buf, NULL, &hints, &res) != 0 || !res)
+    return -1;
 
-    memcpy(&(any->s.a), res->ai_addr, sizeof(struct sockaddr));
-    any->namelen = res->ai_addrlen;
-    freeaddrinfo(res);
+  port = htons((unsigned short)(port <= 0 ? defport : port));
 
-    port = htons((unsigned short)(port <= 0 ? defport : port));
+  for(ai = res; ai && n < max; ai = ai->ai_next)
+  {
+    if(ai->ai_addrlen > sizeof(anys[n].s))
+      continue;
 
-    switch(any->s.a.sa_family)
+    memset(&(anys[n]), 0, sizeof(anys[n]));
+    memcpy(&(anys[n].s.a), ai->ai_addr, ai->ai_addrlen);
+    anys[n].namelen = ai->ai_addrlen;
+
+    switch(anys[n].s.a.sa_family)
     {
     case PF_INET:
-      any->s.in.sin_port = port;
+      anys[n].s.in.sin_port = port;
       break;
 #ifdef HAVE_INET6
     case PF_INET6:
-      any->s.in6.sin6_port = port;
+      anys[n].s.in6.sin6_port = port;
       break;
 #endif
+    default:
+      continue;
     };
 
-    return any->s.a.sa_family;
+    n++;
   }
-  while(0);
 
-  return -1;
+  freeaddrinfo(res);
+  return n > 0 ? n : -1;
+}
+
+int sock_any_pton(const char* addr, struct sockaddr_any* any, int opts)
+{
+  int r = pton_literal(addr, any, opts);
+
+  /* A DNS name and a port? */
+  if(r == -1 && pton_name(addr, any, 1, opts) == 1)
+    r = any->s.a.sa_family;
+
+  return r;
+}
+
+int sock_any_pton_all(const char* addr, struct sockaddr_any* anys, int max, int opts)
+{
+  if(max < 1)
+    return -1;
+
+  if(pton_literal(addr, anys, opts) != -1)
+    return 1;
+
+  return pton_name(addr, anys, max, opts);
 }
 
 int sock_any_ntop(const struct sockaddr_any* any, char* addr, size_t addrlen, int opts)
@@ -68,6 +68,10 @@ struct sockaddr_any
 
 int sock_any_pton(const char* addr, struct sockaddr_any* any, int opts);
 
+/* Like sock_any_pton, but gives all the addresses a name resolves to,
+ * at most max. Returns how many, or -1 */
+int sock_any_pton_all(const char* addr, struct sockaddr_any* anys, int max, int opts);
+
 /* The default port to fill in when no IP/IPv6 port specified */
 #define SANY_OPT_DEFPORT(p)     (int)((p) & 0xFFFF)
 
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spevent.h"
+#include "spwork.h"
+#include "spcoro.h"
+
+#ifdef HAVE_UCONTEXT_H
+
+#include <ucontext.h>
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+/* A stack, in memory that came from mmap */
+typedef struct spstack
+{
+    struct spstack* next;       /* When cached, other stacks */
+}
+spstack_t;
+
+struct spcoro
+{
+    ucontext_t uc;              /* Where the coroutine is at */
+    spevloop_t* loop;           /* The loop it runs on */
+    void (*func)(void*);
+    void (*done)(void*);
+    void* arg;
+
+    char* stack;                /* Bottom of the mapping, the guard page */
+    int finished;               /* func has returned */
+
+    /* While waiting in spcoro_poll */
+    int waiting;
+    struct pollfd* fds;
+    int nfds;
+    spevwatch_t watches[SPCORO_MAX_FDS];
+    spevtimer_t timer;
+
+    /* While waiting in spcoro_write */
+    spevop_t op;
+    int result;
+
+    /* While waiting in spcoro_call */
+    spwork_t work;
+    spevpost_t post;
+    void (*call)(void*);
+    void* callarg;
+};
+
+/* -----------------------------------------------------------------------
+ *  GLOBALS
+ */
+
+/* The coroutine running on this thread, and where to go back to */
+static __thread spcoro_t* t_current = NULL;
+static __thread ucontext_t* t_caller = NULL;
+
+/* Stacks kept around by each thread for reuse */
+static pthread_key_t g_stacks;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+/* Stack size used when the threads get the system default */
+#define DEFAULT_STACK       (256 * 1024)
+
+/* How many unused stacks each thread holds on to */
+#define MAX_CACHED          16
+
+/* -----------------------------------------------------------------------
+ *  STACKS
+ */
+
+static size_t stack_size()
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = g_state.stack_size > 0 ?
+                        (size_t)g_state.stack_size * 1024 : DEFAULT_STACK;
+
+    /* Plus one page for the guard */
+    return ((size + page - 1) & ~(page - 1)) + page;
+}
+
+static void free_stacks(void* arg)
+{
+    spstack_t* st = (spstack_t*)arg;
+    spstack_t* next;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for( ; st; st = next)
+    {
+        next = st->next;
+        munmap((char*)st - page, stack_size());
+    }
+}
+
+static void make_key()
+{
+    pthread_key_create(&g_stacks, free_stacks);
+}
+
+static char* get_stack()
+{
+    spstack_t* st;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char* stack;
+
+    pthread_once(&g_once, make_key);
+
+    /* The link is kept just above the guard page */
+    st = (spstack_t*)pthread_getspecific(g_stacks);
+    if(st)
+    {
+        pthread_setspecific(g_stacks, st->next);
+        return (char*)st - page;
+    }
+
+    stack = mmap(NULL, stack_size(), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(stack == MAP_FAILED)
+    {
+        sp_message(NULL, LOG_ERR, "couldn't allocate coroutine stack");
+        return NULL;
+    }
+
+    /* Running off the end faults rather than trampling other memory */
+    if(mprotect(stack, page, PROT_NONE) == -1)
+    {
+        sp_message(NULL, LOG_ERR, "couldn't protect coroutine stack");
+        munmap(stack, stack_size());
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void put_stack(char* stack)
+{
+    spstack_t* head = (spstack_t*)pthread_getspecific(g_stacks);
+    spstack_t* st;
+    int count = 0;
+
+    for(st = head; st; st = st->next)
+        count++;
+
+    if(count >= MAX_CACHED)
+    {
+        munmap(stack, stack_size());
+        return;
+    }
+
+    /* The guard page is at the bottom, so keep the link above it */
+    st = (spstack_t*)(stack + sysconf(_SC_PAGESIZE));
+    st->next = head;
+    pthread_setspecific(g_stacks, st);
+}
+
+/* -----------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+static void coro_main()
+{
+    spcoro_t* co = t_current;
+
+    (co->func)(co->arg);
+
+    /* Never resumed after this */
+    co->finished = 1;
+    swapcontext(&(co->uc), t_caller);
+}
+
+/* Switch to the coroutine until it yields or finishes */
+static void coro_resume(spcoro_t* co)
+{
+    ucontext_t caller;
+    void (*done)(void*);
+    void* arg;
+
+    ASSERT(!t_current);
+
+    t_current = co;
+    t_caller = &caller;
+
+    if(swapcontext(&caller, &(co->uc)) == -1)
+        sp_message(NULL, LOG_CRIT, "couldn't switch to coroutine");
+
+    t_current = NULL;
+    t_caller = NULL;
+
+    /* On the loop's stack now, so the coroutine can go away */
+    if(co->finished)
+    {
+        done = co->done;
+        arg = co->arg;
+
+        put_stack(co->stack);
+        free(co);
+
+        (done)(arg);
+    }
+}
+
+static void coro_wake(spcoro_t* co)
+{
+    if(co->waiting)
+    {
+        co->waiting = 0;
+        coro_resume(co);
+    }
+}
+
+static void coro_event(spevwatch_t* w, int events)
+{
+    spcoro_t* co = (spcoro_t*)w->arg;
+    struct pollfd* pfd = co->fds + (w - co->watches);
+
+    if(events & SPEV_READ)
+        pfd->revents |= POLLIN;
+    if(events & SPEV_WRITE)
+        pfd->revents |= POLLOUT;
+
+    /* As with poll(), a reader finds out about errors by reading */
+    if(events & SPEV_ERROR)
+        pfd->revents |= POLLERR | POLLHUP | (pfd->events & POLLIN);
+
+    coro_wake(co);
+}
+
+static void coro_timer(spevtimer_t* t)
+{
+    coro_wake((spcoro_t*)t->arg);
+}
+
+static void coro_written(spevop_t* op, int result)
+{
+    spcoro_t* co = (spcoro_t*)op->arg;
+
+    co->result = result;
+    coro_wake(co);
+}
+
+static void coro_called(void* arg)
+{
+    coro_wake((spcoro_t*)arg);
+}
+
+/* On the worker thread, then back to the loop with the result */
+static void coro_worker(spwork_t* work)
+{
+    spcoro_t* co = (spcoro_t*)work->arg;
+
+    (co->call)(co->callarg);
+
+    co->post.func = coro_called;
+    co->post.arg = co;
+    spev_post(co->loop, &(co->post));
+}
+
+int spcoro_run(spevloop_t* loop, void (*func)(void*),
+               void (*done)(void*), void* arg)
+{
+    spcoro_t* co;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    ASSERT(loop && func && done);
+
+    co = (spcoro_t*)calloc(1, sizeof(spcoro_t));
+    if(!co)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        return -1;
+    }
+
+    /* Kept in co, as the compiler takes getcontext() to return twice */
+    co->stack = get_stack();
+    if(!co->stack)
+    {
+        free(co);
+        return -1;
+    }
+
+    if(getcontext(&(co->uc)) == -1)
+    {
+        sp_message(NULL, LOG_CRIT, "couldn't create coroutine");
+        put_stack(co->stack);
+        free(co);
+        return -1;
+    }
+
+    co->loop = loop;
+    co->func = func;
+    co->done = done;
+    co->arg = arg;
+    co->timer.callback = coro_timer;
+    co->timer.arg = co;
+
+    co->uc.uc_stack.ss_sp = co->stack + page;
+    co->uc.uc_stack.ss_size = stack_size() - page;
+    co->uc.uc_link = NULL;
+    makecontext(&(co->uc), coro_main, 0);
+
+    coro_resume(co);
+    return 0;
+}
+
+int spcoro_self()
+{
+    return t_current != NULL;
+}
+
+int spcoro_poll(struct pollfd* fds, int nfds, int timeout)
+{
+    spcoro_t* co = t_current;
+    spevwatch_t* w;
+    int i, ret = 0;
+
+    ASSERT(co);
+    ASSERT(nfds <= SPCORO_MAX_FDS);
+
+    co->fds = fds;
+    co->nfds = nfds;
+
+    for(i = 0; i < nfds; i++)
+    {
+        w = co->watches + i;
+        w->fd = fds[i].fd;
+        w->events = ((fds[i].events & POLLIN) ? SPEV_READ : 0) |
+                    ((fds[i].events & POLLOUT) ? SPEV_WRITE : 0);
+        w->callback = coro_event;
+        w->arg = co;
+
+        fds[i].revents = 0;
+
+        /* As with poll(), negative descriptors are ignored */
+        if(w->fd < 0 || !w->events)
+        {
+            w->fd = -1;
+            continue;
+        }
+
+        /* We stop waiting after the first event anyway */
+        w->events |= SPEV_ONCE;
+
+        if(spev_watch(co->loop, w) == -1)
+        {
+            fds[i].revents = POLLNVAL;
+            w->fd = -1;
+            ret++;
+        }
+    }
+
+    /* Something was already wrong, no need to wait */
+    if(ret == 0)
+    {
+        if(timeout >= 0)
+            spev_timer(co->loop, &(co->timer), timeout);
+
+        /* Back to the loop until something happens */
+        co->waiting = 1;
+        swapcontext(&(co->uc), t_caller);
+
+        if(timeout >= 0)
+            spev_untimer(co->loop, &(co->timer));
+    }
+
+    for(i = 0; i < nfds; i++)
+    {
+        w = co->watches + i;
+        if(w->fd != -1)
+            spev_unwatch(co->loop, w);
+        if(fds[i].revents && !(fds[i].revents & POLLNVAL))
+            ret++;
+    }
+
+    return ret;
+}
+
+ssize_t spcoro_write(int fd, const void* buf, size_t len, off_t off)
+{
+    spcoro_t* co = t_current;
+
+    if(co)
+    {
+        co->op.callback = coro_written;
+        co->op.arg = co;
+
+        if(spev_write(co->loop, &(co->op), fd, buf, len, off) == 0)
+        {
+            /* Back to the loop until the write is done */
+            co->waiting = 1;
+            swapcontext(&(co->uc), t_caller);
+
+            if(co->result < 0)
+            {
+                errno = -(co->result);
+                return -1;
+            }
+
+            return co->result;
+        }
+    }
+
+    return pwrite(fd, buf, len, off);
+}
+
+void spcoro_call(void (*func)(void*), void* arg)
+{
+    spcoro_t* co = t_current;
+
+    ASSERT(func);
+
+    if(co)
+    {
+        co->call = func;
+        co->callarg = arg;
+        co->work.func = coro_worker;
+        co->work.arg = co;
+        co->work.fd = -1;
+
+        /* The post can't run before we yield, it's for this thread */
+        co->waiting = 1;
+        if(spwork_push(spev_loop_index(co->loop) % spwork_queues(), &(co->work)) == 0)
+        {
+            swapcontext(&(co->uc), t_caller);
+            return;
+        }
+
+        co->waiting = 0;
+    }
+
+    (func)(arg);
+}
+
+#else /* HAVE_UCONTEXT_H */
+
+int spcoro_run(struct spevloop* loop, void (*func)(void*),
+               void (*done)(void*), void* arg)
+{
+    return -1;
+}
+
+int spcoro_self()
+{
+    return 0;
+}
+
+int spcoro_poll(struct pollfd* fds, int nfds, int timeout)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t spcoro_write(int fd, const void* buf, size_t len, off_t off)
+{
+    return pwrite(fd, buf, len, off);
+}
+
+void spcoro_call(void (*func)(void*), void* arg)
+{
+    (func)(arg);
+}
+
+#endif /* HAVE_UCONTEXT_H */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPCORO_H__
+#define __SPCORO_H__
+
+/* -----------------------------------------------------------------------------
+ * COROUTINES
+ *
+ * Sequential code that runs on an event loop thread. When it would block
+ * on a descriptor it yields back to the loop, and is resumed when the
+ * descriptor is ready. Each coroutine has its own small stack with a guard
+ * page below it.
+ */
+
+struct spcoro;
+typedef struct spcoro spcoro_t;
+
+struct pollfd;
+struct spevloop;
+
+/* Most descriptors a coroutine can wait on at once */
+#define SPCORO_MAX_FDS      4
+
+/*
+ * Run func on the loop thread as a coroutine. When func returns, done
+ * is called on the loop's own stack and the coroutine goes away. Only
+ * called on the loop thread. Returns -1 if a coroutine couldn't be made,
+ * and then neither function is called.
+ */
+int spcoro_run(struct spevloop* loop, void (*func)(void*),
+               void (*done)(void*), void* arg);
+
+/* Whether we're running in a coroutine */
+int spcoro_self();
+
+/* Like poll(), but yields to the loop while waiting. Only in a coroutine */
+int spcoro_poll(struct pollfd* fds, int nfds, int timeout);
+
+/*
+ * Like pwrite(), but in a coroutine on an io_uring loop the write is done
+ * by the kernel while others run. Otherwise it just writes.
+ */
+ssize_t spcoro_write(int fd, const void* buf, size_t len, off_t off);
+
+/*
+ * Call func on a worker thread, yielding to the loop until it returns.
+ * For things that block without a descriptor to wait on, like looking
+ * up names or forking. Outside a coroutine it's just called.
+ */
+void spcoro_call(void (*func)(void*), void* arg);
+
+#endif /* __SPCORO_H__ */
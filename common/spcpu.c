@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spcpu.h"
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(HAVE_SCHED_GETCPU)
+
+#include <sched.h>
+#include <sys/syscall.h>
+
+/* -----------------------------------------------------------------------
+ *  GLOBALS
+ */
+
+static int g_enabled = 0;
+static int* g_cpus = NULL;          /* CPUs in shard order, nodes taking turns */
+static int g_ncpus = 0;
+static int g_first = 0;             /* Where our shards start in g_cpus */
+static int* g_cpunode = NULL;       /* The node of each CPU, by CPU number */
+static int g_maxcpu = 0;
+static int* g_nodeids = NULL;       /* The kernel's number for each of our nodes */
+static int g_nnodes = 1;
+
+/* Where the kernel describes the nodes */
+#define NODE_PATH       "/sys/devices/system/node"
+
+/* From the mbind(2) man page, as numaif.h may not be around */
+#define PREFER_NODE     1
+
+/* -----------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+/* Parse a list like "0-3,8,10-11" and mark those CPUs as on node */
+static void parse_cpulist(const char* list, int node)
+{
+    char* t;
+    long lo, hi;
+
+    while(*list)
+    {
+        lo = strtol(list, &t, 10);
+        if(t == list)
+            break;
+
+        hi = lo;
+        if(*t == '-')
+            hi = strtol(t + 1, &t, 10);
+
+        for( ; lo <= hi && lo < g_maxcpu; lo++)
+        {
+            if(lo >= 0)
+                g_cpunode[lo] = node;
+        }
+
+        list = t;
+        if(*list == ',')
+            list++;
+        else
+            break;
+    }
+}
+
+static void read_nodes()
+{
+    char path[MAXPATHLEN];
+    char line[1024];
+    struct dirent* ent;
+    FILE* f;
+    DIR* dir;
+    int node;
+
+    dir = opendir(NODE_PATH);
+    if(!dir)
+        return;
+
+    while((ent = readdir(dir)) != NULL)
+    {
+        if(sscanf(ent->d_name, "node%d", &node) != 1 || node < 0)
+            continue;
+
+        snprintf(path, sizeof(path), NODE_PATH "/%s/cpulist", ent->d_name);
+        f = fopen(path, "r");
+        if(!f)
+            continue;
+
+        if(fgets(line, sizeof(line), f))
+            parse_cpulist(line, node);
+        fclose(f);
+    }
+
+    closedir(dir);
+}
+
+int spcpu_init(int enable, int part, int parts)
+{
+    cpu_set_t allowed;
+    int total, nnodes = 0;
+    int i, j, k, n;
+
+    if(!enable)
+        return 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        sp_message(NULL, LOG_ERR, "couldn't get cpu affinity");
+        return -1;
+    }
+
+    g_maxcpu = CPU_SETSIZE;
+    g_cpunode = (int*)calloc(g_maxcpu, sizeof(int));
+    g_cpus = (int*)calloc(g_maxcpu, sizeof(int));
+    g_nodeids = (int*)calloc(g_maxcpu, sizeof(int));
+    if(!g_cpunode || !g_cpus || !g_nodeids)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        spcpu_done();
+        return -1;
+    }
+
+    /* Without NUMA everything is on node zero */
+    read_nodes();
+
+    /* Number the nodes that have CPUs we may use */
+    for(i = 0; i < g_maxcpu; i++)
+    {
+        if(!CPU_ISSET(i, &allowed))
+            continue;
+
+        for(j = 0; j < nnodes && g_nodeids[j] != g_cpunode[i]; j++)
+            ;
+        if(j == nnodes)
+            g_nodeids[nnodes++] = g_cpunode[i];
+        g_cpunode[i] = j;
+    }
+
+    /* Nodes take turns, so neighbouring shards land on different nodes */
+    total = CPU_COUNT(&allowed);
+    for(k = 0; g_ncpus < total; k++)
+    {
+        for(n = 0; n < nnodes; n++)
+        {
+            /* The k-th CPU of this node, if it has that many */
+            for(i = 0, j = 0; i < g_maxcpu; i++)
+            {
+                if(CPU_ISSET(i, &allowed) && g_cpunode[i] == n && j++ == k)
+                {
+                    g_cpus[g_ncpus++] = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    g_nnodes = nnodes;
+    g_first = (g_ncpus * part) / parts;
+    g_enabled = 1;
+
+    sp_messagex(NULL, LOG_DEBUG, "pinning to %d cpus on %d nodes", g_ncpus, g_nnodes);
+    return 0;
+}
+
+void spcpu_done()
+{
+    free(g_cpus);
+    free(g_cpunode);
+    free(g_nodeids);
+    g_cpus = g_cpunode = g_nodeids = NULL;
+    g_ncpus = g_maxcpu = g_first = 0;
+    g_nnodes = 1;
+    g_enabled = 0;
+}
+
+int spcpu_nodes()
+{
+    return g_nnodes;
+}
+
+int spcpu_node(int shard)
+{
+    if(!g_enabled)
+        return 0;
+
+    ASSERT(shard >= 0);
+    return g_cpunode[g_cpus[(g_first + shard) % g_ncpus]];
+}
+
+void spcpu_pin(int shard)
+{
+    cpu_set_t set;
+    int cpu, r;
+
+    if(!g_enabled)
+        return;
+
+    ASSERT(shard >= 0);
+
+    cpu = g_cpus[(g_first + shard) % g_ncpus];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(r != 0)
+    {
+        errno = r;
+        sp_message(NULL, LOG_WARNING, "couldn't pin thread to cpu %d", cpu);
+    }
+}
+
+void spcpu_unpin()
+{
+    cpu_set_t set;
+    int cpu, node, i;
+
+    if(!g_enabled)
+        return;
+
+    cpu = sched_getcpu();
+    if(cpu < 0 || cpu >= g_maxcpu)
+        return;
+
+    node = g_cpunode[cpu];
+
+    CPU_ZERO(&set);
+    for(i = 0; i < g_ncpus; i++)
+    {
+        if(g_cpunode[g_cpus[i]] == node)
+            CPU_SET(g_cpus[i], &set);
+    }
+
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+void spcpu_place(void* mem, size_t len, int node)
+{
+#ifdef __NR_mbind
+    unsigned long mask;
+
+    if(!g_enabled || g_nnodes < 2 || node < 0 || node >= g_nnodes)
+        return;
+
+    /* The kernel numbers nodes its own way */
+    node = g_nodeids[node];
+    if(node < 0 || node >= (int)(sizeof(mask) * 8))
+        return;
+
+    mask = 1UL << node;
+    syscall(__NR_mbind, mem, len, PREFER_NODE, &mask, sizeof(mask) * 8, 0);
+#endif
+}
+
+#else /* HAVE_PTHREAD_SETAFFINITY_NP */
+
+int spcpu_init(int enable, int part, int parts)
+{
+    if(enable)
+        sp_messagex(NULL, LOG_WARNING, "cpu affinity isn't supported on this system");
+    return 0;
+}
+
+void spcpu_done()
+{
+}
+
+int spcpu_nodes()
+{
+    return 1;
+}
+
+int spcpu_node(int shard)
+{
+    return 0;
+}
+
+void spcpu_pin(int shard)
+{
+}
+
+void spcpu_unpin()
+{
+}
+
+void spcpu_place(void* mem, size_t len, int node)
+{
+}
+
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
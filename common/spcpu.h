@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPCPU_H__
+#define __SPCPU_H__
+
+/* -----------------------------------------------------------------------------
+ * CPU AFFINITY
+ *
+ * Event loops, worker queues and acceptors are numbered shards. When
+ * affinity is on, each shard is pinned to a CPU, with shards spread
+ * across the NUMA nodes in turn, so that a loop and the queue with the
+ * same number share a CPU. Memory for a shard can be placed on its node.
+ */
+
+#include <sys/types.h>
+
+/*
+ * Work out which CPUs are on which node. Does nothing unless enabled.
+ * Worker process part of parts starts its shards on its own share of CPUs.
+ */
+int spcpu_init(int enable, int part, int parts);
+
+/* Forget all that */
+void spcpu_done();
+
+/* The number of nodes shards are spread over, one when not in use */
+int spcpu_nodes();
+
+/* The node a shard is on */
+int spcpu_node(int shard);
+
+/* Pin the calling thread to the shard's CPU */
+void spcpu_pin(int shard);
+
+/* Let a forked process run on any CPU of the node it's on */
+void spcpu_unpin();
+
+/* Have fresh, page aligned memory come from the node */
+void spcpu_place(void* mem, size_t len, int node);
+
+#endif /* __SPCPU_H__ */
@@ -0,0 +1,1106 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spevent.h"
+#include "spcpu.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+
+#include "spuring.h"
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+#ifdef HAVE_IO_URING
+
+/* Something waiting on the ring. Looked up by the id of its requests */
+typedef struct spevslot
+{
+    void* obj;                  /* The watch, receive or write */
+    unsigned int gen;           /* Bumped each time the slot is reused */
+    int next;                   /* Next free slot */
+}
+spevslot_t;
+
+#endif
+
+struct spevloop
+{
+    int index;                  /* Which loop this is */
+    int epfd;                   /* The epoll descriptor */
+    int wakefd;                 /* An eventfd to wake the loop */
+    pthread_t tid;              /* The loop thread */
+
+    struct epoll_event* events; /* Events currently being dispatched */
+    int nevents;
+    spwheel_t timers;           /* Pending timers */
+    char* recvbuf;              /* Where receives go without io_uring */
+
+#ifdef HAVE_IO_URING
+    spuring_t* ring;            /* Used instead of epoll when set */
+    spevslot_t* slots;          /* What requests on the ring are for */
+    int nslots;
+    int freeslot;
+#endif
+
+    pthread_mutex_t mtx;        /* Protects the following */
+    spevpost_t* posted;         /* Work posted from other threads */
+    int refs;                   /* Things that keep the loop running */
+    int stopping;               /* Loop has been asked to stop */
+};
+
+/* -----------------------------------------------------------------------
+ *  GLOBALS
+ */
+
+static spevloop_t* g_loops = NULL;
+static int g_nloops = 0;
+static unsigned int g_nextloop = 0;
+static spev_tick_t g_tick = NULL;
+
+/* Number of events to pull from the kernel at once */
+#define MAX_EVENTS      64
+
+/* States of a receive */
+#define RECV_ARMED      0x01    /* Waiting for data */
+#define RECV_WATCHED    0x02    /* Descriptor is in the epoll set */
+#define RECV_CANCEL     0x04    /* Asked the ring to cancel */
+
+#ifdef HAVE_IO_URING
+
+/* Requests we keep on each ring at once, and buffers for receiving into */
+#define RING_ENTRIES    256
+#define RING_BUFFERS    64
+
+/*
+ * The id of a request says what it's for. The generation lets us ignore
+ * completions for something that's since gone away. Zero is ignored.
+ */
+#define ID_WAKE         1
+#define ID_WATCH        2
+#define ID_RECV         3
+#define ID_WRITE        4
+
+#define MAKE_ID(t, g, i)    (((unsigned long long)(t) << 56) | \
+                             ((unsigned long long)((g) & 0xFFFFFF) << 32) | \
+                             (unsigned int)(i))
+#define ID_TYPE(id)         ((int)((id) >> 56))
+#define ID_GEN(id)          ((unsigned int)(((id) >> 32) & 0xFFFFFF))
+#define ID_INDEX(id)        ((int)((id) & 0xFFFFFFFF))
+
+#endif
+
+/* -----------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+static void wake_loop(spevloop_t* loop)
+{
+    uint64_t val = 1;
+
+    if(write(loop->wakefd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN)
+        sp_message(NULL, LOG_ERR, "couldn't wake event loop");
+}
+
+static void run_posted(spevloop_t* loop)
+{
+    spevpost_t* post;
+    spevpost_t* next;
+    spevpost_t* rev = NULL;
+    uint64_t val;
+
+    /* Clear the wakeup */
+    read(loop->wakefd, &val, sizeof(val));
+
+    sp_mutex_lock(&(loop->mtx));
+        post = loop->posted;
+        loop->posted = NULL;
+    pthread_mutex_unlock(&(loop->mtx));
+
+    /* Posted in reverse order, run them in the order they came */
+    for( ; post; post = next)
+    {
+        next = post->next;
+        post->next = rev;
+        rev = post;
+    }
+
+    for(post = rev; post; post = next)
+    {
+        next = post->next;
+        (post->func)(post->arg);
+    }
+}
+
+/* How long we can wait before the next timer is due */
+static int next_timeout(spevloop_t* loop)
+{
+    return spwheel_next(&(loop->timers), 1000);
+}
+
+static int should_exit(spevloop_t* loop)
+{
+    int ret;
+
+    sp_mutex_lock(&(loop->mtx));
+        ret = loop->stopping && loop->refs <= 0 && !loop->posted;
+    pthread_mutex_unlock(&(loop->mtx));
+
+    return ret;
+}
+
+/* -----------------------------------------------------------------------
+ *  EPOLL
+ */
+
+static int translate_events(uint32_t events)
+{
+    int ret = 0;
+
+    if(events & EPOLLIN)
+        ret |= SPEV_READ;
+    if(events & EPOLLOUT)
+        ret |= SPEV_WRITE;
+    if(events & (EPOLLERR | EPOLLHUP))
+        ret |= SPEV_ERROR;
+
+    return ret;
+}
+
+static int epoll_watch(spevloop_t* loop, spevwatch_t* w)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((w->events & SPEV_READ) ? EPOLLIN : 0) |
+                ((w->events & SPEV_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = w;
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, w->fd, &ev);
+}
+
+static void epoll_unwatch(spevloop_t* loop, spevwatch_t* w)
+{
+    int i;
+
+    if(w->fd != -1)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    /* Don't dispatch events already pulled for this watch */
+    for(i = 0; i < loop->nevents; i++)
+    {
+        if(loop->events[i].data.ptr == w)
+            loop->events[i].events = 0;
+    }
+}
+
+static int epoll_wait_loop(spevloop_t* loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    spevwatch_t* w;
+    int i, n;
+
+    n = epoll_wait(loop->epfd, events, MAX_EVENTS, next_timeout(loop));
+    if(n == -1)
+        return errno == EINTR ? 0 : -1;
+
+    loop->events = events;
+    loop->nevents = n;
+
+    for(i = 0; i < n; i++)
+    {
+        w = (spevwatch_t*)events[i].data.ptr;
+
+        /* The wakeup descriptor has a NULL watch */
+        if(w == NULL)
+            run_posted(loop);
+
+        /* Unwatched by an earlier callback, may be freed */
+        else if(events[i].events == 0)
+            continue;
+
+        else
+            (w->callback)(w, translate_events(events[i].events));
+    }
+
+    loop->events = NULL;
+    loop->nevents = 0;
+    return 0;
+}
+
+/*
+ * Receives are done when the socket is readable. The socket stays in the
+ * epoll set between receives, and only comes out when stopped, or when
+ * it's readable and nobody wants the data.
+ */
+static void epoll_recv_ready(spevwatch_t* w, int events)
+{
+    spevrecv_t* r = (spevrecv_t*)w->arg;
+    spevloop_t* loop = r->_loop;
+    int x;
+
+    if(!(r->_state & RECV_ARMED))
+    {
+        epoll_unwatch(loop, w);
+        r->_state &= ~RECV_WATCHED;
+        return;
+    }
+
+    x = recv(r->fd, loop->recvbuf, SPEV_RECV_SIZE, MSG_DONTWAIT);
+    if(x == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    r->_state &= ~RECV_ARMED;
+    (r->callback)(r, loop->recvbuf, x == -1 ? -errno : x);
+}
+
+static int epoll_recv(spevloop_t* loop, spevrecv_t* r)
+{
+    if(!(r->_state & RECV_WATCHED))
+    {
+        r->_w.fd = r->fd;
+        r->_w.events = SPEV_READ;
+        r->_w.callback = epoll_recv_ready;
+        r->_w.arg = r;
+
+        if(epoll_watch(loop, &(r->_w)) == -1)
+            return -1;
+
+        r->_state |= RECV_WATCHED;
+    }
+
+    r->_state |= RECV_ARMED;
+    return 0;
+}
+
+static int epoll_unrecv(spevloop_t* loop, spevrecv_t* r)
+{
+    if(r->_state & RECV_WATCHED)
+        epoll_unwatch(loop, &(r->_w));
+
+    r->_state = 0;
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+/* -----------------------------------------------------------------------
+ *  IO_URING
+ */
+
+static unsigned long long slot_new(spevloop_t* loop, int type, void* obj)
+{
+    spevslot_t* slots;
+    spevslot_t* slot;
+    int index, count, i;
+
+    if(loop->freeslot == -1)
+    {
+        count = loop->nslots ? loop->nslots * 2 : 64;
+        slots = (spevslot_t*)realloc(loop->slots, count * sizeof(spevslot_t));
+        if(!slots)
+        {
+            errno = ENOMEM;
+            return 0;
+        }
+
+        for(i = loop->nslots; i < count; i++)
+        {
+            slots[i].obj = NULL;
+            slots[i].gen = 1;
+            slots[i].next = (i + 1 < count) ? i + 1 : -1;
+        }
+
+        loop->freeslot = loop->nslots;
+        loop->slots = slots;
+        loop->nslots = count;
+    }
+
+    index = loop->freeslot;
+    slot = loop->slots + index;
+    loop->freeslot = slot->next;
+    slot->obj = obj;
+
+    return MAKE_ID(type, slot->gen, index);
+}
+
+/* The thing a request was for, or NULL if it's gone */
+static void* slot_get(spevloop_t* loop, unsigned long long id)
+{
+    int index = ID_INDEX(id);
+    spevslot_t* slot;
+
+    if(index < 0 || index >= loop->nslots)
+        return NULL;
+
+    slot = loop->slots + index;
+    if(!slot->obj || (slot->gen & 0xFFFFFF) != ID_GEN(id))
+        return NULL;
+
+    return slot->obj;
+}
+
+static void slot_free(spevloop_t* loop, unsigned long long id)
+{
+    spevslot_t* slot;
+
+    if(!slot_get(loop, id))
+        return;
+
+    slot = loop->slots + ID_INDEX(id);
+    slot->obj = NULL;
+    slot->gen++;
+    slot->next = loop->freeslot;
+    loop->freeslot = ID_INDEX(id);
+}
+
+static int uring_poll(spevloop_t* loop, int fd, int events, unsigned long long id)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = spuring_get(loop->ring);
+    if(!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ((events & SPEV_READ) ? POLLIN : 0) |
+                         ((events & SPEV_WRITE) ? POLLOUT : 0);
+    sqe->user_data = id;
+
+    /* Keeps firing until removed */
+    if(!(events & SPEV_ONCE))
+        sqe->len = IORING_POLL_ADD_MULTI;
+
+    return 0;
+}
+
+static int uring_recv(spevloop_t* loop, spevrecv_t* r)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = spuring_get(loop->ring);
+    if(!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* The kernel picks one of our buffers once data arrives */
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = r->fd;
+    sqe->len = SPEV_RECV_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = r->_id;
+
+    return 0;
+}
+
+/* Cancel a request, its completion comes back with -ECANCELED */
+static int uring_cancel(spevloop_t* loop, int op, unsigned long long id)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = spuring_get(loop->ring);
+    if(!sqe)
+    {
+        sp_messagex(NULL, LOG_ERR, "couldn't cancel io_uring request");
+        return -1;
+    }
+
+    sqe->opcode = op;
+    sqe->addr = id;
+    sqe->user_data = 0;
+    return 0;
+}
+
+static int poll_events(int revents)
+{
+    int ret = 0;
+
+    if(revents & POLLIN)
+        ret |= SPEV_READ;
+    if(revents & POLLOUT)
+        ret |= SPEV_WRITE;
+    if(revents & (POLLERR | POLLHUP))
+        ret |= SPEV_ERROR;
+
+    return ret;
+}
+
+static void uring_complete(spevloop_t* loop, unsigned long long id, int res, unsigned int flags)
+{
+    spevwatch_t* w;
+    spevrecv_t* r;
+    spevop_t* op;
+    const char* data = NULL;
+    int bid = -1;
+
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = spuring_buffer(loop->ring, bid);
+    }
+
+    switch(ID_TYPE(id))
+    {
+    case ID_WAKE:
+        run_posted(loop);
+        if(!(flags & IORING_CQE_F_MORE) &&
+           uring_poll(loop, loop->wakefd, SPEV_READ, id) == -1)
+            sp_message(NULL, LOG_CRIT, "couldn't watch event loop wakeup");
+        break;
+
+    case ID_WATCH:
+        w = (spevwatch_t*)slot_get(loop, id);
+        if(!w)
+            break;
+
+        /* Errors and one shot watches are done with */
+        if(res < 0 || (w->events & SPEV_ONCE))
+        {
+            slot_free(loop, id);
+            w->_id = 0;
+        }
+
+        /* The kernel sometimes stops a multishot poll, start it again */
+        else if(!(flags & IORING_CQE_F_MORE) &&
+                uring_poll(loop, w->fd, w->events, id) == -1)
+        {
+            slot_free(loop, id);
+            w->_id = 0;
+            res = -1;
+        }
+
+        (w->callback)(w, res < 0 ? SPEV_ERROR : poll_events(res));
+        break;
+
+    case ID_RECV:
+        r = (spevrecv_t*)slot_get(loop, id);
+        if(!r)
+            break;
+
+        /* All our buffers are in use, try again in a moment */
+        if(res == -ENOBUFS && !(r->_state & RECV_CANCEL) && uring_recv(loop, r) == 0)
+            break;
+
+        slot_free(loop, id);
+        r->_id = 0;
+        r->_state = 0;
+
+        if(res == -ENOBUFS)
+            res = -ECANCELED;
+
+        (r->callback)(r, data, res);
+        break;
+
+    case ID_WRITE:
+        op = (spevop_t*)slot_get(loop, id);
+        if(!op)
+            break;
+
+        slot_free(loop, id);
+        (op->callback)(op, res);
+        break;
+
+    default:
+        break;
+    };
+
+    /* The data has been dealt with, the kernel can have the buffer back */
+    if(bid != -1)
+        spuring_recycle(loop->ring, bid);
+}
+
+static int uring_wait_loop(spevloop_t* loop)
+{
+    struct io_uring_cqe* cqe;
+    unsigned long long id;
+    unsigned int flags;
+    int res;
+
+    if(spuring_wait(loop->ring, next_timeout(loop)) == -1 && errno != EINTR)
+        return -1;
+
+    while((cqe = spuring_peek(loop->ring)) != NULL)
+    {
+        id = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+
+        /* Callbacks may queue more requests, which is fine */
+        spuring_seen(loop->ring);
+        uring_complete(loop, id, res, flags);
+    }
+
+    return 0;
+}
+
+static int uring_setup_loop(spevloop_t* loop)
+{
+    loop->freeslot = -1;
+
+    loop->ring = spuring_new(RING_ENTRIES);
+    if(!loop->ring)
+        return -1;
+
+    if(!spuring_supports(loop->ring, IORING_OP_RECV) ||
+       !spuring_supports(loop->ring, IORING_OP_POLL_ADD) ||
+       !spuring_supports(loop->ring, IORING_OP_ASYNC_CANCEL))
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if(spuring_buffers(loop->ring, RING_BUFFERS, SPEV_RECV_SIZE) == -1)
+        return -1;
+
+    return uring_poll(loop, loop->wakefd, SPEV_READ, MAKE_ID(ID_WAKE, 0, 0));
+}
+
+static void uring_done_loop(spevloop_t* loop)
+{
+    spuring_free(loop->ring);
+    loop->ring = NULL;
+    free(loop->slots);
+    loop->slots = NULL;
+    loop->nslots = 0;
+    loop->freeslot = -1;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* -----------------------------------------------------------------------
+ *  LOOPS
+ */
+
+static void* loop_main(void* arg)
+{
+    spevloop_t* loop = (spevloop_t*)arg;
+    unsigned long long last = spwheel_clock();
+    unsigned long long now;
+    int stopped = 0;
+    int r;
+
+    ASSERT(loop);
+
+    spcpu_pin(loop->index);
+
+    for(;;)
+    {
+#ifdef HAVE_IO_URING
+        if(loop->ring)
+            r = uring_wait_loop(loop);
+        else
+#endif
+            r = epoll_wait_loop(loop);
+
+        if(r == -1)
+        {
+            sp_message(NULL, LOG_CRIT, "couldn't wait on event loop");
+            break;
+        }
+
+        now = spwheel_clock();
+        spwheel_run(&(loop->timers), now);
+
+        /* Once when asked to stop, and then along with all the others */
+        if(!stopped && loop->stopping)
+        {
+            stopped = 1;
+            (g_tick)(loop, loop->index, 1);
+        }
+
+        if(now - last >= 1000)
+        {
+            last = now;
+            (g_tick)(loop, loop->index, loop->stopping);
+        }
+
+        if(should_exit(loop))
+            break;
+    }
+
+    return NULL;
+}
+
+static int setup_loop(spevloop_t* loop, int* uring)
+{
+    struct epoll_event ev;
+
+    loop->epfd = -1;
+    spwheel_init(&(loop->timers));
+
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->wakefd == -1)
+        return -1;
+
+#ifdef HAVE_IO_URING
+    if(*uring)
+    {
+        if(uring_setup_loop(loop) == 0)
+            return 0;
+
+        sp_message(NULL, LOG_WARNING, "couldn't use io_uring, using epoll instead");
+        uring_done_loop(loop);
+        *uring = 0;
+    }
+#endif
+
+    loop->recvbuf = (char*)malloc(SPEV_RECV_SIZE);
+    if(!loop->recvbuf)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd == -1)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+}
+
+int spev_init(int count, int uring, spev_tick_t tick)
+{
+    spevloop_t* loop;
+    int i, r;
+
+    ASSERT(count > 0);
+    ASSERT(tick);
+    ASSERT(!g_loops);
+
+    g_loops = (spevloop_t*)calloc(count, sizeof(spevloop_t));
+    if(!g_loops)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        return -1;
+    }
+
+    g_tick = tick;
+
+#ifndef HAVE_IO_URING
+    if(uring)
+    {
+        sp_messagex(NULL, LOG_WARNING, "not built with io_uring support, using epoll instead");
+        uring = 0;
+    }
+#endif
+
+    for(i = 0; i < count; i++)
+    {
+        loop = g_loops + i;
+        loop->index = i;
+
+        if(setup_loop(loop, &uring) == -1)
+        {
+            sp_message(NULL, LOG_CRIT, "couldn't create event loop");
+            return -1;
+        }
+
+        pthread_mutex_init(&(loop->mtx), NULL);
+
+        r = sp_thread_create(&(loop->tid), loop_main, loop);
+        if(r != 0)
+        {
+            errno = r;
+            sp_message(NULL, LOG_CRIT, "couldn't create event loop thread");
+            return -1;
+        }
+
+        g_nloops++;
+    }
+
+    sp_messagex(NULL, LOG_DEBUG, "started %d event loops using %s",
+                count, uring ? "io_uring" : "epoll");
+    return 0;
+}
+
+void spev_done()
+{
+    spevloop_t* loop;
+    int i;
+
+    for(i = 0; i < g_nloops; i++)
+    {
+        loop = g_loops + i;
+
+        sp_mutex_lock(&(loop->mtx));
+            loop->stopping = 1;
+        pthread_mutex_unlock(&(loop->mtx));
+
+        wake_loop(loop);
+    }
+
+    for(i = 0; i < g_nloops; i++)
+    {
+        loop = g_loops + i;
+
+        pthread_join(loop->tid, NULL);
+#ifdef HAVE_IO_URING
+        uring_done_loop(loop);
+#endif
+        if(loop->epfd != -1)
+            close(loop->epfd);
+        close(loop->wakefd);
+        free(loop->recvbuf);
+        pthread_mutex_destroy(&(loop->mtx));
+    }
+
+    free(g_loops);
+    g_loops = NULL;
+    g_nloops = 0;
+}
+
+int spev_running()
+{
+    return g_nloops > 0;
+}
+
+spevloop_t* spev_next_loop()
+{
+    ASSERT(g_nloops > 0);
+
+    /* Called from any of the accepting threads */
+    return g_loops + ((atomic_add(&g_nextloop, 1) - 1) % g_nloops);
+}
+
+int spev_loop_index(spevloop_t* loop)
+{
+    ASSERT(loop);
+    return loop->index;
+}
+
+int spev_watch(spevloop_t* loop, spevwatch_t* w)
+{
+    int r;
+
+    ASSERT(loop && w);
+    ASSERT(w->fd != -1 && w->callback);
+    ASSERT(w->events & (SPEV_READ | SPEV_WRITE));
+
+    w->_id = 0;
+
+#ifdef HAVE_IO_URING
+    if(loop->ring)
+    {
+        w->_id = slot_new(loop, ID_WATCH, w);
+        r = w->_id ? uring_poll(loop, w->fd, w->events, w->_id) : -1;
+        if(r == -1)
+        {
+            slot_free(loop, w->_id);
+            w->_id = 0;
+        }
+    }
+    else
+#endif
+        r = epoll_watch(loop, w);
+
+    if(r == -1)
+        sp_message(NULL, LOG_ERR, "couldn't watch descriptor");
+
+    return r;
+}
+
+void spev_unwatch(spevloop_t* loop, spevwatch_t* w)
+{
+    ASSERT(loop && w);
+
+#ifdef HAVE_IO_URING
+    if(loop->ring)
+    {
+        /* Still in the kernel, unless it's fired or failed */
+        if(w->_id && slot_get(loop, w->_id) == w)
+        {
+            uring_cancel(loop, IORING_OP_POLL_REMOVE, w->_id);
+            slot_free(loop, w->_id);
+        }
+
+        w->_id = 0;
+        return;
+    }
+#endif
+
+    epoll_unwatch(loop, w);
+}
+
+int spev_recv(spevloop_t* loop, spevrecv_t* r)
+{
+    int ret;
+
+    ASSERT(loop && r);
+    ASSERT(r->fd != -1 && r->callback);
+    ASSERT(!(r->_state & (RECV_ARMED | RECV_CANCEL)));
+
+    r->_loop = loop;
+
+#ifdef HAVE_IO_URING
+    if(loop->ring)
+    {
+        r->_id = slot_new(loop, ID_RECV, r);
+        ret = r->_id ? uring_recv(loop, r) : -1;
+        if(ret == -1)
+        {
+            slot_free(loop, r->_id);
+            r->_id = 0;
+        }
+        else
+        {
+            r->_state = RECV_ARMED;
+        }
+    }
+    else
+#endif
+        ret = epoll_recv(loop, r);
+
+    if(ret == -1)
+        sp_message(NULL, LOG_ERR, "couldn't receive from socket");
+
+    return ret;
+}
+
+int spev_unrecv(spevloop_t* loop, spevrecv_t* r)
+{
+    ASSERT(loop && r);
+
+#ifdef HAVE_IO_URING
+    if(loop->ring)
+    {
+        if(r->_state & RECV_ARMED)
+        {
+            r->_state |= RECV_CANCEL;
+            r->_state &= ~RECV_ARMED;
+            uring_cancel(loop, IORING_OP_ASYNC_CANCEL, r->_id);
+        }
+
+        return (r->_state & RECV_CANCEL) ? 1 : 0;
+    }
+#endif
+
+    return epoll_unrecv(loop, r);
+}
+
+int spev_write(spevloop_t* loop, spevop_t* op, int fd, const void* buf,
+               size_t len, unsigned long long off)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe* sqe;
+    unsigned long long id;
+
+    ASSERT(loop && op && op->callback);
+
+    if(!loop->ring || !spuring_supports(loop->ring, IORING_OP_WRITE))
+        return -1;
+
+    id = slot_new(loop, ID_WRITE, op);
+    if(!id)
+        return -1;
+
+    sqe = spuring_get(loop->ring);
+    if(!sqe)
+    {
+        slot_free(loop, id);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = id;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void spev_timer(spevloop_t* loop, spevtimer_t* t, int msecs)
+{
+    ASSERT(loop && t && t->callback);
+    ASSERT(msecs >= 0);
+
+    spwheel_add(&(loop->timers), t, spwheel_clock() + msecs);
+}
+
+void spev_untimer(spevloop_t* loop, spevtimer_t* t)
+{
+    ASSERT(loop && t);
+    spwheel_del(&(loop->timers), t);
+}
+
+void spev_post(spevloop_t* loop, spevpost_t* post)
+{
+    ASSERT(loop && post && post->func);
+
+    sp_mutex_lock(&(loop->mtx));
+        post->next = loop->posted;
+        loop->posted = post;
+    pthread_mutex_unlock(&(loop->mtx));
+
+    wake_loop(loop);
+}
+
+void spev_ref(spevloop_t* loop)
+{
+    ASSERT(loop);
+
+    sp_mutex_lock(&(loop->mtx));
+        loop->refs++;
+    pthread_mutex_unlock(&(loop->mtx));
+}
+
+void spev_unref(spevloop_t* loop)
+{
+    int wake;
+
+    ASSERT(loop);
+
+    sp_mutex_lock(&(loop->mtx));
+        loop->refs--;
+        ASSERT(loop->refs >= 0);
+        wake = loop->stopping && loop->refs <= 0;
+    pthread_mutex_unlock(&(loop->mtx));
+
+    /* So that the loop notices it can exit */
+    if(wake)
+        wake_loop(loop);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+int spev_init(int count, int uring, spev_tick_t tick)
+{
+    sp_messagex(NULL, LOG_CRIT, "not built with event loop support");
+    return -1;
+}
+
+void spev_done()
+{
+}
+
+int spev_running()
+{
+    return 0;
+}
+
+spevloop_t* spev_next_loop()
+{
+    return NULL;
+}
+
+int spev_watch(spevloop_t* loop, spevwatch_t* w)
+{
+    return -1;
+}
+
+void spev_unwatch(spevloop_t* loop, spevwatch_t* w)
+{
+}
+
+int spev_recv(spevloop_t* loop, spevrecv_t* r)
+{
+    return -1;
+}
+
+int spev_unrecv(spevloop_t* loop, spevrecv_t* r)
+{
+    return 0;
+}
+
+int spev_write(spevloop_t* loop, spevop_t* op, int fd, const void* buf,
+               size_t len, unsigned long long off)
+{
+    return -1;
+}
+
+int spev_loop_index(spevloop_t* loop)
+{
+    return 0;
+}
+
+void spev_timer(spevloop_t* loop, spevtimer_t* t, int msecs)
+{
+}
+
+void spev_untimer(spevloop_t* loop, spevtimer_t* t)
+{
+}
+
+void spev_post(spevloop_t* loop, spevpost_t* post)
+{
+}
+
+void spev_ref(spevloop_t* loop)
+{
+}
+
+void spev_unref(spevloop_t* loop)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPEVENT_H__
+#define __SPEVENT_H__
+
+#include "spwheel.h"
+
+/* -----------------------------------------------------------------------------
+ * EVENT LOOPS
+ *
+ * A small fixed set of threads each waiting on an epoll set, or on an
+ * io_uring when asked for and the kernel has it. Descriptors are watched
+ * for readability or writability and a callback is run on the loop thread
+ * that owns them. Work can be posted to a loop from any thread.
+ */
+
+struct spevloop;
+typedef struct spevloop spevloop_t;
+
+/* What a watch is waiting for, and what happened */
+#define SPEV_READ       0x01
+#define SPEV_WRITE      0x02
+#define SPEV_ERROR      0x04                /* Only reported, error or hang up */
+#define SPEV_ONCE       0x08                /* Only the first event is wanted */
+
+typedef struct spevwatch
+{
+    int fd;                                 /* The descriptor being watched */
+    int events;                             /* SPEV_READ and/or SPEV_WRITE */
+    void (*callback)(struct spevwatch* w, int events);
+    void* arg;                              /* For use by the callback */
+    unsigned long long _id;                 /* Used internally */
+}
+spevwatch_t;
+
+/* Most that's received from a socket at once */
+#define SPEV_RECV_SIZE  4096
+
+/*
+ * Receives once from a socket. The callback gets the data, zero at the
+ * end of the stream, or a negative errno. The data is only valid until
+ * the callback returns. Owned by the caller.
+ */
+typedef struct spevrecv
+{
+    int fd;                                 /* The socket to receive from */
+    void (*callback)(struct spevrecv* r, const char* data, int len);
+    void* arg;                              /* For use by the callback */
+
+    /* Used internally */
+    int _state;
+    unsigned long long _id;
+    struct spevloop* _loop;
+    spevwatch_t _w;
+}
+spevrecv_t;
+
+/* A file write on the loop's behalf. Owned by the caller */
+typedef struct spevop
+{
+    void (*callback)(struct spevop* op, int result);
+    void* arg;                              /* For use by the callback */
+}
+spevop_t;
+
+/* Work posted to a loop from another thread. Owned by the caller,
+ * and must stay around until the function has been run. */
+typedef struct spevpost
+{
+    void (*func)(void* arg);
+    void* arg;
+    struct spevpost* next;
+}
+spevpost_t;
+
+/* A timer that fires once on the loop thread. Owned by the caller */
+typedef spwtimer_t spevtimer_t;
+
+/* Called on the loop thread about once a second, and when stopping */
+typedef void (*spev_tick_t)(spevloop_t* loop, int index, int stopping);
+
+/*
+ * Start up count loop threads, using io_uring if uring is set. Falls back
+ * to epoll when io_uring can't be used. Returns -1 on failure.
+ */
+int spev_init(int count, int uring, spev_tick_t tick);
+
+/* Tell all loops to stop, and wait until they have */
+void spev_done();
+
+/* Whether the event loops are running */
+int spev_running();
+
+/* Pick a loop to place a new descriptor on */
+spevloop_t* spev_next_loop();
+
+/* The number of the loop, from zero */
+int spev_loop_index(spevloop_t* loop);
+
+/* Watch a descriptor for the events in the watch, or stop watching it.
+ * Only called from the loop thread, or while the descriptor is idle. */
+int spev_watch(spevloop_t* loop, spevwatch_t* w);
+void spev_unwatch(spevloop_t* loop, spevwatch_t* w);
+
+/* Receive once from a socket. Only on the loop thread. Returns -1 on failure */
+int spev_recv(spevloop_t* loop, spevrecv_t* r);
+
+/*
+ * Stop receiving. Returns zero if the callback won't be called again, or
+ * one if it'll be called once more: with data that already came in, or
+ * with -ECANCELED. Also called once a socket is finished with.
+ */
+int spev_unrecv(spevloop_t* loop, spevrecv_t* r);
+
+/*
+ * Write to a file without blocking the loop. The callback gets the number
+ * of bytes written or a negative errno. Returns -1 when the loop can't do
+ * this, and the caller should write the usual way.
+ */
+int spev_write(spevloop_t* loop, spevop_t* op, int fd, const void* buf,
+               size_t len, unsigned long long off);
+
+/* Fire a timer in msecs milliseconds, or cancel it. Only on the loop thread */
+void spev_timer(spevloop_t* loop, spevtimer_t* t, int msecs);
+void spev_untimer(spevloop_t* loop, spevtimer_t* t);
+
+/* Run a function on the loop thread. Can be called from any thread */
+void spev_post(spevloop_t* loop, spevpost_t* post);
+
+/* A loop doesn't stop until all references have been released */
+void spev_ref(spevloop_t* loop);
+void spev_unref(spevloop_t* loop);
+
+#endif /* __SPEVENT_H__ */
@@ -35,6 +35,8 @@
  *  Stef Walter <stef@memberwebs.com>
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
 /*
@@ -47,6 +49,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 
@@ -59,6 +63,10 @@
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include <netinet/in.h>
 
 #ifdef HAVE_IP_TRANSPARENT
@@ -71,10 +79,22 @@
 #include "sock_any.h"
 #include "stringx.h"
 #include "sppriv.h"
+#include "spcoro.h"
+#include "spscan.h"
+#include "spwheel.h"
+#include "sptrace.h"
 
 #define MAX_LOG_LINE    79
 #define GET_IO_NAME(io)  ((io)->name ? (io)->name : "???   ")
-#define HAS_EXTRA(io)   ((io)->_ln > 0)
+#define HAS_EXTRA(io)   ((io)->_ln > 0 || (io)->_inlen > 0 || (io)->_inerr)
+
+/* Only costs a check when the session isn't traced */
+#define TRACE_IO(ctx, io, flags, data, len) \
+    do { if((ctx)->trace) sp_trace((ctx), (io), (flags), (data), (len)); } while(0)
+
+/* Addresses connected to at once, and how long before another is tried */
+#define CONNECT_PARALLEL    SPCORO_MAX_FDS
+#define CONNECT_STAGGER     250
 
 static void close_raw(int* fd)
 {
@@ -84,21 +104,67 @@ static void close_raw(int* fd)
     *fd = -1;
 }
 
-static void log_io_data(spctx_t* ctx, spio_t* io, const char* data, int read)
+/*
+ * Sockets are never blocked on, we wait for them here instead. That's how
+ * operations time out, rather than with socket options. In a coroutine
+ * the wait is a timer on the loop and others run meanwhile. Returns 0
+ * when timed out and -1 on failure.
+ */
+static int wait_raw(int fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    return sp_poll(&pfd, 1, g_state.timeout.tv_sec * 1000);
+}
+
+/* Forget data that was fed to us */
+static void drop_fed(spio_t* io)
+{
+    free(io->_inbuf);
+    io->_inbuf = NULL;
+    io->_in = NULL;
+    io->_inlen = 0;
+}
+
+/*
+ * Send what's held back for both peers, since the one we're about to wait
+ * on may be waiting on us. Only fails when io's own data couldn't be sent.
+ */
+static int flush_peers(spctx_t* ctx, spio_t* io)
+{
+    int r = 0;
+
+    if(spio_flush(ctx, &(ctx->client)) == -1 && io == &(ctx->client))
+        r = -1;
+    if(spio_flush(ctx, &(ctx->server)) == -1 && io == &(ctx->server))
+        r = -1;
+
+    return r;
+}
+
+static void log_io_data(spctx_t* ctx, spio_t* io, const char* data, int len, int read)
 {
     char buf[MAX_LOG_LINE + 1];
-    int pos, len;
+    const char* end = data + len;
+    int pos;
 
     ASSERT(ctx && io && data);
 
     for(;;)
     {
-        data += strspn(data, "\r\n");
+        while(data < end && (*data == '\r' || *data == '\n'))
+            data++;
 
-        if(!*data)
+        if(data >= end || !*data)
             break;
 
-        pos = strcspn(data, "\r\n");
+        for(pos = 0; data + pos < end && data[pos] &&
+                     data[pos] != '\r' && data[pos] != '\n'; pos++)
+            ;
 
         len = pos < MAX_LOG_LINE ? pos : MAX_LOG_LINE;
         memcpy(buf, data, len);
@@ -117,74 +183,211 @@ void spio_init(spio_t* io, const char* name)
     memset(io, 0, sizeof(*io));
     io->name = name;
     io->fd = -1;
+    io->line = io->_buf = io->_small;
+    io->_sz = SP_LINE_MIN;
+    io->_sv = -1;
+    io->_out = io->_osmall;
+    io->_outsz = SP_LINE_MIN;
 }
 
-void spio_attach(spctx_t* ctx, spio_t* io, int fd, struct sockaddr_any* peer)
+void spio_free(spio_t* io)
+{
+    ASSERT(io);
+
+    if(io->_buf != io->_small)
+        free(io->_buf);
+    if(io->_out != io->_osmall)
+        free(io->_out);
+    free(io->_peername);
+    free(io->_localname);
+    drop_fed(io);
+
+    io->_peername = io->_localname = NULL;
+    io->_inerr = 0;
+    io->line = io->_buf = io->_small;
+    io->line[0] = 0;
+    io->_sz = SP_LINE_MIN;
+    io->_st = 0;
+    io->_ln = 0;
+    io->_sv = -1;
+    io->_out = io->_osmall;
+    io->_outsz = SP_LINE_MIN;
+    io->_outlen = 0;
+}
+
+/* Move the line buffer between the small one and one on the heap */
+static int resize_line(spctx_t* ctx, spio_t* io, size_t size)
+{
+    size_t off = io->line - io->_buf;
+    char* buf;
+
+    ASSERT(size >= SP_LINE_MIN && size <= SP_READ_LENGTH);
+
+    /* When going back to the small one, callers make sure it all fits */
+    if(size == SP_LINE_MIN)
+    {
+        buf = io->_small;
+        if(io->_buf != io->_small)
+        {
+            memcpy(buf, io->_buf, SP_LINE_MIN);
+            free(io->_buf);
+        }
+    }
+
+    else if(io->_buf == io->_small)
+    {
+        buf = (char*)malloc(size);
+        if(buf)
+            memcpy(buf, io->_small, SP_LINE_MIN);
+    }
+
+    else
+    {
+        buf = (char*)realloc(io->_buf, size);
+    }
+
+    if(!buf)
+    {
+        sp_messagex(ctx, LOG_CRIT, "out of memory");
+        return -1;
+    }
+
+    io->_buf = buf;
+    io->line = buf + off;
+    io->_sz = size;
+    return 0;
+}
+
+int spio_reserve(spctx_t* ctx, spio_t* io, size_t size)
+{
+    ASSERT(io);
+
+    if(size > SP_READ_LENGTH)
+        size = SP_READ_LENGTH;
+    if(io->_sz >= size)
+        return 0;
+
+    return resize_line(ctx, io, size);
+}
+
+void spio_compact(spio_t* io)
+{
+    size_t off, used;
+
+    ASSERT(io);
+
+    if(io->_sz <= SP_LINE_MIN)
+        return;
+
+    /* The last line read has to stay around, with its terminator, as well
+     * as anything after it */
+    off = io->line - io->_buf;
+    used = (io->_st + io->_ln + 1) - off;
+    if(used > SP_LINE_MIN)
+        return;
+
+    memmove(io->_buf, io->line, used);
+    io->line = io->_buf;
+    io->_st -= off;
+    resize_line(NULL, io, SP_LINE_MIN);
+}
+
+static const char* format_name(const struct sockaddr_any* addr, char** name)
+{
+    char buf[MAXPATHLEN];
+
+    if(!*name)
+    {
+        if(SANY_TYPE(*addr) == AF_UNSPEC ||
+           sock_any_ntop(addr, buf, MAXPATHLEN, SANY_OPT_NOPORT) == -1)
+            return "UNKNOWN";
+
+        *name = strdup(buf);
+        if(!*name)
+            return "UNKNOWN";
+    }
+
+    return *name;
+}
+
+const char* spio_peername(spio_t* io)
+{
+    ASSERT(io);
+    return format_name(&(io->peeraddr), &(io->_peername));
+}
+
+const char* spio_localname(spio_t* io)
 {
-    struct sockaddr_any peeraddr;
-    struct sockaddr_any locaddr;
+    ASSERT(io);
+    return format_name(&(io->localaddr), &(io->_localname));
+}
 
+void spio_attach(spctx_t* ctx, spio_t* io, int fd, struct sockaddr_any* peer)
+{
     io->fd = fd;
 
+    /* Addresses are only turned into text when needed */
+    free(io->_peername);
+    free(io->_localname);
+    io->_peername = io->_localname = NULL;
+
     /* Get the address on which we accepted the connection */
-    memset(&locaddr, 0, sizeof(locaddr));
-    SANY_LEN(locaddr) = sizeof(locaddr);
+    memset(&(io->localaddr), 0, sizeof(io->localaddr));
+    SANY_LEN(io->localaddr) = sizeof(io->localaddr);
 
-    if(getsockname(fd, &SANY_ADDR(locaddr), &SANY_LEN(locaddr)) == -1 ||
-	   sock_any_ntop(&locaddr, io->localname, MAXPATHLEN, SANY_OPT_NOPORT) == -1)
+    if(getsockname(fd, &SANY_ADDR(io->localaddr), &SANY_LEN(io->localaddr)) == -1)
     {
-		if (errno != EAFNOSUPPORT)
-	        sp_message(ctx, LOG_WARNING, "%s: couldn't get socket address", GET_IO_NAME(io));
-        strlcpy(io->localname, "UNKNOWN", MAXPATHLEN);
+        sp_message(ctx, LOG_WARNING, "%s: couldn't get socket address", GET_IO_NAME(io));
+        memset(&(io->localaddr), 0, sizeof(io->localaddr));
     }
 
-    /* If the caller doesn't want the peer then use our own */
-    if (peer == NULL)
-        peer = &peeraddr;
+    memset(&(io->peeraddr), 0, sizeof(io->peeraddr));
+    SANY_LEN(io->peeraddr) = sizeof(io->peeraddr);
 
-    memset(peer, 0, sizeof(*peer));
-    SANY_LEN(*peer) = sizeof(*peer);
-
-    if(getpeername(fd, &SANY_ADDR(*peer), &SANY_LEN(*peer)) == -1 ||
-       sock_any_ntop(peer, io->peername, MAXPATHLEN, SANY_OPT_NOPORT) == -1)
+    if(getpeername(fd, &SANY_ADDR(io->peeraddr), &SANY_LEN(io->peeraddr)) == -1)
     {
-		if (errno != EAFNOSUPPORT)
-	        sp_message(ctx, LOG_WARNING, "%s: couldn't get peer address", GET_IO_NAME(io));
-        strlcpy(io->peername, "UNKNOWN", MAXPATHLEN);
+        sp_message(ctx, LOG_WARNING, "%s: couldn't get peer address", GET_IO_NAME(io));
+        memset(&(io->peeraddr), 0, sizeof(io->peeraddr));
     }
 
+    /* The caller may want the peer */
+    if (peer != NULL)
+        memcpy(peer, &(io->peeraddr), sizeof(*peer));
+
+    /* Counts as activity for timeouts */
+    io->last_action = spwheel_clock();
+
     /* As a double check */
+    io->line = io->_buf;
     io->line[0] = 0;
-    io->_nx = NULL;
+    io->_st = 0;
     io->_ln = 0;
+    io->_sv = -1;
 }
 
-int spio_connect(spctx_t* ctx, spio_t* io, const struct sockaddr_any* sdst,
-                 const char* dstname, const struct sockaddr_any* ssrc, const char *srcname)
+/*
+ * Start connecting a new socket. Returns it while the connection may still
+ * be going, or -1 when it failed straight off.
+ */
+static int connect_raw(spctx_t* ctx, spio_t* io, const struct sockaddr_any* sdst,
+                       const struct sockaddr_any* ssrc, const char* srcname)
 {
-	int ret = 0;
-	int fd;
-
-	ASSERT(ctx && io && sdst && dstname);
-	ASSERT(io->fd == -1);
+	const struct sockaddr_any* src = ssrc;
+	int fd, r;
 
 	if((fd = socket(SANY_TYPE(*sdst), SOCK_STREAM, 0)) == -1)
-		RETURN(-1);
-
-	if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &(g_state.timeout), sizeof(g_state.timeout)) == -1 ||
-	   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &(g_state.timeout), sizeof(g_state.timeout)) == -1)
-		sp_messagex(ctx, LOG_DEBUG, "%s: couldn't set timeouts on connection", GET_IO_NAME(io));
+		return -1;
 
 	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
 
-	if (ssrc != NULL) {
+	if (src != NULL) {
 #ifdef HAVE_IP_TRANSPARENT
 		int value = 1;
 		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0 ||
 		   setsockopt(fd, SOL_IP, IP_TRANSPARENT, &value, sizeof(value)) < 0) {
 			sp_message(ctx, LOG_DEBUG, "%s: couldn't set transparent mode on connection",
 			           GET_IO_NAME(io));
-			ssrc = NULL;
+			src = NULL;
 		}
 #elif defined(HAVE_IP_BINDANY)
 		int value = 1;
@@ -192,18 +395,18 @@ int spio_connect(spctx_t* ctx, spio_t* io, const struct sockaddr_any* sdst,
 		   setsockopt(fd, IPPROTO_IP, IP_BINDANY, &value, sizeof(value)) < 0) {
 			sp_message(ctx, LOG_DEBUG, "%s: couldn't set transparent mode on connection",
 			           GET_IO_NAME(io));
-			ssrc = NULL;
+			src = NULL;
 		}
 #else
 		/* Can't set source address on other OS */
 		sp_messagex(ctx, LOG_WARNING, "%s: couldn't set transparent mode on connection: not supported",
 		            GET_IO_NAME(io));
-		ssrc = NULL;
+		src = NULL;
 #endif
 	}
 
-	if (ssrc != NULL) {
-		if(bind(fd, &SANY_ADDR(*ssrc), SANY_LEN(*ssrc)) < 0)
+	if (src != NULL) {
+		if(bind(fd, &SANY_ADDR(*src), SANY_LEN(*src)) < 0)
 			sp_message(ctx, LOG_WARNING, "%s: couldn't set source of transparent connection to: %s",
 			           GET_IO_NAME(io), srcname);
 		else
@@ -211,26 +414,188 @@ int spio_connect(spctx_t* ctx, spio_t* io, const struct sockaddr_any* sdst,
 			            GET_IO_NAME(io), srcname);
 	}
 
-	if(connect(fd, &SANY_ADDR(*sdst), SANY_LEN(*sdst)) == -1)
+	/* Wait for the connection ourselves, so it times out like the rest */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	if(connect(fd, &SANY_ADDR(*sdst), SANY_LEN(*sdst)) == -1 && errno != EINPROGRESS)
 	{
-		close_raw(&fd);
-		RETURN(-1);
+		r = errno;
+		close(fd);
+		errno = r;
+		return -1;
 	}
 
-	spio_attach(ctx, io, fd, NULL);
+	return fd;
+}
 
-cleanup:
-	if(ret < 0)
+/* Take turns between address families, the first one's family first */
+static void order_addresses(const struct sockaddr_any* addrs, int n,
+                            const struct sockaddr_any** order)
+{
+	int family = SANY_TYPE(addrs[0]);
+	int same = 0, other = 0;
+	int first = 1;
+	int k = 0;
+
+	while(k < n)
+	{
+		if(first)
+		{
+			while(same < n && SANY_TYPE(addrs[same]) != family)
+				same++;
+			if(same < n)
+				order[k++] = &(addrs[same++]);
+		}
+		else
+		{
+			while(other < n && SANY_TYPE(addrs[other]) == family)
+				other++;
+			if(other < n)
+				order[k++] = &(addrs[other++]);
+		}
+
+		first = !first;
+	}
+}
+
+static void connect_failed(spctx_t* ctx, spio_t* io, const struct sockaddr_any* addr, int err)
+{
+	char buf[MAXPATHLEN];
+
+	if(sock_any_ntop(addr, buf, sizeof(buf), 0) == -1)
+		strcpy(buf, "unknown");
+
+	errno = err;
+	sp_message(ctx, LOG_DEBUG, "%s: couldn't connect to address: %s", GET_IO_NAME(io), buf);
+}
+
+int spio_connect(spctx_t* ctx, spio_t* io, const struct sockaddr_any* sdst, int ndst,
+                 const char* dstname, const struct sockaddr_any* ssrc, const char *srcname)
+{
+	const struct sockaddr_any* order[SP_CONNECT_MAX];
+	const struct sockaddr_any* tries[CONNECT_PARALLEL];
+	struct pollfd fds[CONNECT_PARALLEL];
+	unsigned long long now, deadline;
+	unsigned long long next = 0;
+	int err = ETIMEDOUT;
+	int nfds = 0;
+	int tried = 0;
+	int fd = -1;
+	int i, r, e, wait;
+	socklen_t len;
+
+	ASSERT(ctx && io && sdst && dstname);
+	ASSERT(io->fd == -1);
+	ASSERT(ndst > 0);
+
+	ndst = min(ndst, SP_CONNECT_MAX);
+	order_addresses(sdst, ndst, order);
+
+	deadline = spwheel_clock() + g_state.connect_timeout * 1000ULL;
+
+	while(fd == -1)
+	{
+		now = spwheel_clock();
+
+		/* Try the next address when nothing's going, or the others are slow */
+		if(tried < ndst && nfds < CONNECT_PARALLEL && (nfds == 0 || now >= next))
+		{
+			r = connect_raw(ctx, io, order[tried], ssrc, srcname);
+			if(r == -1)
+			{
+				err = errno;
+				connect_failed(ctx, io, order[tried], err);
+				next = 0;
+			}
+			else
+			{
+				tries[nfds] = order[tried];
+				fds[nfds].fd = r;
+				fds[nfds].events = POLLOUT;
+				fds[nfds].revents = 0;
+				nfds++;
+				next = now + CONNECT_STAGGER;
+			}
+
+			tried++;
+			continue;
+		}
+
+		/* All of them failed */
+		if(nfds == 0)
+			break;
+
+		if(now >= deadline)
+		{
+			err = ETIMEDOUT;
+			break;
+		}
+
+		wait = (int)(deadline - now);
+		if(tried < ndst && nfds < CONNECT_PARALLEL)
+			wait = min(wait, (int)(next - now));
+
+		r = sp_poll(fds, nfds, wait);
+		if(r == -1)
+		{
+			/* When the application is quiting */
+			if(errno == EINTR && !sp_is_quit())
+				continue;
+			err = errno;
+			break;
+		}
+
+		/* The first to connect wins, the ones that failed are dropped */
+		for(i = 0; i < nfds; )
+		{
+			if(!fds[i].revents)
+			{
+				i++;
+				continue;
+			}
+
+			len = sizeof(e);
+			if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1)
+				e = errno;
+
+			if(e == 0)
+			{
+				fd = fds[i].fd;
+				fds[i].fd = -1;
+				break;
+			}
+
+			err = e;
+			connect_failed(ctx, io, tries[i], err);
+			close(fds[i].fd);
+
+			/* No waiting for the next one, this one is out of the way */
+			next = 0;
+
+			nfds--;
+			fds[i] = fds[nfds];
+			tries[i] = tries[nfds];
+		}
+	}
+
+	/* The ones still going lost */
+	for(i = 0; i < nfds; i++)
 	{
-		if(spio_valid(io))
-			close_raw(&(io->fd));
+		if(fds[i].fd != -1)
+			close(fds[i].fd);
+	}
 
+	if(fd == -1)
+	{
+		errno = err;
 		sp_message(ctx, LOG_ERR, "%s: couldn't connect to: %s", GET_IO_NAME(io), dstname);
 		return -1;
 	}
 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	spio_attach(ctx, io, fd, NULL);
+
 	ASSERT(io->fd != -1);
-	sp_messagex(ctx, LOG_DEBUG, "%s connected to: %s", GET_IO_NAME(io), io->peername);
+	sp_messagex(ctx, LOG_DEBUG, "%s connected to: %s", GET_IO_NAME(io), spio_peername(io));
 	return 0;
 }
 
@@ -240,7 +605,9 @@ void spio_disconnect(spctx_t* ctx, spio_t* io)
 
     if(spio_valid(io))
     {
-        close_raw(&(io->fd));
+        spio_flush(ctx, io);
+        if(spio_valid(io))
+            close_raw(&(io->fd));
         sp_messagex(ctx, LOG_DEBUG, "%s connection closed", GET_IO_NAME(io));
     }
 }
@@ -253,6 +620,8 @@ unsigned int spio_select(spctx_t* ctx)
 
     ASSERT(ctx);
 
+    flush_peers(ctx, NULL);
+
     if (spio_valid(&(ctx->client))) {
         if(HAS_EXTRA(&(ctx->client)))
             ret |= (1 << 0);
@@ -282,7 +651,7 @@ unsigned int spio_select(spctx_t* ctx)
     for(;;)
     {
         /* Otherwise wait on more data */
-        switch(poll((struct pollfd *)&fds, i, g_state.timeout.tv_sec * 1000))
+        switch(sp_poll((struct pollfd *)&fds, i, g_state.timeout.tv_sec * 1000))
         {
         case 0:
             sp_messagex(ctx, LOG_ERR, "network operation timed out");
@@ -311,11 +680,11 @@ unsigned int spio_select(spctx_t* ctx)
             continue;
 
         if (fds[i].fd == ctx->client.fd) {
-            ctx->client.last_action = time(NULL);
+            ctx->client.last_action = spwheel_clock();
             ret |= (1 << 0);
         }
         if (fds[i].fd == ctx->server.fd) {
-            ctx->server.last_action = time(NULL);
+            ctx->server.last_action = spwheel_clock();
             ret |= (1 << 1);
         }
     }
@@ -323,169 +692,240 @@ unsigned int spio_select(spctx_t* ctx)
     return ret;
 }
 
-int read_raw(spctx_t* ctx, spio_t* io, int opts)
+/* Say why a read failed, and shut the socket down */
+static int read_failed(spctx_t* ctx, spio_t* io)
 {
-    int len, x, count;
-    char* at;
-    char* p;
+    if(errno == ECONNRESET) /* Not usually a big deal so supresse the error */
+        sp_messagex(ctx, LOG_DEBUG, "%s: connection disconnected by peer", GET_IO_NAME(io));
+    else if(errno == EAGAIN)
+        sp_messagex(ctx, LOG_WARNING, "%s: network read operation timed out", GET_IO_NAME(io));
+    else
+        sp_message(ctx, LOG_ERR, "%s: couldn't read data from socket", GET_IO_NAME(io));
 
     /*
-     * Just a refresher:
-     *
-     * _nx: Extra data read on last read.
-     * _ln: Length of that extra data.
-     *
-     * _nx should never be equal to line when entering this function.
-     * And _ln should always be less than a full buffer.
+     * The basic logic here is that if we've had a fatal error
+     * reading from the socket once then we shut it down as it's
+     * no good trying to read from again later.
      */
+    close_raw(&(io->fd));
 
-    count = 0;
-    io->line[0] = 0;
+    return -1;
+}
+
+/*
+ * Receive what's there, waiting for something unless SPIO_NONBLOCK. Returns
+ * SPIO_AGAIN when it would have to wait, and -1 on failure.
+ */
+static int recv_raw(spctx_t* ctx, spio_t* io, char* buf, size_t len, int opts)
+{
+    int x;
 
-    /* Remaining data in the buffer  */
-    if(io->_nx && io->_ln > 0)
+    for(;;)
     {
-        ASSERT(!io->_nx || io->_nx > io->line);
-        ASSERT(io->_ln < SP_LINE_LENGTH);
-        ASSERT(io->_nx + io->_ln <= io->line + SP_LINE_LENGTH);
+        x = recv(io->fd, buf, len, MSG_DONTWAIT);
+        if(x >= 0)
+            return x;
 
-        /* Check for a return in the current buffer */
-        if((p = (char*)memchr(io->_nx, '\n', io->_ln)) != NULL)
+        if((opts & SPIO_NONBLOCK) && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SPIO_AGAIN;
+
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            switch(wait_raw(io->fd, POLLIN))
+            {
+            case 0:
+                errno = EAGAIN;
+                break;
+            case -1:
+                break;
+            default:
+                continue;
+            };
+        }
+
+        if(errno == EINTR)
         {
-            /* Move data to front */
-            x = (p - io->_nx) + 1;
-            ASSERT(x > 0);
-            memmove(io->line, io->_nx, x);
+            /* When the application is quiting */
+            if(sp_is_quit())
+                return -1;
+
+            /* For any other signal we go again */
+            continue;
+        }
+
+        return read_failed(ctx, io);
+    }
+}
+
+/*
+ * Add up to room bytes after what's in the buffer. Returns how many, zero
+ * at the end of the stream, SPIO_AGAIN when SPIO_BUFFERED and nothing was
+ * fed, or -1 on failure.
+ */
+static int fill_raw(spctx_t* ctx, spio_t* io, size_t room, int opts)
+{
+    char* at = io->_buf + io->_st + io->_ln;
+    int x;
 
-            /* Null teriminate it */
-            io->line[x] = 0;
+    ASSERT(room > 0);
 
-            /* Do maintanence for next time around */
-            io->_ln -= x;
-            io->_nx += x;
+    /*
+     * Everything held back goes out before we wait on a peer. Buffered
+     * reads don't wait, their caller flushes once it runs out of lines.
+     */
+    if(io->_inlen == 0 && !io->_inerr && !(opts & SPIO_BUFFERED) &&
+       flush_peers(ctx, io) == -1)
+        return -1;
+
+    /* Data that was fed to us comes first */
+    if(io->_inlen > 0)
+    {
+        x = min((int)room, io->_inlen);
+        memcpy(at, io->_in, x);
+        io->_in += x;
+        io->_inlen -= x;
+        if(io->_inlen == 0)
+            drop_fed(io);
+    }
 
-            /* A double check on the return value */
-            count += x;
-            return count;
+    /* End of the stream stays, an error is reported once */
+    else if(io->_inerr)
+    {
+        x = 0;
+        if(io->_inerr != -1)
+        {
+            errno = io->_inerr;
+            io->_inerr = 0;
+            return read_failed(ctx, io);
         }
+    }
 
-        /* Otherwise move all old data to front */
-        memmove(io->line, io->_nx, io->_ln);
-        count += io->_ln;
+    else if(opts & SPIO_BUFFERED)
+        return SPIO_AGAIN;
 
-        /* We always leave space for a null terminator */
-        len = (SP_LINE_LENGTH - io->_ln) - 1;
-        at = io->line + io->_ln;
+    /* Read a block of data */
+    else if((x = recv_raw(ctx, io, at, room, opts)) < 0)
+        return x;
+
+    /* Read data which is a descriptor action */
+    if(x > 0)
+    {
+        TRACE_IO(ctx, io, 0, at, x);
+        io->last_action = spwheel_clock();
+        io->_ln += x;
     }
 
-    /* No data at front just read straight in */
-    else
+    return x;
+}
+
+/*
+ * Find the next line in the buffer, reading more when there isn't a whole
+ * one. Lines stay where they were received, with io->line pointing at them.
+ * The only data ever moved is a partial line, to the front of the buffer
+ * when it runs out of room at the end.
+ */
+static int read_raw(spctx_t* ctx, spio_t* io, int opts)
+{
+    size_t scan = 0;
+    size_t room;
+    char* p;
+    int x;
+
+    ASSERT(!(opts & SPIO_BUFFERED) || (opts & SPIO_NONBLOCK));
+
+    /* Put back what the last line's terminator covered */
+    if(io->_sv != -1)
     {
-        /* We always leave space for a null terminator */
-        len = SP_LINE_LENGTH - 1;
-        at = io->line;
+        io->_buf[io->_st] = (char)io->_sv;
+        io->_sv = -1;
     }
 
+    if(io->_ln == 0)
+        io->_st = 0;
+
+    io->line = io->_buf + io->_st;
+
     for(;;)
     {
-        /* Read a block of data */
-        ASSERT(io->fd != -1);
-        x = read(io->fd, at, sizeof(char) * len);
+        ASSERT(io->_st + io->_ln < io->_sz);
 
-        if(x == -1)
+        /* Check for a whole line in what we have, only looking once */
+        if(io->_ln > scan)
         {
-            if(errno == EINTR)
-            {
-                /* When the application is quiting */
-                if(sp_is_quit())
-                    return -1;
+            p = (char*)memchr(io->line + scan, '\n', io->_ln - scan);
+            x = p ? (p - io->line) + 1 : 0;
+            scan = io->_ln;
 
-                /* For any other signal we go again */
-                continue;
+            if(p && x < SP_LINE_LENGTH)
+            {
+                io->_st += x;
+                io->_ln -= x;
+                return x;
             }
 
-            if(errno == ECONNRESET) /* Not usually a big deal so supresse the error */
-                sp_messagex(ctx, LOG_DEBUG, "%s: connection disconnected by peer", GET_IO_NAME(io));
-            else if(errno == EAGAIN)
-                sp_messagex(ctx, LOG_WARNING, "%s: network read operation timed out", GET_IO_NAME(io));
-            else
-                sp_message(ctx, LOG_ERR, "%s: couldn't read data from socket", GET_IO_NAME(io));
+            /* Hand back as much of a long line as we can */
+            if(!(opts & SPIO_DISCARD) && (p || io->_ln >= SP_LINE_LENGTH - 1))
+            {
+                x = SP_LINE_LENGTH - 1;
+                io->_st += x;
+                io->_ln -= x;
+                return x;
+            }
 
             /*
-             * The basic logic here is that if we've had a fatal error
-             * reading from the socket once then we shut it down as it's
-             * no good trying to read from again later.
+             * When discarding we keep the start of the line and its ending,
+             * and skip over what's in between.
              */
-            close_raw(&(io->fd));
+            if(p)
+            {
+                memcpy(io->line + SP_LINE_LENGTH - 3, p - 1, 2);
+                io->_st += x;
+                io->_ln -= x;
+                return SP_LINE_LENGTH - 1;
+            }
 
-            return -1;
+            /*
+             * K, basically the logic is that we're discarding
+             * data and the data will be screwed up. So overwriting
+             * some valid data in order to flush the line and
+             * keep the buffering simple is a price we pay gladly :)
+             */
+            if(io->_ln >= SP_LINE_LENGTH - 1)
+                io->_ln = scan = SP_LINE_LENGTH - 1 - 128;
         }
 
-        /* End of data */
-        else if(x == 0)
-        {
-            /* Maintenance for remaining data */
-            io->_nx = NULL;
-            io->_ln = 0;
+        /* We always leave space for a null terminator */
+        room = io->_sz - (io->_st + io->_ln) - 1;
 
-            return count;
+        /* Move a partial line to the front when the end gets tight */
+        if(io->_st > 0 && room < io->_sz / 4)
+        {
+            memmove(io->_buf, io->line, io->_ln);
+            io->line = io->_buf;
+            io->_st = 0;
+            continue;
         }
 
-        /* Read data which is a descriptor action */
-        io->last_action = time(NULL);
-
-        /* Check for a new line */
-        p = (char*)memchr(at, '\n', x);
-        if(p != NULL)
+        /* Room to grow, keep reading the line */
+        if(room == 0)
         {
-            p++;
-            count += (p - at);
-
-            /* Insert the null terminator */
-            len = x - (p - at);
-            memmove(p + 1, p, len);
-            *p = 0;
-
-            /* Do maintenence for remaining data */
-            io->_nx = p + 1;
-            io->_ln = len;
-
-            return count;
+            ASSERT(io->_sz < SP_LINE_LENGTH);
+            if(resize_line(ctx, io, min(io->_sz * 2, SP_LINE_LENGTH)) == -1)
+                return -1;
+            continue;
         }
 
-        /* Move the buffer pointer along */
-        at += x;
-        len -= x;
-        count += x;
+        /* Keep what we have until the rest of the line arrives */
+        if((x = fill_raw(ctx, io, room, opts)) < 0)
+            return x;
 
-        if(len <= 0)
+        /* End of data, whatever is left is the last line */
+        if(x == 0)
         {
-            /* Keep reading until we hit a new line */
-            if(opts & SPIO_DISCARD)
-            {
-                /*
-                 * K, basically the logic is that we're discarding
-                 * data and the data will be screwed up. So overwriting
-                 * some valid data in order to flush the line and
-                 * keep the buffering simple is a price we pay gladly :)
-                 */
-
-                ASSERT(128 < SP_LINE_LENGTH);
-                at = (io->line + SP_LINE_LENGTH) - 128;
-                len = 128;
-
-                /* Go for next read */
-                continue;
-            }
-
-            io->_nx = NULL;
+            x = io->_ln;
+            io->_st += x;
             io->_ln = 0;
-
-            /* Null terminate */
-            io->line[SP_LINE_LENGTH - 1] = 0;
-
-            /* A double check on the return value */
-            return count;
+            return x;
         }
     }
 }
@@ -505,6 +945,18 @@ int spio_read_line(spctx_t* ctx, spio_t* io, int opts)
 
     x = read_raw(ctx, io, opts);
 
+    /*
+     * For those that want a string. When the terminator goes over data
+     * after the line, that's put back on the next read.
+     */
+    t = io->line + max(x, 0);
+    if(t == io->_buf + io->_st && io->_ln > 0)
+        io->_sv = (unsigned char)*t;
+    *t = 0;
+
+    if(x == SPIO_AGAIN)
+        return x;
+
     if(x > 0)
     {
         if(opts & SPIO_TRIM)
@@ -514,9 +966,9 @@ int spio_read_line(spctx_t* ctx, spio_t* io, int opts)
             while(*t && isspace(*t))
                 t++;
 
-            /* Bump the entire line down */
+            /* Start the line further along */
             l = t - io->line;
-            memmove(io->line, t, (x + 1) - l);
+            io->line = t;
             x -= l;
 
             /* Now the end */
@@ -530,32 +982,180 @@ int spio_read_line(spctx_t* ctx, spio_t* io, int opts)
         }
 
         if(!(opts & SPIO_QUIET))
-            log_io_data(ctx, io, io->line, 1);
+            log_io_data(ctx, io, io->line, x, 1);
     }
 
     return x;
 }
 
-int spio_write_data(spctx_t* ctx, spio_t* io, const char* data)
+/*
+ * A lone dot after a bare LF doesn't end the data, as RFC 5321 has it, so a
+ * client that sends those waits on us until it times out. Said once a message.
+ */
+static void lone_dot(spctx_t* ctx, spio_t* io, spscan_t* scan)
 {
-    int len = strlen(data);
-    ASSERT(ctx && io && data);
+    if(scan->lone++ == 0)
+        sp_messagex(ctx, LOG_WARNING, "%s: lone dot after a bare LF is data, not the end of it",
+                    GET_IO_NAME(io));
+}
+
+int spio_read_data(spctx_t* ctx, spio_t* io, spscan_t* scan, const char** data)
+{
+    size_t n, room;
+    char* at;
+    int found, x;
+
+    ASSERT(ctx && io && scan && data);
+
+    *data = NULL;
 
     if(!spio_valid(io))
     {
-        sp_message(ctx, LOG_ERR, "%s: connection closed. can't write data", GET_IO_NAME(io));
+        sp_messagex(ctx, LOG_WARNING, "%s: tried to read from a closed connection", GET_IO_NAME(io));
         return -1;
     }
 
-    log_io_data(ctx, io, data, 0);
-    return spio_write_data_raw(ctx, io, (unsigned char*)data, len);
-}
+    /* Put back what the last line's terminator covered */
+    if(io->_sv != -1)
+    {
+        io->_buf[io->_st] = (char)io->_sv;
+        io->_sv = -1;
+    }
 
-int spio_write_dataf(struct spctx* ctx, spio_t* io, const char* fmt, ...)
-{
-    char buf[SP_LINE_LENGTH];
-    va_list ap;
-    ASSERT(ctx && io && fmt);
+    for(;;)
+    {
+        if(io->_ln > 0)
+        {
+            at = io->_buf + io->_st;
+            n = spscan_block(scan, at, io->_ln, 0, &found);
+
+            switch(found)
+            {
+            /* What's before the end goes first, the end is found again next time */
+            case SPSCAN_END:
+                if(n > 0)
+                    break;
+                io->_st += SPSCAN_DOT_LEN;
+                io->_ln -= SPSCAN_DOT_LEN;
+                return 0;
+
+            /* Only ends the data after a CRLF, otherwise it's data */
+            case SPSCAN_DOT:
+                lone_dot(ctx, io, scan);
+                n += SPSCAN_DOT_LEN;
+                break;
+
+            /* The dot that was stuffed is left out */
+            case SPSCAN_STUFF:
+                io->_st += n + 1;
+                io->_ln -= n + 1;
+                if(n == 0)
+                    continue;
+                *data = at;
+                return n;
+            };
+
+            if(n > 0)
+            {
+                io->_st += n;
+                io->_ln -= n;
+                *data = at;
+                return n;
+            }
+        }
+
+        if(io->_ln == 0)
+            io->_st = 0;
+
+        /* Move a partial line to the front when the end gets tight */
+        room = io->_sz - (io->_st + io->_ln) - 1;
+        if(io->_st > 0 && room < io->_sz / 4)
+        {
+            memmove(io->_buf, io->_buf + io->_st, io->_ln);
+            io->_st = 0;
+            room = io->_sz - io->_ln - 1;
+        }
+
+        x = fill_raw(ctx, io, room, 0);
+        if(x < 0)
+            return -1;
+
+        if(x == 0)
+        {
+            sp_messagex(ctx, LOG_ERR, "unexpected end of data from client");
+            return -1;
+        }
+    }
+}
+
+int spio_read_count(spctx_t* ctx, spio_t* io, size_t len, const char** data)
+{
+    size_t n;
+    int x;
+
+    ASSERT(ctx && io && data && len > 0);
+
+    *data = NULL;
+
+    if(!spio_valid(io))
+    {
+        sp_messagex(ctx, LOG_WARNING, "%s: tried to read from a closed connection", GET_IO_NAME(io));
+        return -1;
+    }
+
+    /* Put back what the last line's terminator covered */
+    if(io->_sv != -1)
+    {
+        io->_buf[io->_st] = (char)io->_sv;
+        io->_sv = -1;
+    }
+
+    for(;;)
+    {
+        /* Whatever has come in goes as it is */
+        if(io->_ln > 0)
+        {
+            n = min(len, io->_ln);
+            *data = io->_buf + io->_st;
+            io->_st += n;
+            io->_ln -= n;
+            return (int)n;
+        }
+
+        /* Nothing more than the data, what follows is read as usual */
+        io->_st = 0;
+        x = fill_raw(ctx, io, min(len, io->_sz - 1), 0);
+        if(x < 0)
+            return -1;
+
+        if(x == 0)
+        {
+            sp_messagex(ctx, LOG_ERR, "unexpected end of data from client");
+            return -1;
+        }
+    }
+}
+
+int spio_write_data(spctx_t* ctx, spio_t* io, const char* data)
+{
+    int len = strlen(data);
+    ASSERT(ctx && io && data);
+
+    if(!spio_valid(io))
+    {
+        sp_message(ctx, LOG_ERR, "%s: connection closed. can't write data", GET_IO_NAME(io));
+        return -1;
+    }
+
+    log_io_data(ctx, io, data, len, 0);
+    return spio_write_data_raw(ctx, io, (unsigned char*)data, len);
+}
+
+int spio_write_dataf(struct spctx* ctx, spio_t* io, const char* fmt, ...)
+{
+    char buf[SP_LINE_LENGTH];
+    va_list ap;
+    ASSERT(ctx && io && fmt);
 
     buf[0] = 0;
 
@@ -568,29 +1168,112 @@ int spio_write_dataf(struct spctx* ctx, spio_t* io, const char* fmt, ...)
     return spio_write_data(ctx, io, buf);
 }
 
-int spio_write_data_raw(spctx_t* ctx, spio_t* io, const unsigned char* buf, int len)
+/* Say why a write failed, and shut the socket down */
+static int write_failed(spctx_t* ctx, spio_t* io)
 {
-    int r;
+    int err = errno;
 
-    ASSERT(ctx && io && buf);
+    /*
+     * The basic logic here is that if we've had a fatal error
+     * writing to the socket once then we shut it down as it's
+     * no good trying to write to it again later.
+     */
+    close_raw(&(io->fd));
+    errno = err;
 
-    if(io->fd == -1)
-        return 0;
+    if(errno == EAGAIN)
+        sp_messagex(ctx, LOG_WARNING, "%s: network write operation timed out", GET_IO_NAME(io));
+    else
+        sp_message(ctx, LOG_ERR, "%s: couldn't write data to socket", GET_IO_NAME(io));
 
-    io->last_action = time(NULL);
+    return -1;
+}
 
-    while(len > 0)
+/* Hold back what the socket wouldn't take, when writes mustn't wait */
+static int hold_raw(spctx_t* ctx, spio_t* io, struct iovec* iov, int cnt)
+{
+    size_t len = 0;
+    char* out;
+    int i;
+
+    for(i = 0; i < cnt; i++)
+        len += iov[i].iov_len;
+
+    /* The data may be in the old buffer, so it's copied before that goes */
+    out = (char*)malloc(max(len, (size_t)SP_WRITE_LENGTH));
+    if(!out)
     {
-        r = write(io->fd, buf, len);
+        sp_messagex(ctx, LOG_CRIT, "out of memory");
+        close_raw(&(io->fd));
+        return -1;
+    }
+
+    for(i = 0, len = 0; i < cnt; i++)
+    {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    if(io->_out != io->_osmall)
+        free(io->_out);
+    io->_out = out;
+    io->_outsz = max(len, (size_t)SP_WRITE_LENGTH);
+    io->_outlen = len;
+    return 0;
+}
+
+/* Send all of the data, or fail and close the socket */
+static int write_raw(spctx_t* ctx, spio_t* io, struct iovec* iov, int cnt)
+{
+    struct msghdr msg;
+    ssize_t r;
+    size_t n;
+
+    io->last_action = spwheel_clock();
+
+    while(cnt > 0)
+    {
+        if(iov->iov_len == 0)
+        {
+            iov++;
+            cnt--;
+            continue;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        r = sendmsg(io->fd, &msg, MSG_DONTWAIT);
 
         if(r > 0)
         {
-            buf += r;
-            len -= r;
+            for( ; r > 0; r -= n)
+            {
+                n = min((size_t)r, iov->iov_len);
+                iov->iov_base = (char*)iov->iov_base + n;
+                iov->iov_len -= n;
+                if(iov->iov_len == 0)
+                {
+                    iov++;
+                    cnt--;
+                }
+            }
         }
 
         else if(r == -1)
         {
+            if((errno == EAGAIN || errno == EWOULDBLOCK) && io->_defer)
+                return hold_raw(ctx, io, iov, cnt);
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                r = wait_raw(io->fd, POLLOUT);
+                if(r > 0)
+                    continue;
+                if(r == 0)
+                    errno = EAGAIN;
+            }
+
             if(errno == EINTR)
             {
                 /* When the application is quiting */
@@ -601,22 +1284,611 @@ int spio_write_data_raw(spctx_t* ctx, spio_t* io, const unsigned char* buf, int
                 continue;
             }
 
-            /*
-             * The basic logic here is that if we've had a fatal error
-             * writing to the socket once then we shut it down as it's
-             * no good trying to write to it again later.
-             */
-            close_raw(&(io->fd));
+            return write_failed(ctx, io);
+        }
+    }
 
-            if(errno == EAGAIN)
-                sp_messagex(ctx, LOG_WARNING, "%s: network write operation timed out", GET_IO_NAME(io));
-            else
-                sp_message(ctx, LOG_ERR, "%s: couldn't write data to socket", GET_IO_NAME(io));
+    return 0;
+}
+
+int spio_write_data_raw(spctx_t* ctx, spio_t* io, const unsigned char* buf, int len)
+{
+    struct iovec iov[2];
+    char* out;
+
+    ASSERT(ctx && io && buf);
+
+    if(io->fd == -1)
+        return 0;
 
+    TRACE_IO(ctx, io, SPTRACE_WRITE, buf, len);
+
+    /* Lots of small writes in a row get room to pile up */
+    if(io->_outlen + len > io->_outsz && len < SP_LINE_MIN &&
+       io->_outsz < SP_WRITE_LENGTH)
+    {
+        out = (char*)malloc(SP_WRITE_LENGTH);
+        if(!out)
+        {
+            sp_messagex(ctx, LOG_CRIT, "out of memory");
             return -1;
         }
+
+        memcpy(out, io->_out, io->_outlen);
+        io->_out = out;
+        io->_outsz = SP_WRITE_LENGTH;
+    }
+
+    /* Held back while it fits */
+    if(io->_outlen + len <= io->_outsz)
+    {
+        memcpy(io->_out + io->_outlen, buf, len);
+        io->_outlen += len;
+        return 0;
+    }
+
+    /* Otherwise it goes out right behind what's held */
+    iov[0].iov_base = io->_out;
+    iov[0].iov_len = io->_outlen;
+    iov[1].iov_base = (void*)buf;
+    iov[1].iov_len = len;
+    io->_outlen = 0;
+
+    return write_raw(ctx, io, iov, 2);
+}
+
+int spio_flush(spctx_t* ctx, spio_t* io)
+{
+    struct iovec iov;
+    int r = 0;
+
+    ASSERT(ctx && io);
+
+    if(io->_outlen > 0 && io->fd != -1)
+    {
+        iov.iov_base = io->_out;
+        iov.iov_len = io->_outlen;
+        io->_outlen = 0;
+        r = write_raw(ctx, io, &iov, 1);
+
+        /* Still held, the socket wouldn't take it yet */
+        if(io->_outlen > 0)
+            return r;
+    }
+
+    io->_outlen = 0;
+
+    /* Idle connections don't hang on to a grown buffer */
+    if(io->_out != io->_osmall)
+    {
+        free(io->_out);
+        io->_out = io->_osmall;
+        io->_outsz = SP_LINE_MIN;
+    }
+
+    return r;
+}
+
+void spio_defer(spio_t* io, int defer)
+{
+    ASSERT(io);
+    io->_defer = defer;
+}
+
+int spio_held(spio_t* io)
+{
+    ASSERT(io);
+    return io->fd != -1 && io->_outlen > 0;
+}
+
+/* The file ran out before all of it was sent, which leaves the peer waiting */
+static int file_short(spctx_t* ctx, spio_t* io)
+{
+    sp_messagex(ctx, LOG_ERR, "%s: file to send ended early", GET_IO_NAME(io));
+    close_raw(&(io->fd));
+    return -1;
+}
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+
+/*
+ * Send what sendfile can. Leaves len at what it couldn't, when the file
+ * has to be copied instead. Returns -1 on failure.
+ */
+static int sendfile_raw(spctx_t* ctx, spio_t* io, int fd, off_t* off, size_t* len)
+{
+    ssize_t r;
+
+    while(*len > 0)
+    {
+        r = sendfile(io->fd, fd, off, *len);
+        if(r > 0)
+        {
+            *len -= r;
+            continue;
+        }
+
+        if(r == 0)
+            return file_short(ctx, io);
+
+        if(errno == EAGAIN)
+        {
+            r = wait_raw(io->fd, POLLOUT);
+            if(r > 0)
+                continue;
+            if(r == 0)
+                errno = EAGAIN;
+        }
+
+        if(errno == EINTR)
+        {
+            if(sp_is_quit())
+                return -1;
+            continue;
+        }
+
+        /* Not a file that can be sent this way, so it's copied */
+        if(errno == EINVAL || errno == ENOSYS)
+            break;
+
+        return write_failed(ctx, io);
+    }
+
+    return 0;
+}
+
+#endif
+
+int spio_write_file(spctx_t* ctx, spio_t* io, int fd, off_t off, size_t len)
+{
+    struct iovec iov;
+    char* block;
+    ssize_t r;
+    int ret = 0;
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    int flags;
+#endif
+
+    ASSERT(ctx && io && fd != -1);
+
+    if(io->fd == -1 || len == 0)
+        return 0;
+
+    /* What's held back goes first, all in one */
+    if(spio_flush(ctx, io) == -1)
+        return -1;
+
+    TRACE_IO(ctx, io, SPTRACE_WRITE | SPTRACE_ELIDED, NULL, len);
+    io->last_action = spwheel_clock();
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    /* Wait on the socket rather than in sendfile, so the timeout holds */
+    flags = fcntl(io->fd, F_GETFL, 0);
+    if(flags != -1)
+        fcntl(io->fd, F_SETFL, flags | O_NONBLOCK);
+
+    r = sendfile_raw(ctx, io, fd, &off, &len);
+
+    if(flags != -1 && io->fd != -1)
+        fcntl(io->fd, F_SETFL, flags);
+
+    if(r == -1)
+        return -1;
+    if(len == 0)
+        return 0;
+#endif
+
+    block = (char*)malloc(SP_DATA_LENGTH);
+    if(!block)
+    {
+        sp_messagex(ctx, LOG_CRIT, "out of memory");
+        return -1;
+    }
+
+    while(len > 0)
+    {
+        r = pread(fd, block, min(len, SP_DATA_LENGTH), off);
+        if(r == -1 && errno == EINTR)
+            continue;
+
+        if(r == -1)
+        {
+            sp_message(ctx, LOG_ERR, "%s: couldn't read file to send", GET_IO_NAME(io));
+            close_raw(&(io->fd));
+            ret = -1;
+            break;
+        }
+
+        if(r == 0)
+        {
+            ret = file_short(ctx, io);
+            break;
+        }
+
+        iov.iov_base = block;
+        iov.iov_len = r;
+        if(write_raw(ctx, io, &iov, 1) == -1)
+        {
+            ret = -1;
+            break;
+        }
+
+        off += r;
+        len -= r;
+    }
+
+    free(block);
+    return ret;
+}
+
+#ifdef HAVE_SPLICE
+
+/*
+ * A client that doesn't pipeline sends nothing after the end of data until
+ * it's had a reply, so the end is always among the last bytes waiting on
+ * its socket. This much at the end is read and looked over, what's before
+ * it goes across unseen. A client that sends on anyway, more than this,
+ * gets the end spliced across. The server then answers early, which is
+ * how we find out. See splice_wait()
+ */
+#define SPLICE_TAIL     4096
+
+/*
+ * The server has nothing to say until it sees the end of data. If it
+ * does, the end went across in spliced data, and the session is lost.
+ * So once anything's been spliced, the client is waited on with an eye
+ * on the server. Returns -1 when the server spoke or the client is gone.
+ */
+static int splice_wait(spctx_t* ctx, spio_t* io, spio_t* to)
+{
+    struct pollfd pfd[2];
+    int r;
+
+    pfd[0].fd = io->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = to->fd;
+    pfd[1].events = POLLIN;
+
+    do
+    {
+        pfd[0].revents = pfd[1].revents = 0;
+        r = sp_poll(pfd, 2, g_state.timeout.tv_sec * 1000);
+    }
+    while(r == -1 && errno == EINTR && !sp_is_quit());
+
+    if(r > 0 && pfd[1].revents)
+    {
+        sp_messagex(ctx, LOG_ERR, "%s: sent more after the end of data without waiting for a reply",
+                    GET_IO_NAME(io));
+        return -1;
+    }
+
+    if(r == 0)
+        errno = EAGAIN;
+    if(r <= 0)
+        return read_failed(ctx, io);
+
+    return 0;
+}
+
+/* Move len bytes waiting on one socket to the other through a pipe */
+static int splice_raw(spctx_t* ctx, spio_t* io, spio_t* to, int* pfd, size_t len)
+{
+    size_t in = 0;
+    ssize_t r;
+
+    while(len > 0 || in > 0)
+    {
+        /* Fill the pipe, from data that's already waiting */
+        if(len > 0)
+        {
+            r = splice(io->fd, NULL, pfd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(r > 0)
+            {
+                len -= r;
+                in += r;
+            }
+            else if(r == 0)
+            {
+                errno = ECONNRESET;
+                return read_failed(ctx, io);
+            }
+            else if(errno != EAGAIN && errno != EINTR)
+            {
+                return read_failed(ctx, io);
+            }
+        }
+
+        /* And empty it out into the other */
+        while(in > 0)
+        {
+            r = splice(pfd[0], NULL, to->fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(r > 0)
+            {
+                in -= r;
+                continue;
+            }
+
+            if(r == -1 && errno == EAGAIN)
+            {
+                r = wait_raw(to->fd, POLLOUT);
+                if(r > 0)
+                    continue;
+                if(r == 0)
+                    errno = EAGAIN;
+            }
+
+            if(r == -1 && errno == EINTR)
+            {
+                if(sp_is_quit())
+                    return -1;
+                continue;
+            }
+
+            return write_failed(ctx, to);
+        }
+    }
+
+    return 0;
+}
+
+#endif /* HAVE_SPLICE */
+
+int spio_relay_data(spctx_t* ctx, spio_t* io, spio_t* to, int opts)
+{
+    spscan_t scan;
+    const char* at;
+    size_t n, room;
+    int count = 0;
+    int ret = -1;
+    int found, x;
+#ifdef HAVE_SPLICE
+    int pfd[2] = { -1, -1 };
+    int flags = -1;
+    int spliced = 0;
+    char edge[2];
+    int avail;
+#endif
+
+    ASSERT(ctx && io && to);
+
+    if(spio_reserve(ctx, io, SP_READ_LENGTH) == -1)
+        return -1;
+
+    /* Put back what the last line's terminator covered */
+    if(io->_sv != -1)
+    {
+        io->_buf[io->_st] = (char)io->_sv;
+        io->_sv = -1;
+    }
+
+    spscan_init(&scan, 0, 0);
+
+#ifdef HAVE_SPLICE
+    /* Without a pipe it's all read and written */
+    if((opts & SPIO_PIPELINED) || io->_eager || pipe2(pfd, O_NONBLOCK | O_CLOEXEC) == -1)
+        pfd[0] = pfd[1] = -1;
+
+    /* Wait on the socket rather than in the splice */
+    else if((flags = fcntl(to->fd, F_GETFL, 0)) != -1)
+        fcntl(to->fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+    for(;;)
+    {
+        /* Pass on what we have, up to the end of the data */
+        if(io->_ln > 0)
+        {
+            at = io->_buf + io->_st;
+            n = spscan_block(&scan, at, io->_ln, 0, &found);
+
+            /* Only ends the data after a CRLF */
+            if(found == SPSCAN_DOT)
+            {
+                lone_dot(ctx, io, &scan);
+                n += SPSCAN_DOT_LEN;
+            }
+
+            if(n > 0 && spio_write_data_raw(ctx, to, (const unsigned char*)at, n) == -1)
+                goto cleanup;
+
+            count += n;
+            io->_st += n;
+            io->_ln -= n;
+
+            if(found == SPSCAN_END)
+            {
+                io->_st += SPSCAN_DOT_LEN;
+                io->_ln -= SPSCAN_DOT_LEN;
+
+                /* It didn't wait this time, so don't count on it next time */
+                if(!(opts & SPIO_PIPELINED) && (io->_ln > 0 || io->_inlen > 0))
+                    io->_eager = 1;
+
+                ret = count;
+                goto cleanup;
+            }
+
+            if(found == SPSCAN_DOT)
+                continue;
+        }
+
+        /* All that can be left is the start of a dot line */
+        if(io->_st > 0)
+        {
+            memmove(io->_buf, io->_buf + io->_st, io->_ln);
+            io->_st = 0;
+        }
+
+        room = io->_sz - io->_ln - 1;
+        ASSERT(room > 0);
+
+        /* Data that was fed to us comes first */
+        if(io->_inlen > 0)
+        {
+            x = min((int)room, io->_inlen);
+            memcpy(io->_buf + io->_ln, io->_in, x);
+            io->_in += x;
+            io->_inlen -= x;
+            if(io->_inlen == 0)
+                drop_fed(io);
+            TRACE_IO(ctx, io, 0, io->_buf + io->_ln, x);
+            io->_ln += x;
+            continue;
+        }
+
+        if(io->_inerr)
+        {
+            x = 0;
+            if(io->_inerr != -1)
+            {
+                errno = io->_inerr;
+                io->_inerr = 0;
+                read_failed(ctx, io);
+                goto cleanup;
+            }
+        }
+
+        else
+        {
+#ifdef HAVE_SPLICE
+            /* When lots is waiting, all but the tail goes straight across */
+            if(pfd[0] != -1 && io->_ln == 0 &&
+               ioctl(io->fd, FIONREAD, &avail) != -1 && avail > SPLICE_TAIL + 2)
+            {
+                n = avail - SPLICE_TAIL;
+                if(spio_flush(ctx, to) == -1 ||
+                   splice_raw(ctx, io, to, pfd, n - 2) == -1)
+                    goto cleanup;
+
+                /* Look at the last couple of bytes on the way, to know where we are */
+                if(recv(io->fd, edge, 2, MSG_PEEK | MSG_DONTWAIT) != 2)
+                {
+                    read_failed(ctx, io);
+                    goto cleanup;
+                }
+
+                if(splice_raw(ctx, io, to, pfd, 2) == -1)
+                    goto cleanup;
+
+                spliced = 1;
+                spscan_skip(&scan, edge, 2);
+                TRACE_IO(ctx, io, SPTRACE_ELIDED, NULL, n);
+                TRACE_IO(ctx, to, SPTRACE_WRITE | SPTRACE_ELIDED, NULL, n);
+                count += n;
+                io->last_action = to->last_action = spwheel_clock();
+                continue;
+            }
+#endif
+
+            /* Everything held back goes out before we wait on a peer */
+            if(flush_peers(ctx, io) == -1)
+                goto cleanup;
+
+#ifdef HAVE_SPLICE
+            if(spliced && splice_wait(ctx, io, to) == -1)
+                goto cleanup;
+#endif
+
+            if((x = recv_raw(ctx, io, io->_buf + io->_ln, room, 0)) < 0)
+                goto cleanup;
+        }
+
+        if(x == 0)
+        {
+            sp_messagex(ctx, LOG_ERR, "unexpected end of data from client");
+            goto cleanup;
+        }
+
+        TRACE_IO(ctx, io, 0, io->_buf + io->_ln, x);
+        io->last_action = spwheel_clock();
+        io->_ln += x;
+    }
+
+cleanup:
+#ifdef HAVE_SPLICE
+    if(pfd[0] != -1)
+    {
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+    if(flags != -1 && to->fd != -1)
+        fcntl(to->fd, F_SETFL, flags);
+#endif
+
+    /* Whatever the client sent after the data is read as usual */
+    if(io->_ln == 0)
+        io->_st = 0;
+    io->line = io->_buf + io->_st;
+
+    return ret;
+}
+
+int spio_feed(spio_t* io, const char* data, int len)
+{
+    char* buf;
+
+    ASSERT(io);
+
+    if(len <= 0)
+    {
+        io->_inerr = (len == 0) ? -1 : -len;
+        return 0;
+    }
+
+    /* Read data which is a descriptor action */
+    io->last_action = spwheel_clock();
+
+    if(io->_inlen == 0)
+    {
+        drop_fed(io);
+        io->_in = data;
+        io->_inlen = len;
+        return 0;
+    }
+
+    /* Still holding on to some, add this after it */
+    buf = (char*)malloc(io->_inlen + len);
+    if(!buf)
+    {
+        drop_fed(io);
+        io->_inerr = ENOMEM;
+        return -1;
+    }
+
+    memcpy(buf, io->_in, io->_inlen);
+    memcpy(buf + io->_inlen, data, len);
+    len += io->_inlen;
+    drop_fed(io);
+
+    io->_inbuf = buf;
+    io->_in = buf;
+    io->_inlen = len;
+    return 0;
+}
+
+int spio_keep(spctx_t* ctx, spio_t* io)
+{
+    char* buf;
+
+    ASSERT(io);
+
+    /* Nothing borrowed */
+    if(io->_inlen == 0 || io->_inbuf)
+        return 0;
+
+    buf = (char*)malloc(io->_inlen);
+    if(!buf)
+    {
+        sp_messagex(ctx, LOG_CRIT, "out of memory");
+        drop_fed(io);
+        io->_inerr = ENOMEM;
+        return -1;
     }
 
+    memcpy(buf, io->_in, io->_inlen);
+    io->_inbuf = buf;
+    io->_in = buf;
     return 0;
 }
 
@@ -632,7 +1904,7 @@ void spio_read_junk(spctx_t* ctx, spio_t* io)
 
     /* Truncate any data in buffer */
     io->_ln = 0;
-    io->_nx = 0;
+    drop_fed(io);
 
     if(!spio_valid(io))
         return;
@@ -646,7 +1918,7 @@ void spio_read_junk(spctx_t* ctx, spio_t* io)
         if(l <= 0)
             break;
 
-        io->last_action = time(NULL);
+        io->last_action = spwheel_clock();
 
         buf[l] = 0;
         t = trim_start(buf);
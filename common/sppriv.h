@@ -57,6 +57,7 @@ typedef struct spstate
     int debug_level;                /* The level to print stuff to console */
     int max_threads;                /* Maximum number of threads to process at once */
     struct timeval timeout;         /* Timeout for communication */
+    int connect_timeout;            /* Seconds to wait for the server to answer a connect */
     int keepalives;                 /* Send server keep alives at this interval */
     int transparent;                /* Transparent proxying */
     int xclient;                    /* Send XFORWARD info */
@@ -65,6 +66,23 @@ typedef struct spstate
     const char* pidfile;            /* The pid file for daemon */
     const char* header;             /* A header to include in the email */
     int skip;                       /* Various types of email to skip processing */
+    int event_threads;              /* Number of event loops, or zero for thread per connection */
+    int worker_threads;             /* Number of worker threads to start up front */
+    int acceptors;                  /* Number of listening sockets and threads */
+    int stack_size;                 /* Thread stack size in kilobytes, or zero for default */
+    int pending_max;                /* Connections that can wait for a free slot */
+    int pending_timeout;            /* Seconds they wait before getting a busy response */
+    int io_uring;                   /* Use io_uring where the kernel has it */
+    int cpu_affinity;               /* Pin threads to CPUs, by NUMA node */
+    int processes;                  /* Number of worker processes */
+    int trace_sessions;             /* Percentage of sessions traced */
+    int trace_size;                 /* Kilobytes of trace kept for each */
+    struct sockaddr_any* trace_clients; /* Clients always traced */
+    int trace_nclients;
+    int chunking;                   /* Send with BDAT when the server offers CHUNKING */
+    int spool_memory;               /* Kilobytes of a message kept in memory */
+    int spool_soft;                 /* Megabytes in memory for all messages, before they go to files */
+    int spool_hard;                 /* Megabytes for all messages, before new ones are refused */
 
     struct sockaddr_any outaddr;    /* The outgoing address */
     const char* outname;
@@ -74,6 +92,8 @@ typedef struct spstate
     /* State --------------------------------- */
     const char* name;               /* The name of the program */
     int quit;                       /* Quit the process */
+    int stats;                      /* Log statistics */
+    int trace_dump;                 /* Bumped to have traces written out */
     int daemonized;                 /* Whether process is daemonized or not */
 
     /* Internal Use ------------------------- */
@@ -83,5 +103,15 @@ spstate_t;
 
 extern spstate_t g_state;
 
+/* Lock a mutex, counting the times it was held by another thread.
+ * Returns one if it had to wait */
+int sp_mutex_lock(pthread_mutex_t* mtx);
+
+/* Start a thread with the configured stack size. Returns an errno value */
+int sp_thread_create(pthread_t* tid, void* (*func)(void*), void* arg);
+
+/* Add to the session's trace, writing it out if that was asked for */
+void sp_trace(spctx_t* ctx, spio_t* io, int flags, const void* data, size_t len);
+
 #endif /* __SPPRIV_H__ */
 
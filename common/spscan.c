@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "usuals.h"
+#include "spscan.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#ifdef __SSE2__
+#define HAVE_SSE2_SCAN 1
+#endif
+#endif
+
+/* -----------------------------------------------------------------------
+ *  FINDING LINES
+ *
+ * These find the next line start whose first byte may make it a line we
+ * care about: a dot, or while in the headers, whitespace. The byte at p
+ * itself is never one, even when it starts a line, since the caller has
+ * already looked at it. Return end when there's none.
+ */
+
+#define IS_SPECIAL(c, headers) \
+    ((c) == '.' || ((headers) && isspace((unsigned char)(c))))
+
+#ifndef HAVE_SSE2_SCAN
+
+static const char* find_plain(const char* p, const char* end, int headers)
+{
+    while((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        if(++p == end)
+            break;
+        if(IS_SPECIAL(*p, headers))
+            return p;
+    }
+
+    return end;
+}
+
+#endif /* !HAVE_SSE2_SCAN */
+
+#ifdef HAVE_AVX2_SCAN
+
+/* The rest of a block after the vectors, a byte at a time */
+static const char* find_tail(const char* p, const char* end, int headers,
+                             int after)
+{
+    for( ; p < end; p++)
+    {
+        if(after && IS_SPECIAL(*p, headers))
+            return p;
+        after = (*p == '\n');
+    }
+
+    return end;
+}
+
+#endif /* HAVE_AVX2_SCAN */
+
+#ifdef HAVE_SSE2_SCAN
+
+static const char* find_sse2(const char* p, const char* end, int headers)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    unsigned int lines, special, hits;
+    unsigned int after = 0;
+    __m128i v, t;
+
+    while(end - p >= 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)p);
+        lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        special = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot));
+
+        if(headers)
+        {
+            /* Tab through carriage return are in a row, and then space */
+            t = _mm_sub_epi8(v, tab);
+            special |= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(t, four), t)) |
+                       _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp));
+        }
+
+        /* Bytes that come right after a newline, and are special */
+        hits = ((lines << 1) | after) & special & 0xFFFF;
+        if(hits)
+            return p + __builtin_ctz(hits);
+
+        after = (lines >> 15) & 1;
+        p += 16;
+    }
+
+    return find_tail(p, end, headers, after);
+}
+
+#endif /* HAVE_SSE2_SCAN */
+
+#ifdef HAVE_AVX2_SCAN
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* p, const char* end, int headers)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    unsigned int lines, special, hits;
+    unsigned int after = 0;
+    __m256i v, t;
+
+    while(end - p >= 32)
+    {
+        v = _mm256_loadu_si256((const __m256i*)p);
+        lines = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        special = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot));
+
+        if(headers)
+        {
+            t = _mm256_sub_epi8(v, tab);
+            special |= (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t)) |
+                       (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp));
+        }
+
+        hits = ((lines << 1) | after) & special;
+        if(hits)
+            return p + __builtin_ctz(hits);
+
+        after = lines >> 31;
+        p += 32;
+    }
+
+    return find_tail(p, end, headers, after);
+}
+
+#endif /* HAVE_AVX2_SCAN */
+
+static const char* find_start(const char* p, const char* end, int headers)
+{
+#ifdef HAVE_AVX2_SCAN
+    if(__builtin_cpu_supports("avx2"))
+        return find_avx2(p, end, headers);
+#endif
+#ifdef HAVE_SSE2_SCAN
+    return find_sse2(p, end, headers);
+#else
+    return find_plain(p, end, headers);
+#endif
+}
+
+/* -----------------------------------------------------------------------
+ *  SCANNING
+ */
+
+/* What the line at the front of len bytes is, with SPSCAN_DOT for any lone dot */
+static int check_line(const spscan_t* scan, const char* line, size_t len,
+                      int final)
+{
+    int other = scan->dots ? SPSCAN_STUFF : SPSCAN_NONE;
+    size_t i;
+
+    if(line[0] == '.')
+    {
+        if(len >= SPSCAN_DOT_LEN)
+            return line[1] == '\r' && line[2] == '\n' ? SPSCAN_DOT : other;
+        if(final || (len == 2 && line[1] != '\r'))
+            return other;
+        return SPSCAN_MORE;
+    }
+
+    if(!scan->headers)
+        return SPSCAN_NONE;
+
+    /* Longer runs of whitespace than this aren't taken as a blank line */
+    for(i = 0; i < len && i < SPSCAN_MAX_BLANK; i++)
+    {
+        if(line[i] == '\n')
+            return SPSCAN_BLANK;
+        if(!isspace((unsigned char)line[i]))
+            return SPSCAN_NONE;
+    }
+
+    if(i == SPSCAN_MAX_BLANK)
+        return SPSCAN_NONE;
+
+    return final ? SPSCAN_BLANK : SPSCAN_MORE;
+}
+
+/* Where the scan is up to after len ordinary bytes ending at end */
+static void pass_over(spscan_t* scan, const char* end, size_t len)
+{
+    scan->bol = (end[-1] == '\n');
+    if(scan->bol)
+        scan->crlf = (len >= 2) ? end[-2] == '\r' : scan->last == '\r';
+    scan->last = (unsigned char)end[-1];
+}
+
+void spscan_init(spscan_t* scan, int headers, int dots)
+{
+    ASSERT(scan);
+    scan->headers = headers;
+    scan->dots = dots;
+    scan->bol = 1;
+    scan->crlf = 1;
+    scan->last = '\n';
+    scan->lone = 0;
+}
+
+size_t spscan_block(spscan_t* scan, const char* data, size_t len,
+                    int final, int* found)
+{
+    const char* end = data + len;
+    const char* p = data;
+    int what = SPSCAN_NONE;
+    int crlf = 0;
+
+    ASSERT(scan && found);
+    *found = SPSCAN_NONE;
+
+    if(len == 0)
+        return 0;
+
+    if(scan->bol)
+    {
+        crlf = scan->crlf;
+        what = check_line(scan, p, len, final);
+    }
+
+    while(what == SPSCAN_NONE)
+    {
+        p = find_start(p, end, scan->headers);
+        if(p == end)
+            break;
+
+        /* Just after a newline, so there's at least one byte before */
+        crlf = (p - data >= 2) ? p[-2] == '\r' : scan->last == '\r';
+        what = check_line(scan, p, end - p, final);
+    }
+
+    /* All of it was ordinary */
+    if(what == SPSCAN_NONE)
+    {
+        pass_over(scan, end, len);
+        return len;
+    }
+
+    switch(what)
+    {
+    case SPSCAN_DOT:
+        /* Carry on after the dot line, which ends with CRLF */
+        if(crlf)
+            what = SPSCAN_END;
+        scan->crlf = 1;
+        break;
+    case SPSCAN_BLANK:
+        scan->headers = 0;
+        scan->crlf = crlf;
+        break;
+    case SPSCAN_STUFF:
+        /* Carry on just after the dot */
+        scan->bol = 0;
+        scan->last = '.';
+        *found = what;
+        return p - data;
+    default:
+        scan->crlf = crlf;
+        break;
+    };
+
+    scan->bol = 1;
+    scan->last = '\n';
+    *found = what;
+    return p - data;
+}
+
+void spscan_skip(spscan_t* scan, const char* tail, size_t len)
+{
+    ASSERT(scan && tail && len >= 2);
+    pass_over(scan, tail + len, len);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPSCAN_H__
+#define __SPSCAN_H__
+
+/* -----------------------------------------------------------------------------
+ * DATA SCANNING
+ *
+ * Message data is looked over a block at a time for the few lines that
+ * need something done to them: a lone dot, and the blank line that ends
+ * the headers. Line starts are found many bytes at a time with SSE2 or
+ * AVX2 where the CPU has them, and ordinary lines are never looked at
+ * one by one.
+ */
+
+#include <sys/types.h>
+
+/* Where a scan is up to, carried from one block to the next */
+typedef struct spscan
+{
+    int headers;                /* Still looking for the end of the headers */
+    int dots;                   /* Any line starting with a dot is wanted */
+    int bol;                    /* The next byte starts a line */
+    int crlf;                   /* ... and the line before ended with CRLF */
+    int last;                   /* The byte before the next one */
+    int lone;                   /* SPSCAN_DOT seen, for whoever reads data */
+}
+spscan_t;
+
+/* What a scan stopped at */
+#define SPSCAN_NONE     0       /* Nothing, the whole block is ordinary */
+#define SPSCAN_END      1       /* A lone dot after a CRLF: end of data */
+#define SPSCAN_DOT      2       /* A lone dot after a bare LF */
+#define SPSCAN_BLANK    3       /* The blank line ending the headers */
+#define SPSCAN_MORE     4       /* May be one of those, not all here yet */
+#define SPSCAN_STUFF    5       /* Another line starting with a dot, if asked */
+
+/* A lone dot line, and the longest whitespace that may make a blank line */
+#define SPSCAN_DOT_LEN  3
+#define SPSCAN_MAX_BLANK 256
+
+/*
+ * Start a scan at the beginning of a message. With headers set the blank
+ * line ending them is looked for, and with dots set any line starting
+ * with a dot, for stuffing and unstuffing them.
+ */
+void spscan_init(spscan_t* scan, int headers, int dots);
+
+/*
+ * Scan a block. Returns how many bytes at the front of it are ordinary,
+ * and in found what comes after them. After SPSCAN_END or SPSCAN_DOT the
+ * scan carries on past the SPSCAN_DOT_LEN bytes of the dot line, and after
+ * SPSCAN_STUFF past the dot that starts the line. After SPSCAN_BLANK it
+ * carries on from the blank line, which is ordinary from then on. After
+ * SPSCAN_MORE the line has to be handed in again at the front of the
+ * next block. When final is set, no more data follows and SPSCAN_MORE is
+ * never returned.
+ */
+size_t spscan_block(spscan_t* scan, const char* data, size_t len,
+                    int final, int* found);
+
+/*
+ * Carry on after data that went by without being scanned, only the end
+ * of which is at hand: len bytes at tail, where len is at least two.
+ */
+void spscan_skip(spscan_t* scan, const char* tail, size_t len);
+
+#endif /* __SPSCAN_H__ */
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <syslog.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spslab.h"
+#include "spcpu.h"
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+typedef struct spchunk
+{
+    struct spchunk* next;
+    /* Objects follow */
+}
+spchunk_t;
+
+struct spslab
+{
+    size_t size;                /* Size of each object, aligned */
+    int count;                  /* Objects per chunk */
+    int node;                   /* The node chunks come from, or -1 */
+
+    pthread_mutex_t mtx;        /* Protects the following */
+    void* free;                 /* Free objects, linked through their first word */
+    spchunk_t* chunks;          /* All chunks allocated */
+};
+
+/* Objects are aligned to this */
+#define SLAB_ALIGN      16
+
+/* Space for the chunk header, keeping objects aligned */
+#define CHUNK_HEADER    ((sizeof(spchunk_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+/* The size of a whole chunk */
+#define CHUNK_SIZE(s)   (CHUNK_HEADER + (s)->size * (s)->count)
+
+/* -----------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+spslab_t* spslab_new(size_t size, int count)
+{
+    spslab_t* slab;
+
+    ASSERT(size > 0 && count > 0);
+
+    slab = (spslab_t*)calloc(1, sizeof(spslab_t));
+    if(!slab)
+        return NULL;
+
+    slab->size = (max(size, sizeof(void*)) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    slab->count = count;
+    slab->node = -1;
+    pthread_mutex_init(&(slab->mtx), NULL);
+
+    return slab;
+}
+
+void spslab_place(spslab_t* slab, int node)
+{
+    ASSERT(slab);
+
+    sp_mutex_lock(&(slab->mtx));
+        ASSERT(!slab->chunks);
+        slab->node = node;
+    pthread_mutex_unlock(&(slab->mtx));
+}
+
+static void free_chunk(spslab_t* slab, spchunk_t* chunk)
+{
+    /* Placed chunks are mapped on their own, see add_chunk */
+    if(slab->node >= 0)
+        munmap(chunk, CHUNK_SIZE(slab));
+    else
+        free(chunk);
+}
+
+void spslab_free(spslab_t* slab)
+{
+    spchunk_t* chunk;
+
+    if(!slab)
+        return;
+
+    while(slab->chunks)
+    {
+        chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        free_chunk(slab, chunk);
+    }
+
+    pthread_mutex_destroy(&(slab->mtx));
+    free(slab);
+}
+
+/* Called with the lock held */
+static int add_chunk(spslab_t* slab)
+{
+    spchunk_t* chunk;
+    char* obj;
+    int i;
+
+    /*
+     * The policy has to be set on pages no one has touched yet, which
+     * malloc can't promise. So placed chunks get their own mapping.
+     */
+    if(slab->node >= 0)
+    {
+        chunk = (spchunk_t*)mmap(NULL, CHUNK_SIZE(slab), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(chunk == MAP_FAILED)
+            return -1;
+        spcpu_place(chunk, CHUNK_SIZE(slab), slab->node);
+    }
+    else
+    {
+        chunk = (spchunk_t*)malloc(CHUNK_SIZE(slab));
+        if(!chunk)
+            return -1;
+    }
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    /* Put all the new objects on the free list, in order */
+    obj = (char*)chunk + CHUNK_HEADER + slab->size * (slab->count - 1);
+    for(i = 0; i < slab->count; i++, obj -= slab->size)
+    {
+        *((void**)obj) = slab->free;
+        slab->free = obj;
+    }
+
+    return 0;
+}
+
+void* spslab_take(spslab_t* slab)
+{
+    void* obj = NULL;
+
+    ASSERT(slab);
+
+    sp_mutex_lock(&(slab->mtx));
+
+        if(slab->free || add_chunk(slab) == 0)
+        {
+            obj = slab->free;
+            slab->free = *((void**)obj);
+        }
+
+    pthread_mutex_unlock(&(slab->mtx));
+
+    return obj;
+}
+
+void* spslab_alloc(spslab_t* slab)
+{
+    void* obj = spslab_take(slab);
+
+    if(obj)
+        memset(obj, 0, slab->size);
+
+    return obj;
+}
+
+void spslab_release(spslab_t* slab, void* obj)
+{
+    ASSERT(slab);
+
+    if(!obj)
+        return;
+
+    sp_mutex_lock(&(slab->mtx));
+        *((void**)obj) = slab->free;
+        slab->free = obj;
+    pthread_mutex_unlock(&(slab->mtx));
+}
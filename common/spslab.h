@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPSLAB_H__
+#define __SPSLAB_H__
+
+/* -----------------------------------------------------------------------------
+ * SLAB ALLOCATION
+ *
+ * Objects of one size carved out of larger chunks. Freed objects go on
+ * a free list for the next allocation. The chunks are only given back
+ * when the slab is freed. A slab can be tied to a NUMA node.
+ */
+
+struct spslab;
+typedef struct spslab spslab_t;
+
+/* A slab of objects of size, allocated count at a time. NULL on failure */
+spslab_t* spslab_new(size_t size, int count);
+
+/* Have chunks come from memory on a NUMA node. Before any allocation */
+void spslab_place(spslab_t* slab, int node);
+
+/* Free the slab and all objects allocated from it */
+void spslab_free(spslab_t* slab);
+
+/* Allocate a zeroed object, or NULL when out of memory */
+void* spslab_alloc(spslab_t* slab);
+
+/* Allocate an object as it was left, for when it'll be filled anyway */
+void* spslab_take(spslab_t* slab);
+
+/* Return an object to the slab */
+void spslab_release(spslab_t* slab, void* obj);
+
+#endif /* __SPSLAB_H__ */
@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
+#include "usuals.h"
+#include "spslab.h"
+#include "spcoro.h"
+#include "spspool.h"
+
+/* -----------------------------------------------------------------------
+ *  GLOBALS
+ */
+
+static const char* g_dir = NULL;        /* Where the files go */
+static const char* g_prefix = NULL;     /* What they're called */
+static size_t g_limit = 0;              /* Largest message kept in memory */
+static spslab_t* g_blocks = NULL;       /* Memory shared by all spools */
+static int g_anonymous = 1;             /* Files can be made without a name */
+static unsigned long long g_soft = 0;   /* Memory all spools hold before spilling sooner */
+static unsigned long long g_hard = 0;   /* All spools hold before no more are started */
+
+/* What the spools of one process hold, seen by all processes */
+typedef struct spusage
+{
+    unsigned long long memory;          /* Held in blocks */
+    unsigned long long files;           /* Held in files */
+    char _pad[48];                      /* Keep each process to its own cache line */
+}
+spusage_t;
+
+static spusage_t* g_usage = NULL;       /* One for each process, shared between them */
+static int g_nusage = 0;
+static spusage_t* g_mine = NULL;        /* The one for this process */
+
+/* Blocks are carved out this many at a time */
+#define POOL_CHUNK      16
+
+/* Names tried when linking a file into the directory */
+#define LINK_TRIES      16
+
+/* Random characters in those names */
+#define LINK_RANDOM     12
+
+/* -----------------------------------------------------------------------------
+ *  HELPERS
+ */
+
+static int write_all(int fd, const char* data, size_t len, unsigned long long off)
+{
+    ssize_t r;
+
+    while(len > 0)
+    {
+        r = spcoro_write(fd, data, len, off);
+        if(r == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data += r;
+        len -= r;
+        off += r;
+    }
+
+    return 0;
+}
+
+/* What the spools of all processes hold */
+static void total_usage(unsigned long long* memory, unsigned long long* files)
+{
+    int i;
+
+    *memory = 0;
+    *files = 0;
+    for(i = 0; i < g_nusage; i++)
+    {
+        *memory += atomic_get(&(g_usage[i].memory));
+        *files += atomic_get(&(g_usage[i].files));
+    }
+}
+
+static char* add_block(spspool_t* spool)
+{
+    char** blocks;
+    char* block;
+
+    if(spool->_nblocks == spool->_ablocks)
+    {
+        blocks = (char**)realloc(spool->_blocks, sizeof(char*) *
+                                 (spool->_ablocks + 4));
+        if(!blocks)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        spool->_blocks = blocks;
+        spool->_ablocks += 4;
+    }
+
+    block = (char*)spslab_take(g_blocks);
+    if(!block)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    spool->_blocks[spool->_nblocks++] = block;
+    atomic_add(&(g_mine->memory), SPSPOOL_BLOCK);
+    return block;
+}
+
+static void drop_blocks(spspool_t* spool, int keep)
+{
+    while(spool->_nblocks > keep)
+    {
+        spslab_release(g_blocks, spool->_blocks[--spool->_nblocks]);
+        atomic_sub(&(g_mine->memory), SPSPOOL_BLOCK);
+    }
+}
+
+/* Note how much is in the file, for the totals */
+static void set_flushed(spspool_t* spool, unsigned long long flushed)
+{
+    if(flushed > spool->_flushed)
+        atomic_add(&(g_mine->files), flushed - spool->_flushed);
+    else if(flushed < spool->_flushed)
+        atomic_sub(&(g_mine->files), spool->_flushed - flushed);
+    spool->_flushed = flushed;
+}
+
+/* Past the soft limit, a message only gets its first block in memory */
+static int should_spill(spspool_t* spool, size_t len)
+{
+    unsigned long long memory, files;
+
+    if(spool->size + len > g_limit)
+        return 1;
+
+    if(!g_soft || spool->_nblocks == 0 ||
+       spool->size + len <= spool->_nblocks * (unsigned long long)SPSPOOL_BLOCK)
+        return 0;
+
+    total_usage(&memory, &files);
+    return memory >= g_soft;
+}
+
+static void stamp_file(struct stat* sb, unsigned long long* stamp)
+{
+    stamp[0] = sb->st_ino;
+    stamp[1] = sb->st_size;
+    stamp[2] = sb->st_mtime * 1000000000ULL;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    stamp[2] += sb->st_mtim.tv_nsec;
+#endif
+}
+
+static char* alloc_name()
+{
+    size_t namelen = strlen(g_dir) + strlen(g_prefix) + 10;
+    char* name = (char*)malloc(namelen);
+
+    if(name)
+        snprintf(name, namelen, "%s/%s.XXXXXX", g_dir, g_prefix);
+    else
+        errno = ENOMEM;
+    return name;
+}
+
+/* A new file for the spool, without a name when that can be done */
+static int create_file(spspool_t* spool)
+{
+    char* name;
+    int fd;
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT) && defined(HAVE_GETRANDOM)
+    if(g_anonymous)
+    {
+        fd = open(g_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if(fd != -1)
+            return fd;
+
+        /* The file system or kernel can't, so don't keep asking */
+        if(errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL)
+            return -1;
+        g_anonymous = 0;
+    }
+#endif
+
+    name = alloc_name();
+    if(!name)
+        return -1;
+
+    fd = mkstemp(name);
+    if(fd == -1)
+    {
+        free(name);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+    spool->name = name;
+    return fd;
+}
+
+/* Copy the whole file to a new one with a name */
+static int copy_file(spspool_t* spool)
+{
+    unsigned long long off;
+    char* name;
+    ssize_t r;
+    int fd;
+
+    ASSERT(spool->_nblocks == 1);
+
+    name = alloc_name();
+    if(!name)
+        return -1;
+
+    fd = mkstemp(name);
+    if(fd == -1)
+    {
+        free(name);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+
+    for(off = 0; off < spool->size; off += r)
+    {
+        r = pread(spool->fd, spool->_blocks[0], SPSPOOL_BLOCK, off);
+        if(r == -1 && errno == EINTR)
+            r = 0;
+        else if(r <= 0 || write_all(fd, spool->_blocks[0], r, off) == -1)
+        {
+            if(r == 0)
+                errno = EIO;
+            unlink(name);
+            free(name);
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(spool->fd);
+    spool->fd = fd;
+    spool->name = name;
+    return 0;
+}
+
+/* Give a file without a name one in the directory */
+static int name_file(spspool_t* spool)
+{
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT) && defined(HAVE_GETRANDOM)
+    static const char chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    unsigned char rnd[LINK_RANDOM];
+    char proc[64];
+    size_t namelen, len;
+    char* name;
+    int i, j, err = 0;
+
+    namelen = strlen(g_dir) + strlen(g_prefix) + LINK_RANDOM + 3;
+    name = (char*)malloc(namelen);
+    if(!name)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", spool->fd);
+
+    /*
+     * The directory may be writable by others, so the name can't be
+     * guessed, just as with mkstemp.
+     */
+    snprintf(name, namelen, "%s/%s.", g_dir, g_prefix);
+    len = strlen(name);
+
+    for(i = 0; i < LINK_TRIES; i++)
+    {
+        if(getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd))
+        {
+            err = errno;
+            break;
+        }
+
+        for(j = 0; j < LINK_RANDOM; j++)
+            name[len + j] = chars[rnd[j] % (sizeof(chars) - 1)];
+        name[len + j] = 0;
+
+        if(linkat(AT_FDCWD, proc, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0)
+        {
+            spool->name = name;
+            return 0;
+        }
+
+        err = errno;
+        if(err != EEXIST)
+            break;
+    }
+
+    free(name);
+
+    /* Without /proc, from here on files get their names up front */
+    if(err != EEXIST)
+        g_anonymous = 0;
+#endif
+
+    return copy_file(spool);
+}
+
+/* Write out what's in the buffer, when in a file */
+static int flush_spool(spspool_t* spool)
+{
+    ASSERT(spool->fd != -1);
+
+    if(spool->_flushed == spool->size)
+        return 0;
+
+    ASSERT(spool->_nblocks == 1);
+    if(write_all(spool->fd, spool->_blocks[0], spool->size - spool->_flushed,
+                 spool->_flushed) == -1)
+        return -1;
+
+    set_flushed(spool, spool->size);
+    return 0;
+}
+
+/* Move what's in memory to a new file, keeping one block as a buffer */
+static int spill_spool(spspool_t* spool)
+{
+    unsigned long long off;
+    int fd, i;
+
+    ASSERT(spool->fd == -1);
+
+    if(spool->_spare != -1)
+    {
+        fd = spool->_spare;
+        spool->_spare = -1;
+    }
+    else if((fd = create_file(spool)) == -1)
+    {
+        return -1;
+    }
+
+    spool->fd = fd;
+
+    for(i = 0, off = 0; off < spool->size; i++, off += SPSPOOL_BLOCK)
+    {
+        if(write_all(fd, spool->_blocks[i], min(spool->size - off,
+                     (unsigned long long)SPSPOOL_BLOCK), off) == -1)
+            return -1;
+    }
+
+    set_flushed(spool, spool->size);
+    drop_blocks(spool, 1);
+
+    if(spool->_nblocks == 0 && !add_block(spool))
+        return -1;
+
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+int spspool_share(int nprocs)
+{
+    ASSERT(nprocs > 0);
+    ASSERT(!g_usage);
+
+    g_usage = (spusage_t*)mmap(NULL, sizeof(spusage_t) * nprocs, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(g_usage == MAP_FAILED)
+    {
+        g_usage = NULL;
+        return -1;
+    }
+
+    g_nusage = nprocs;
+    return 0;
+}
+
+void spspool_unshare()
+{
+    if(g_usage)
+        munmap(g_usage, sizeof(spusage_t) * g_nusage);
+    g_usage = NULL;
+    g_nusage = 0;
+}
+
+int spspool_init(const char* dir, const char* prefix, size_t limit,
+                 unsigned long long soft, unsigned long long hard, int index)
+{
+    ASSERT(dir && prefix);
+    ASSERT(!g_blocks);
+    ASSERT(g_usage && index >= 0 && index < g_nusage);
+
+    /* Whatever held this before is gone, and what it held with it */
+    g_mine = g_usage + index;
+    atomic_set(&(g_mine->memory), 0);
+    atomic_set(&(g_mine->files), 0);
+
+    g_blocks = spslab_new(SPSPOOL_BLOCK, POOL_CHUNK);
+    if(!g_blocks)
+        return -1;
+
+    g_dir = dir;
+    g_prefix = prefix;
+    g_limit = limit;
+    g_soft = soft;
+    g_hard = hard;
+    return 0;
+}
+
+void spspool_done()
+{
+    if(g_blocks)
+        spslab_free(g_blocks);
+    g_blocks = NULL;
+}
+
+int spspool_full()
+{
+    unsigned long long memory, files;
+
+    if(!g_hard)
+        return 0;
+
+    total_usage(&memory, &files);
+    return memory + files >= g_hard;
+}
+
+void spspool_usage(unsigned long long* memory, unsigned long long* files)
+{
+    total_usage(memory, files);
+}
+
+void spspool_open(spspool_t* spool)
+{
+    ASSERT(spool);
+    ASSERT(g_blocks);
+
+    memset(spool, 0, sizeof(*spool));
+    spool->fd = -1;
+    spool->_spare = -1;
+}
+
+void spspool_close(spspool_t* spool)
+{
+    ASSERT(spool);
+
+    drop_blocks(spool, 0);
+    free(spool->_blocks);
+    set_flushed(spool, 0);
+
+    if(spool->fd != -1)
+        close(spool->fd);
+    if(spool->_spare != -1)
+        close(spool->_spare);
+
+    if(spool->name)
+    {
+        unlink(spool->name);
+        free((char*)spool->name);
+    }
+
+    spspool_open(spool);
+}
+
+void spspool_reset(spspool_t* spool)
+{
+    int spare;
+
+    ASSERT(spool);
+
+    spare = spool->_spare;
+    spool->_spare = -1;
+
+    /*
+     * Once a file has had a name it can't be given one again, and a
+     * filter may have linked it elsewhere. Only a file that never had
+     * one is kept.
+     */
+    if(spool->fd != -1 && !spool->name && spare == -1 &&
+       ftruncate(spool->fd, 0) == 0)
+    {
+        spare = spool->fd;
+        spool->fd = -1;
+    }
+
+    spspool_close(spool);
+    spool->_spare = spare;
+}
+
+int spspool_write(spspool_t* spool, const char* data, size_t len)
+{
+    size_t at, n;
+    char* block;
+
+    ASSERT(spool);
+    ASSERT(!spool->done);
+
+    if(spool->fd == -1 && should_spill(spool, len) &&
+       spill_spool(spool) == -1)
+        return -1;
+
+    while(len > 0)
+    {
+        if(spool->fd == -1)
+        {
+            at = spool->size % SPSPOOL_BLOCK;
+            if(spool->size / SPSPOOL_BLOCK < spool->_nblocks)
+                block = spool->_blocks[spool->size / SPSPOOL_BLOCK];
+            else if(!(block = add_block(spool)))
+                return -1;
+        }
+        else
+        {
+            at = spool->size - spool->_flushed;
+            if(at == SPSPOOL_BLOCK)
+            {
+                if(flush_spool(spool) == -1)
+                    return -1;
+                at = 0;
+            }
+
+            /* Big writes don't need to go through the buffer */
+            if(at == 0 && len >= SPSPOOL_BLOCK)
+            {
+                if(write_all(spool->fd, data, len, spool->size) == -1)
+                    return -1;
+                spool->size += len;
+                set_flushed(spool, spool->size);
+                break;
+            }
+
+            block = spool->_blocks[0];
+        }
+
+        n = min(len, SPSPOOL_BLOCK - at);
+        memcpy(block + at, data, n);
+        spool->size += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int spspool_finish(spspool_t* spool)
+{
+    ASSERT(spool);
+
+    if(spool->done)
+        return 0;
+
+    spool->done = 1;
+
+    if(spool->fd != -1)
+        return flush_spool(spool);
+
+    return 0;
+}
+
+const char* spspool_name(spspool_t* spool)
+{
+    struct stat sb;
+
+    ASSERT(spool);
+    ASSERT(spool->done);
+
+    if(spool->fd == -1 && (spill_spool(spool) == -1 || flush_spool(spool) == -1))
+        return NULL;
+
+    if(!spool->name && name_file(spool) == -1)
+        return NULL;
+
+    if(!spool->_named)
+    {
+        if(fstat(spool->fd, &sb) == -1)
+            return NULL;
+
+        stamp_file(&sb, spool->_stamp);
+        spool->_named = 1;
+    }
+
+    return spool->name;
+}
+
+int spspool_changed(spspool_t* spool)
+{
+    unsigned long long stamp[3];
+    struct stat sb;
+    int fd;
+
+    ASSERT(spool);
+
+    if(!spool->_named)
+        return 0;
+
+    if(stat(spool->name, &sb) == -1)
+        return -1;
+
+    stamp_file(&sb, stamp);
+    if(memcmp(stamp, spool->_stamp, sizeof(stamp)) == 0)
+        return 0;
+
+    /* It may have been replaced rather than changed */
+    fd = open(spool->name, O_RDONLY);
+    if(fd == -1)
+        return -1;
+
+    if(fstat(fd, &sb) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+    close(spool->fd);
+    spool->fd = fd;
+    spool->size = sb.st_size;
+    set_flushed(spool, sb.st_size);
+    stamp_file(&sb, spool->_stamp);
+    return 1;
+}
+
+ssize_t spspool_view(spspool_t* spool, unsigned long long off, size_t len,
+                     const char** data)
+{
+    ssize_t r;
+    size_t at;
+
+    ASSERT(spool && data);
+    ASSERT(spool->done);
+
+    if(off >= spool->size)
+        return 0;
+
+    len = min(len, spool->size - off);
+
+    if(spool->fd == -1)
+    {
+        at = off % SPSPOOL_BLOCK;
+        *data = spool->_blocks[off / SPSPOOL_BLOCK] + at;
+        return min(len, SPSPOOL_BLOCK - at);
+    }
+
+    /* Once finished the write buffer is free to read into */
+    ASSERT(spool->_nblocks == 1);
+    len = min(len, SPSPOOL_BLOCK);
+
+    for(;;)
+    {
+        r = pread(spool->fd, spool->_blocks[0], len, off);
+        if(r == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+
+    if(r > 0)
+        *data = spool->_blocks[0];
+    return r;
+}
+
+ssize_t spspool_read(spspool_t* spool, unsigned long long off, char* buf,
+                     size_t len)
+{
+    const char* data;
+    ssize_t r;
+    size_t n = 0;
+
+    while(n < len)
+    {
+        r = spspool_view(spool, off + n, len - n, &data);
+        if(r == -1)
+            return -1;
+        if(r == 0)
+            break;
+
+        memcpy(buf + n, data, r);
+        n += r;
+    }
+
+    return n;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPSPOOL_H__
+#define __SPSPOOL_H__
+
+#include <sys/types.h>
+
+/* -----------------------------------------------------------------------------
+ * MESSAGE SPOOL
+ *
+ * Holds a message while it's being looked at. Small messages are kept in
+ * memory, in blocks from a pool shared by all sessions. A message that
+ * grows past the limit is moved to a temp file, as is one that something
+ * outside needs to open by name. Where the system allows, the file has no
+ * name until one is asked for, and a reset spool keeps it for next time.
+ */
+
+/* Memory is handed out in blocks of this size */
+#define SPSPOOL_BLOCK       (64 * 1024)
+
+typedef struct spspool
+{
+    unsigned long long size;        /* Bytes in the spool */
+    const char* name;               /* The file it's in, once it's in one */
+    int fd;                         /* Open on that file, or -1 */
+    int done;                       /* Set once finished writing */
+
+    /* Used internally */
+    char** _blocks;                 /* The data, or the write buffer for the file */
+    int _nblocks;
+    int _ablocks;
+    unsigned long long _flushed;    /* How much is in the file */
+    int _named;                     /* The name was handed out */
+    unsigned long long _stamp[3];   /* What the file looked like then */
+    int _spare;                     /* An empty file kept for reuse, or -1 */
+}
+spspool_t;
+
+/*
+ * Keep count of what the spools of nprocs processes hold, so that the
+ * limits are for all of them together. Call before forking them.
+ * Returns -1 on failure.
+ */
+int spspool_share(int nprocs);
+
+/* Once the processes are gone */
+void spspool_unshare();
+
+/*
+ * Spool files are created in dir and named after prefix. Messages larger
+ * than limit bytes go to a file. Once all spools together hold soft bytes
+ * of memory, messages that need more than a block go to a file too. At
+ * hard bytes in memory and files, the spool is full. Zero for no limit.
+ * The process counts as index, below nprocs from spspool_share.
+ * Returns -1 on failure.
+ */
+int spspool_init(const char* dir, const char* prefix, size_t limit,
+                 unsigned long long soft, unsigned long long hard, int index);
+
+/* Give back the memory pool. Once no spools are left */
+void spspool_done();
+
+/* Whether the spools hold as much as they should, and no more messages start */
+int spspool_full();
+
+/* How much all spools hold, in memory and in files, in all processes */
+void spspool_usage(unsigned long long* memory, unsigned long long* files);
+
+/* Start an empty spool */
+void spspool_open(spspool_t* spool);
+
+/* Drop the data and remove any file */
+void spspool_close(spspool_t* spool);
+
+/*
+ * Empty the spool for another message. A file that was never given a
+ * name is truncated and kept, so it needn't be created again.
+ */
+void spspool_reset(spspool_t* spool);
+
+/* Add to the spool. Returns -1 and sets errno on failure */
+int spspool_write(spspool_t* spool, const char* data, size_t len);
+
+/* No more writing. Returns -1 and sets errno on failure */
+int spspool_finish(spspool_t* spool);
+
+/*
+ * Put a finished spool in a file, for handing to something that opens it.
+ * Returns the file name, or NULL and sets errno on failure.
+ */
+const char* spspool_name(spspool_t* spool);
+
+/*
+ * Whether a spool handed out by name was changed in its file since. The
+ * spool then reads the file as it is now. Returns -1 on failure.
+ */
+int spspool_changed(spspool_t* spool);
+
+/*
+ * Look at data in a finished spool, starting at off. Points data at up to
+ * len bytes, valid until the next call. Returns the number of bytes, zero
+ * at the end or -1 on failure.
+ */
+ssize_t spspool_view(spspool_t* spool, unsigned long long off, size_t len,
+                     const char** data);
+
+/* Copy data out of a finished spool. Returns as spspool_view */
+ssize_t spspool_read(spspool_t* spool, unsigned long long off, char* buf,
+                     size_t len);
+
+#endif /* __SPSPOOL_H__ */
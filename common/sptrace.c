@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "usuals.h"
+#include "sptrace.h"
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+struct sptrace
+{
+    size_t size;                /* Of the ring */
+    unsigned long long head;    /* Bytes ever added */
+    unsigned long long tail;    /* Where the oldest record starts */
+    unsigned int dropped;       /* Records pushed out */
+    unsigned char ring[1];      /* The ring follows */
+};
+
+/* No record takes more than this part of the ring */
+#define MAX_KEPT(t)     min((t)->size / 4 - sizeof(sptrace_rec_t), (size_t)0xFFFF)
+
+/* -----------------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+sptrace_t* sptrace_new(size_t size)
+{
+    sptrace_t* trace;
+
+    ASSERT(size >= sizeof(sptrace_rec_t) * 8);
+
+    trace = (sptrace_t*)malloc(sizeof(sptrace_t) + size);
+    if(!trace)
+        return NULL;
+
+    memset(trace, 0, sizeof(sptrace_t));
+    trace->size = size;
+    return trace;
+}
+
+void sptrace_free(sptrace_t* trace)
+{
+    free(trace);
+}
+
+/* Copy into the ring at pos, going round the end */
+static void ring_put(sptrace_t* trace, unsigned long long pos, const void* data, size_t len)
+{
+    size_t at = pos % trace->size;
+    size_t n = min(len, trace->size - at);
+
+    memcpy(trace->ring + at, data, n);
+    memcpy(trace->ring, (const unsigned char*)data + n, len - n);
+}
+
+static void ring_get(sptrace_t* trace, unsigned long long pos, void* data, size_t len)
+{
+    size_t at = pos % trace->size;
+    size_t n = min(len, trace->size - at);
+
+    memcpy(data, trace->ring + at, n);
+    memcpy((unsigned char*)data + n, trace->ring, len - n);
+}
+
+void sptrace_record(sptrace_t* trace, int flags, const void* data, size_t len)
+{
+    sptrace_rec_t rec;
+    sptrace_rec_t old;
+    struct timeval tv;
+    size_t need;
+
+    ASSERT(trace);
+
+    gettimeofday(&tv, NULL);
+    rec.usecs = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    rec.len = (uint32_t)len;
+    rec.kept = (flags & SPTRACE_ELIDED) ? 0 : (uint16_t)min(len, MAX_KEPT(trace));
+    rec.flags = (uint16_t)flags;
+
+    /* Push out the oldest records until this one fits */
+    need = sizeof(rec) + rec.kept;
+    while(trace->head + need - trace->tail > trace->size)
+    {
+        ring_get(trace, trace->tail, &old, sizeof(old));
+        trace->tail += sizeof(old) + old.kept;
+        trace->dropped++;
+    }
+
+    ring_put(trace, trace->head, &rec, sizeof(rec));
+    if(rec.kept > 0)
+        ring_put(trace, trace->head + sizeof(rec), data, rec.kept);
+    trace->head += need;
+}
+
+static int write_all(int fd, const void* data, size_t len)
+{
+    ssize_t r;
+
+    while(len > 0)
+    {
+        r = write(fd, data, len);
+        if(r == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data = (const unsigned char*)data + r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+int sptrace_write(sptrace_t* trace, unsigned int id, int fd)
+{
+    sptrace_head_t head;
+    size_t at, len;
+
+    ASSERT(trace);
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, SPTRACE_MAGIC, sizeof(head.magic));
+    head.id = id;
+    head.dropped = trace->dropped;
+
+    if(write_all(fd, &head, sizeof(head)) == -1)
+        return -1;
+
+    /* The records are in at most two pieces, either side of the end */
+    at = trace->tail % trace->size;
+    len = trace->head - trace->tail;
+
+    if(at + len > trace->size)
+    {
+        if(write_all(fd, trace->ring + at, trace->size - at) == -1)
+            return -1;
+        len -= trace->size - at;
+        at = 0;
+    }
+
+    return write_all(fd, trace->ring + at, len);
+}
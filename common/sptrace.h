@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPTRACE_H__
+#define __SPTRACE_H__
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------------
+ * WIRE TRACES
+ *
+ * The bytes that went across a session's sockets, with when and which way,
+ * kept in a ring of fixed size so the oldest go as more comes in. Only the
+ * session adds to its own trace, so there's no locking, and nothing is
+ * formatted until the trace is written out.
+ *
+ * A written trace is an sptrace_head_t, followed by each record oldest
+ * first: an sptrace_rec_t and then the bytes kept. All in host byte order.
+ */
+
+#define SPTRACE_MAGIC       "SPTRACE1"
+
+/* Which way the data went */
+#define SPTRACE_WRITE       0x0001          /* Sent by us, otherwise received */
+#define SPTRACE_SERVER      0x0002          /* On the server socket, otherwise the client */
+#define SPTRACE_ELIDED      0x0004          /* Passed across unseen, only the length is known */
+
+typedef struct sptrace_head
+{
+    char magic[8];                          /* SPTRACE_MAGIC */
+    uint32_t id;                            /* The connection id, as logged */
+    uint32_t dropped;                       /* Records that were pushed out */
+}
+sptrace_head_t;
+
+typedef struct sptrace_rec
+{
+    uint64_t usecs;                         /* Microseconds since the epoch */
+    uint32_t len;                           /* Bytes that went across */
+    uint16_t kept;                          /* Of those, how many follow */
+    uint16_t flags;                         /* SPTRACE_XXX above */
+}
+sptrace_rec_t;
+
+struct sptrace;
+typedef struct sptrace sptrace_t;
+
+/* A trace holding about size bytes. NULL when out of memory */
+sptrace_t* sptrace_new(size_t size);
+void sptrace_free(sptrace_t* trace);
+
+/* Add what went across. Long records only keep their start */
+void sptrace_record(sptrace_t* trace, int flags, const void* data, size_t len);
+
+/* Write the trace out to a descriptor. Returns -1 and errno on failure */
+int sptrace_write(sptrace_t* trace, unsigned int id, int fd);
+
+#endif /* __SPTRACE_H__ */
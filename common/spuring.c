@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spuring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/syscall.h>
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+struct spuring
+{
+    int fd;                         /* The ring descriptor */
+    void* mem;                      /* Both queues, mapped from the kernel */
+    size_t memsz;
+    struct io_uring_sqe* sqes;      /* Requests, also mapped */
+    size_t sqesz;
+
+    unsigned int* sqhead;           /* Submission queue */
+    unsigned int* sqtail;
+    unsigned int* sqarray;
+    unsigned int sqmask;
+    unsigned int sqentries;
+    unsigned int sqlocal;           /* Our tail, not yet shown to the kernel */
+
+    unsigned int* cqhead;           /* Completion queue */
+    unsigned int* cqtail;
+    struct io_uring_cqe* cqes;
+    unsigned int cqmask;
+
+    struct io_uring_buf_ring* br;   /* Provided buffers */
+    size_t brsz;
+    unsigned short brtail;
+    int brmask;
+    char* bufs;
+    int bufsize;
+
+    unsigned char ops[IORING_OP_LAST];  /* Which opcodes are supported */
+};
+
+/* Features we can't do without */
+#define NEEDED_FEATURES     (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+/* -----------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+static int uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait,
+                       unsigned int flags, void* arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned int op, void* arg, unsigned int nargs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static void probe_ops(spuring_t* ring)
+{
+    struct io_uring_probe* probe;
+    size_t len;
+    int i;
+
+    len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = (struct io_uring_probe*)calloc(1, len);
+    if(!probe)
+        return;
+
+    if(uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        for(i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+        {
+            if(probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+                ring->ops[probe->ops[i].op] = 1;
+        }
+    }
+
+    free(probe);
+}
+
+spuring_t* spuring_new(unsigned int entries)
+{
+    struct io_uring_params p;
+    spuring_t* ring;
+    size_t sqsz, cqsz;
+    char* mem;
+    int e;
+
+    ring = (spuring_t*)calloc(1, sizeof(spuring_t));
+    if(!ring)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ring->mem = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = uring_setup(entries, &p);
+    if(ring->fd == -1)
+        goto failed;
+
+    if((p.features & NEEDED_FEATURES) != NEEDED_FEATURES)
+    {
+        errno = ENOTSUP;
+        goto failed;
+    }
+
+    /* Both queues live in the one mapping */
+    sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->memsz = max(sqsz, cqsz);
+    ring->mem = mmap(NULL, ring->memsz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->mem == MAP_FAILED)
+        goto failed;
+
+    ring->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto failed;
+
+    mem = (char*)ring->mem;
+    ring->sqhead = (unsigned int*)(mem + p.sq_off.head);
+    ring->sqtail = (unsigned int*)(mem + p.sq_off.tail);
+    ring->sqarray = (unsigned int*)(mem + p.sq_off.array);
+    ring->sqmask = *(unsigned int*)(mem + p.sq_off.ring_mask);
+    ring->sqentries = p.sq_entries;
+    ring->sqlocal = *(ring->sqtail);
+
+    ring->cqhead = (unsigned int*)(mem + p.cq_off.head);
+    ring->cqtail = (unsigned int*)(mem + p.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(mem + p.cq_off.cqes);
+    ring->cqmask = *(unsigned int*)(mem + p.cq_off.ring_mask);
+
+    probe_ops(ring);
+    return ring;
+
+failed:
+    e = errno;
+    spuring_free(ring);
+    errno = e;
+    return NULL;
+}
+
+void spuring_free(spuring_t* ring)
+{
+    if(!ring)
+        return;
+
+    if(ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesz);
+    if(ring->mem != MAP_FAILED)
+        munmap(ring->mem, ring->memsz);
+    if(ring->br)
+        munmap(ring->br, ring->brsz);
+    if(ring->fd != -1)
+        close(ring->fd);
+
+    free(ring->bufs);
+    free(ring);
+}
+
+int spuring_supports(spuring_t* ring, int op)
+{
+    ASSERT(ring);
+    return op >= 0 && op < IORING_OP_LAST && ring->ops[op];
+}
+
+/* Show the kernel what we've queued, returns the number not yet taken */
+static unsigned int flush_queue(spuring_t* ring)
+{
+    __atomic_store_n(ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+    return ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe* spuring_get(spuring_t* ring)
+{
+    struct io_uring_sqe* sqe;
+    unsigned int index;
+
+    ASSERT(ring);
+
+    /* Full up, hand what we have to the kernel first */
+    if(ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+    {
+        uring_enter(ring->fd, flush_queue(ring), 0, 0, NULL, 0);
+
+        if(ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+            return NULL;
+    }
+
+    index = ring->sqlocal & ring->sqmask;
+    sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqarray[index] = index;
+    ring->sqlocal++;
+
+    return sqe;
+}
+
+int spuring_wait(spuring_t* ring, int msecs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int submit, wait, flags;
+    int r;
+
+    ASSERT(ring);
+
+    submit = flush_queue(ring);
+
+    /* Don't wait when there's already something to do */
+    wait = 1;
+    if(msecs == 0 || spuring_peek(ring))
+        wait = 0;
+
+    if(!submit && !wait)
+        return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    flags = 0;
+
+    if(wait)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+        if(msecs > 0)
+        {
+            ts.tv_sec = msecs / 1000;
+            ts.tv_nsec = (msecs % 1000) * 1000000L;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+    }
+
+    r = uring_enter(ring->fd, submit, wait, flags, wait ? &arg : NULL,
+                    wait ? sizeof(arg) : 0);
+
+    if(r == -1)
+    {
+        switch(errno)
+        {
+        /* Timed out, or the kernel is too busy to take more right now */
+        case ETIME:
+        case EAGAIN:
+        case EBUSY:
+            return 0;
+        default:
+            return -1;
+        };
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe* spuring_peek(spuring_t* ring)
+{
+    unsigned int head;
+
+    ASSERT(ring);
+
+    head = *(ring->cqhead);
+    if(head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return ring->cqes + (head & ring->cqmask);
+}
+
+void spuring_seen(spuring_t* ring)
+{
+    ASSERT(ring);
+    __atomic_store_n(ring->cqhead, *(ring->cqhead) + 1, __ATOMIC_RELEASE);
+}
+
+int spuring_buffers(spuring_t* ring, int count, int size)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    ASSERT(ring && !ring->br);
+    ASSERT(count > 0 && (count & (count - 1)) == 0);
+
+    ring->brsz = count * sizeof(struct io_uring_buf);
+    ring->br = (struct io_uring_buf_ring*)mmap(NULL, ring->brsz, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->br == MAP_FAILED)
+    {
+        ring->br = NULL;
+        return -1;
+    }
+
+    ring->bufs = (char*)malloc((size_t)count * size);
+    if(!ring->bufs)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring->br;
+    reg.ring_entries = count;
+    reg.bgid = 0;
+
+    if(uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    ring->brmask = count - 1;
+    ring->bufsize = size;
+    ring->brtail = 0;
+
+    for(i = 0; i < count; i++)
+        spuring_recycle(ring, i);
+
+    return 0;
+}
+
+const char* spuring_buffer(spuring_t* ring, int bid)
+{
+    ASSERT(ring && ring->bufs);
+    ASSERT(bid >= 0 && bid <= ring->brmask);
+    return ring->bufs + (size_t)bid * ring->bufsize;
+}
+
+void spuring_recycle(spuring_t* ring, int bid)
+{
+    struct io_uring_buf* buf;
+
+    ASSERT(ring && ring->br);
+    ASSERT(bid >= 0 && bid <= ring->brmask);
+
+    buf = &(ring->br->bufs[ring->brtail & ring->brmask]);
+    buf->addr = (unsigned long long)(uintptr_t)(ring->bufs + (size_t)bid * ring->bufsize);
+    buf->len = ring->bufsize;
+    buf->bid = bid;
+
+    ring->brtail++;
+    __atomic_store_n(&(ring->br->tail), ring->brtail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
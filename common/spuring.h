@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPURING_H__
+#define __SPURING_H__
+
+/* -----------------------------------------------------------------------------
+ * IO_URING
+ *
+ * Just enough of an io_uring wrapper for our needs, talking to the kernel
+ * directly. A ring is only ever used from one thread. Requests are queued
+ * and handed to the kernel together the next time we wait.
+ */
+
+struct spuring;
+typedef struct spuring spuring_t;
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+/* Set up a ring. Returns NULL with errno set if the kernel can't do it */
+spuring_t* spuring_new(unsigned int entries);
+
+/* Close down the ring */
+void spuring_free(spuring_t* ring);
+
+/* Whether the kernel supports the opcode */
+int spuring_supports(spuring_t* ring, int op);
+
+/* A cleared request to fill in. NULL if the queue is full and stuck */
+struct io_uring_sqe* spuring_get(spuring_t* ring);
+
+/*
+ * Hand queued requests to the kernel and wait up to msecs for at least
+ * one completion, or forever when -1. Returns -1 on failure and when
+ * interrupted by a signal.
+ */
+int spuring_wait(spuring_t* ring, int msecs);
+
+/* The next completion, or NULL. Call spuring_seen() once done with it */
+struct io_uring_cqe* spuring_peek(spuring_t* ring);
+void spuring_seen(spuring_t* ring);
+
+/*
+ * Give the kernel count buffers of size each, in buffer group zero, for
+ * requests to pick from. Count must be a power of two.
+ */
+int spuring_buffers(spuring_t* ring, int count, int size);
+
+/* The data in a buffer picked by the kernel, and giving it back after */
+const char* spuring_buffer(spuring_t* ring, int bid);
+void spuring_recycle(spuring_t* ring, int bid);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* __SPURING_H__ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usuals.h"
+#include "spwheel.h"
+
+#define SLOT_MASK       (SPWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l)  ((l) * SPWHEEL_BITS)
+#define LEVEL_SPAN(l)   (1ULL << LEVEL_SHIFT(l))
+#define SLOT_OF(w, l)   ((int)(((w) >> LEVEL_SHIFT(l)) & SLOT_MASK))
+
+/* How far out the wheel reaches, timers beyond that come round again */
+#define WHEEL_SPAN      LEVEL_SPAN(SPWHEEL_LEVELS)
+
+/* -----------------------------------------------------------------------------
+ *  IMPLEMENTATION
+ */
+
+unsigned long long spwheel_clock()
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    if(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == -1)
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Put a timer in the slot for when it's due, relative to the wheel */
+static void link_timer(spwheel_t* wheel, spwtimer_t* t)
+{
+    unsigned long long when = t->when;
+    unsigned long long delta;
+    spwtimer_t** head;
+    int level, slot;
+
+    /* Already due, goes in with what's run next */
+    if(when < wheel->tick)
+        when = wheel->tick;
+
+    delta = when - wheel->tick;
+    if(delta >= WHEEL_SPAN)
+    {
+        when = wheel->tick + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    for(level = 0; level < SPWHEEL_LEVELS - 1; level++)
+    {
+        if(delta < LEVEL_SPAN(level + 1))
+            break;
+    }
+
+    slot = SLOT_OF(when, level);
+    head = &(wheel->slots[level][slot]);
+
+    t->slot = (level << SPWHEEL_BITS) | slot;
+    t->next = *head;
+    if(t->next)
+        t->next->prev = &(t->next);
+    t->prev = head;
+    *head = t;
+
+    wheel->used[level] |= (1ULL << slot);
+}
+
+/* Move timers down from a slot on a higher level. Returns the slot */
+static int cascade(spwheel_t* wheel, int level)
+{
+    int slot = SLOT_OF(wheel->tick, level);
+    spwtimer_t* t = wheel->slots[level][slot];
+    spwtimer_t* next;
+
+    wheel->slots[level][slot] = NULL;
+    wheel->used[level] &= ~(1ULL << slot);
+
+    for( ; t; t = next)
+    {
+        next = t->next;
+        link_timer(wheel, t);
+    }
+
+    return slot;
+}
+
+static int wheel_empty(spwheel_t* wheel)
+{
+    int i;
+
+    for(i = 0; i < SPWHEEL_LEVELS; i++)
+    {
+        if(wheel->used[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+void spwheel_init(spwheel_t* wheel)
+{
+    ASSERT(wheel);
+
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick = spwheel_clock();
+}
+
+void spwheel_add(spwheel_t* wheel, spwtimer_t* t, unsigned long long when)
+{
+    ASSERT(wheel && t && t->callback);
+
+    spwheel_del(wheel, t);
+    t->when = when;
+    link_timer(wheel, t);
+}
+
+void spwheel_del(spwheel_t* wheel, spwtimer_t* t)
+{
+    int level, slot;
+
+    ASSERT(wheel && t);
+
+    if(!t->prev)
+        return;
+
+    *(t->prev) = t->next;
+    if(t->next)
+        t->next->prev = t->prev;
+
+    t->next = NULL;
+    t->prev = NULL;
+
+    /* Not strictly needed, but saves waking for nothing */
+    level = t->slot >> SPWHEEL_BITS;
+    slot = t->slot & SLOT_MASK;
+    if(!wheel->slots[level][slot])
+        wheel->used[level] &= ~(1ULL << slot);
+}
+
+void spwheel_run(spwheel_t* wheel, unsigned long long now)
+{
+    spwtimer_t* due;
+    spwtimer_t* t;
+    unsigned long long bits;
+    int slot, skip;
+
+    ASSERT(wheel);
+
+    while(wheel->tick <= now)
+    {
+        if(wheel_empty(wheel))
+        {
+            wheel->tick = now + 1;
+            break;
+        }
+
+        slot = SLOT_OF(wheel->tick, 0);
+
+        /* At the start of each turn timers come down a level */
+        if(slot == 0 && cascade(wheel, 1) == 0 && cascade(wheel, 2) == 0)
+            cascade(wheel, 3);
+
+        /* Go straight to the next slot with something in it */
+        bits = wheel->used[0] >> slot;
+        skip = bits ? __builtin_ctzll(bits) : SPWHEEL_SLOTS - slot;
+        if(wheel->tick + skip > now)
+        {
+            wheel->tick = now + 1;
+            break;
+        }
+
+        wheel->tick += skip;
+        if(!bits)
+            continue;
+
+        slot += skip;
+        due = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->used[0] &= ~(1ULL << slot);
+        wheel->tick++;
+
+        /* Taken off the wheel as they fire, callbacks may cancel the others */
+        if(due)
+            due->prev = &due;
+
+        while((t = due) != NULL)
+        {
+            due = t->next;
+            if(due)
+                due->prev = &due;
+
+            t->next = NULL;
+            t->prev = NULL;
+            (t->callback)(t);
+        }
+    }
+}
+
+int spwheel_next(spwheel_t* wheel, int max)
+{
+    unsigned long long bits, due, now;
+    int slot;
+
+    ASSERT(wheel);
+
+    if(wheel_empty(wheel))
+        return max;
+
+    /* The next slot on the lowest level, or when the next turn comes down */
+    slot = SLOT_OF(wheel->tick, 0);
+    bits = wheel->used[0] >> slot;
+    due = wheel->tick + (bits ? __builtin_ctzll(bits) : SPWHEEL_SLOTS - slot);
+
+    now = spwheel_clock();
+    if(due <= now)
+        return 0;
+
+    return (int)min(due - now, (unsigned long long)max);
+}
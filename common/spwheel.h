@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPWHEEL_H__
+#define __SPWHEEL_H__
+
+/* -----------------------------------------------------------------------------
+ * TIMER WHEELS
+ *
+ * Timers hashed by when they're due into a few levels of slots, each
+ * level covering SPWHEEL_SLOTS times the span of the one below. Adding,
+ * cancelling and firing a timer are all O(1) however many are pending.
+ * A timer far out waits on a higher level and moves down as it comes
+ * closer. Times are in milliseconds on a clock that doesn't jump.
+ */
+
+#define SPWHEEL_BITS    6
+#define SPWHEEL_SLOTS   (1 << SPWHEEL_BITS)
+#define SPWHEEL_LEVELS  4                   /* Up to about four and a half hours */
+
+/* A timer that fires once. Owned by the caller, zeroed before first use */
+typedef struct spwtimer
+{
+    void (*callback)(struct spwtimer* t);
+    void* arg;                              /* For use by the callback */
+
+    /* Used internally */
+    unsigned long long when;
+    int slot;
+    struct spwtimer* next;
+    struct spwtimer** prev;
+}
+spwtimer_t;
+
+typedef struct spwheel
+{
+    unsigned long long tick;                /* The next millisecond to run */
+    unsigned long long used[SPWHEEL_LEVELS];    /* Slots with timers in them */
+    spwtimer_t* slots[SPWHEEL_LEVELS][SPWHEEL_SLOTS];
+}
+spwheel_t;
+
+/*
+ * Milliseconds on a monotonic clock. Cheap enough to call often: it's
+ * the kernel's copy as of its last tick, where the system has one.
+ */
+unsigned long long spwheel_clock();
+
+/* Start an empty wheel at the current time */
+void spwheel_init(spwheel_t* wheel);
+
+/* Fire the timer once the clock reaches when. Restarts it if pending */
+void spwheel_add(spwheel_t* wheel, spwtimer_t* t, unsigned long long when);
+
+/* Cancel a timer. Fine when it isn't pending, or has already fired */
+void spwheel_del(spwheel_t* wheel, spwtimer_t* t);
+
+/* Whether a timer is waiting to fire */
+#define spwheel_pending(t)  ((t)->prev != NULL)
+
+/* Fire the timers that are due as of now. Callbacks may add and cancel */
+void spwheel_run(spwheel_t* wheel, unsigned long long now);
+
+/* Milliseconds to wait before running again, at most max */
+int spwheel_next(spwheel_t* wheel, int max);
+
+#endif /* __SPWHEEL_H__ */
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#include "usuals.h"
+#include "sock_any.h"
+#include "sppriv.h"
+#include "spwork.h"
+#include "spcpu.h"
+
+/* -----------------------------------------------------------------------
+ *  STRUCTURES
+ */
+
+/*
+ * A bounded lock free queue. Any number of threads can push and pop.
+ * See Dmitry Vyukov's bounded MPMC queue.
+ */
+
+typedef struct spcell
+{
+    size_t seq;
+    spwork_t* work;
+}
+spcell_t;
+
+typedef struct spqueue
+{
+    size_t mask;
+    spcell_t* cells;
+    char _pad1[64];
+    size_t head;                /* Next position to push at */
+    char _pad2[64];
+    size_t tail;                /* Next position to pop from */
+    char _pad3[64];
+}
+spqueue_t;
+
+typedef struct spworker
+{
+    pthread_t tid;
+    int home;                   /* The queue we look at first */
+    int fd;                     /* Descriptor of the running work */
+}
+spworker_t;
+
+typedef struct sppool
+{
+    spqueue_t* queues;
+    int nqueues;
+
+    spworker_t* workers;
+    int nworkers;               /* Workers started so far */
+    int maxworkers;
+
+    int idle;                   /* Unclaimed idle workers */
+    sem_t wake;                 /* Posted once per claimed idle worker */
+    int stopping;
+}
+sppool_t;
+
+/* -----------------------------------------------------------------------
+ *  GLOBALS
+ */
+
+static sppool_t g_pool;
+
+/* The smallest queue we'll make */
+#define MIN_QUEUE       64
+
+/* -----------------------------------------------------------------------
+ *  QUEUES
+ */
+
+static int queue_init(spqueue_t* queue, size_t size)
+{
+    size_t i, cap = MIN_QUEUE;
+
+    while(cap < size)
+        cap <<= 1;
+
+    queue->cells = (spcell_t*)calloc(cap, sizeof(spcell_t));
+    if(!queue->cells)
+        return -1;
+
+    for(i = 0; i < cap; i++)
+        queue->cells[i].seq = i;
+
+    queue->mask = cap - 1;
+    queue->head = queue->tail = 0;
+    return 0;
+}
+
+static int queue_push(spqueue_t* queue, spwork_t* work)
+{
+    spcell_t* cell;
+    size_t pos, seq;
+    intptr_t dif;
+
+    pos = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    for(;;)
+    {
+        cell = queue->cells + (pos & queue->mask);
+        seq = atomic_get(&(cell->seq));
+        dif = (intptr_t)seq - (intptr_t)pos;
+
+        if(dif == 0)
+        {
+            if(atomic_cas(&(queue->head), &pos, pos + 1))
+                break;
+        }
+
+        /* Full */
+        else if(dif < 0)
+            return -1;
+
+        else
+            pos = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    }
+
+    cell->work = work;
+    atomic_set(&(cell->seq), pos + 1);
+    return 0;
+}
+
+static spwork_t* queue_pop(spqueue_t* queue)
+{
+    spwork_t* work;
+    spcell_t* cell;
+    size_t pos, seq;
+    intptr_t dif;
+
+    pos = __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED);
+    for(;;)
+    {
+        cell = queue->cells + (pos & queue->mask);
+        seq = atomic_get(&(cell->seq));
+        dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(dif == 0)
+        {
+            if(atomic_cas(&(queue->tail), &pos, pos + 1))
+                break;
+        }
+
+        /* Empty */
+        else if(dif < 0)
+            return NULL;
+
+        else
+            pos = __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED);
+    }
+
+    work = cell->work;
+    atomic_set(&(cell->seq), pos + queue->mask + 1);
+    return work;
+}
+
+/* -----------------------------------------------------------------------
+ *  WORKERS
+ */
+
+static spwork_t* take_work(int home)
+{
+    spwork_t* work;
+    int node = spcpu_node(home);
+    int local, i, q;
+
+    /* Our own queue first, then steal from our node, then from the others */
+    for(local = 1; local >= 0; local--)
+    {
+        for(i = 0; i < g_pool.nqueues; i++)
+        {
+            q = (home + i) % g_pool.nqueues;
+            if((spcpu_node(q) == node) != local)
+                continue;
+
+            work = queue_pop(g_pool.queues + q);
+            if(work)
+                return work;
+        }
+    }
+
+    return NULL;
+}
+
+/* Take back an idle count we added, or wait for whoever claimed it */
+static void unidle()
+{
+    int n;
+
+    for(;;)
+    {
+        n = atomic_get(&(g_pool.idle));
+        if(n <= 0)
+            break;
+        if(atomic_cas(&(g_pool.idle), &n, n - 1))
+            return;
+    }
+
+    while(sem_wait(&(g_pool.wake)) == -1 && errno == EINTR)
+        ;
+}
+
+static void* worker_main(void* arg)
+{
+    spworker_t* worker = (spworker_t*)arg;
+    spwork_t* work;
+
+    /* Sits with the loop that feeds our queue */
+    spcpu_pin(worker->home);
+
+    for(;;)
+    {
+        work = take_work(worker->home);
+
+        if(!work)
+        {
+            if(atomic_get(&(g_pool.stopping)))
+                break;
+
+            atomic_add(&(g_pool.idle), 1);
+            atomic_fence();
+
+            /* Something may have come in before we were counted as idle */
+            work = take_work(worker->home);
+            if(work)
+            {
+                unidle();
+            }
+            else
+            {
+                while(sem_wait(&(g_pool.wake)) == -1 && errno == EINTR)
+                    ;
+                continue;
+            }
+        }
+
+        atomic_set(&(worker->fd), work->fd);
+        (work->func)(work);
+        atomic_set(&(worker->fd), -1);
+    }
+
+    return NULL;
+}
+
+static int start_worker()
+{
+    spworker_t* worker;
+    int n, r;
+
+    for(;;)
+    {
+        n = atomic_get(&(g_pool.nworkers));
+        if(n >= g_pool.maxworkers)
+            return -1;
+        if(atomic_cas(&(g_pool.nworkers), &n, n + 1))
+            break;
+    }
+
+    worker = g_pool.workers + n;
+    worker->home = n % g_pool.nqueues;
+    worker->fd = -1;
+
+    r = sp_thread_create(&(worker->tid), worker_main, worker);
+    if(r != 0)
+    {
+        /* Mark so we don't join it later */
+        worker->home = -1;
+        errno = r;
+        sp_message(NULL, LOG_ERR, "couldn't create worker thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+int spwork_init(int nqueues, int nstart, int nmax)
+{
+    int i;
+
+    ASSERT(nqueues > 0 && nmax > 0);
+
+    memset(&g_pool, 0, sizeof(g_pool));
+
+    if(nstart > nmax)
+        nstart = nmax;
+
+    g_pool.nqueues = nqueues;
+    g_pool.maxworkers = nmax;
+
+    g_pool.queues = (spqueue_t*)calloc(nqueues, sizeof(spqueue_t));
+    g_pool.workers = (spworker_t*)calloc(nmax, sizeof(spworker_t));
+    if(!g_pool.queues || !g_pool.workers)
+    {
+        sp_messagex(NULL, LOG_CRIT, "out of memory");
+        return -1;
+    }
+
+    /* Room for all the work that can be outstanding, plus some */
+    for(i = 0; i < nqueues; i++)
+    {
+        if(queue_init(g_pool.queues + i, (nmax * 2) / nqueues) == -1)
+        {
+            sp_messagex(NULL, LOG_CRIT, "out of memory");
+            return -1;
+        }
+    }
+
+    if(sem_init(&(g_pool.wake), 0, 0) == -1)
+    {
+        sp_message(NULL, LOG_CRIT, "couldn't create semaphore");
+        return -1;
+    }
+
+    for(i = 0; i < nstart; i++)
+    {
+        if(start_worker() == -1)
+            return -1;
+    }
+
+    sp_messagex(NULL, LOG_DEBUG, "started %d worker threads", nstart);
+    return 0;
+}
+
+void spwork_done()
+{
+    int i, n, fd;
+
+    if(!g_pool.workers)
+        return;
+
+    atomic_set(&(g_pool.stopping), 1);
+    n = atomic_get(&(g_pool.nworkers));
+
+    sp_messagex(NULL, LOG_DEBUG, "waiting for threads to quit");
+
+    for(i = 0; i < n; i++)
+    {
+        /* Interrupt any blocking IO */
+        fd = atomic_get(&(g_pool.workers[i].fd));
+        if(fd != -1)
+            shutdown(fd, SHUT_RDWR);
+
+        sem_post(&(g_pool.wake));
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        if(g_pool.workers[i].home != -1)
+            pthread_join(g_pool.workers[i].tid, NULL);
+    }
+
+    for(i = 0; i < g_pool.nqueues; i++)
+        free(g_pool.queues[i].cells);
+
+    sem_destroy(&(g_pool.wake));
+    free(g_pool.queues);
+    free(g_pool.workers);
+    memset(&g_pool, 0, sizeof(g_pool));
+}
+
+int spwork_queues()
+{
+    return g_pool.nqueues;
+}
+
+int spwork_push(int queue, spwork_t* work)
+{
+    int i, n;
+
+    ASSERT(work && work->func);
+    ASSERT(g_pool.queues);
+
+    /* Try the queue we were asked for first */
+    for(i = 0; i < g_pool.nqueues; i++)
+    {
+        if(queue_push(g_pool.queues + ((queue + i) % g_pool.nqueues), work) == 0)
+            break;
+    }
+
+    if(i == g_pool.nqueues)
+    {
+        sp_messagex(NULL, LOG_ERR, "worker queues are full");
+        return -1;
+    }
+
+    /* Pairs with the worker checking the queues after going idle */
+    atomic_fence();
+
+    /* Claim an idle worker and wake it up */
+    for(;;)
+    {
+        n = atomic_get(&(g_pool.idle));
+        if(n <= 0)
+            break;
+        if(atomic_cas(&(g_pool.idle), &n, n - 1))
+        {
+            sem_post(&(g_pool.wake));
+            return 0;
+        }
+    }
+
+    /*
+     * Nobody is idle, so start another worker. When we already have
+     * the maximum the work is picked up when a worker finishes.
+     */
+    start_worker();
+    return 0;
+}
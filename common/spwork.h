@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2004, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#ifndef __SPWORK_H__
+#define __SPWORK_H__
+
+/* -----------------------------------------------------------------------------
+ * WORKER THREADS
+ *
+ * A pool of persistent threads which run work handed to them. Work is
+ * placed on one of several lock free queues, each worker has a home queue
+ * and steals from the others when its own is empty. More workers are
+ * started when none are idle, up to a maximum.
+ */
+
+typedef struct spwork
+{
+    void (*func)(struct spwork* work);  /* Run on a worker thread */
+    void* arg;                          /* For use by func */
+    int fd;                             /* Shut down when the pool stops */
+}
+spwork_t;
+
+/* Start the pool with nqueues queues and nstart threads. Returns -1 on failure */
+int spwork_init(int nqueues, int nstart, int nmax);
+
+/* Interrupt running work, and wait for all workers to quit */
+void spwork_done();
+
+/* Queue work on the given queue. Never blocks. Returns -1 on failure */
+int spwork_push(int queue, spwork_t* work);
+
+/* The number of queues in the pool */
+int spwork_queues();
+
+#endif /* __SPWORK_H__ */
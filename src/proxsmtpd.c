@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <sys/poll.h>
 
 #include <ctype.h>
 #include <stdio.h>
@@ -53,6 +54,7 @@
 #include "sock_any.h"
 #include "stringx.h"
 #include "smtppass.h"
+#include "spslab.h"
 
 /* -----------------------------------------------------------------------
  *  STRUCTURES
@@ -70,6 +72,17 @@ typedef struct pxstate
 }
 pxstate_t;
 
+/* Arguments for fork_filter, when it's run by sp_call */
+typedef struct pxfork
+{
+    spctx_t* sp;
+    int* infd;
+    int* outfd;
+    int* errfd;
+    pid_t pid;                      /* What it returned */
+}
+pxfork_t;
+
 /* -----------------------------------------------------------------------
  *  STRINGS
  */
@@ -103,6 +116,12 @@ enum {
 /* Poll time for waiting operations in milli seconds */
 #define POLL_TIME           20
 
+/* The command timeout in milli seconds */
+#define TIMEOUT_MSECS       (g_pxstate.timeout.tv_sec * 1000)
+
+/* Number of contexts to allocate at once */
+#define CONTEXT_CHUNK       64
+
 /* read & write ends of a pipe */
 #define  READ_END   0
 #define  WRITE_END  1
@@ -117,6 +136,7 @@ enum {
  */
 
 pxstate_t g_pxstate;
+spslab_t* g_contexts = NULL;                /* Where contexts come from */
 
 /* -----------------------------------------------------------------------
  *  FORWARD DECLARATIONS
@@ -210,10 +230,17 @@ int main(int argc, char* argv[])
     if(argc > 0)
         usage();
 
+    g_contexts = spslab_new(sizeof(spctx_t), CONTEXT_CHUNK);
+    if(!g_contexts)
+        errx(1, "out of memory");
+
     r = sp_run(configfile, pidfile, dbg_level);
 
     sp_done();
 
+    spslab_free(g_contexts);
+    g_contexts = NULL;
+
     return r;
 }
 
@@ -346,7 +373,7 @@ int cb_parse_option(const char* name, const char* value)
 
 spctx_t* cb_new_context()
 {
-    spctx_t* ctx = (spctx_t*)calloc(1, sizeof(spctx_t));
+    spctx_t* ctx = (spctx_t*)spslab_alloc(g_contexts);
     if(!ctx)
         sp_messagex(NULL, LOG_CRIT, "out of memory");
     return ctx;
@@ -354,7 +381,7 @@ spctx_t* cb_new_context()
 
 void cb_del_context(spctx_t* ctx)
 {
-    free(ctx);
+    spslab_release(g_contexts, ctx);
 }
 
 /* -----------------------------------------------------------------------------
@@ -490,37 +517,55 @@ cleanup:
     return ret >= 0 ? pid : (pid_t)-1;
 }
 
+static void call_fork(void* arg)
+{
+    pxfork_t* fk = (pxfork_t*)arg;
+    fk->pid = fork_filter(fk->sp, fk->infd, fk->outfd, fk->errfd);
+}
+
+/* Forking copies all our page tables, so it can take a while */
+static pid_t start_filter(spctx_t* sp, int* infd, int* outfd, int* errfd)
+{
+    pxfork_t fk;
+
+    fk.sp = sp;
+    fk.infd = infd;
+    fk.outfd = outfd;
+    fk.errfd = errfd;
+    fk.pid = -1;
+
+    sp_call(call_fork, &fk);
+    return fk.pid;
+}
+
 static int process_file_command(spctx_t* sp)
 {
     pid_t pid = 0;
     int ret = 0, status, r;
-    struct timeval timeout;
 
     /* For reading data from the process */
     int errfd = -1;
-    fd_set rmask;
+    struct pollfd pfd;
     char obuf[1024];
     char ebuf[256];
 
     memset(ebuf, 0, sizeof(ebuf));
 
-    if(sp_cache_data(sp) == -1)
+    /* The filter is handed the message as a file */
+    if(sp_cache_data(sp) == -1 || !sp_cache_file(sp))
         RETURN(-1); /* message already printed */
 
-    pid = fork_filter(sp, NULL, NULL, &errfd);
+    pid = start_filter(sp, NULL, NULL, &errfd);
     if(pid == (pid_t)-1)
         RETURN(-1);
 
     /* Main read write loop */
     while(errfd != -1)
     {
-        FD_ZERO(&rmask);
-        FD_SET(errfd, &rmask);
+        pfd.fd = errfd;
+        pfd.events = POLLIN;
 
-        /* Select can modify the timeout argument so we copy */
-        memcpy(&timeout, &(g_pxstate.timeout), sizeof(timeout));
-
-        r = select(errfd + 1, &rmask, NULL, NULL, &timeout);
+        r = sp_poll(&pfd, 1, TIMEOUT_MSECS);
 
         switch(r)
         {
@@ -532,7 +577,7 @@ static int process_file_command(spctx_t* sp)
             RETURN(-1);
         };
 
-        ASSERT(FD_ISSET(errfd, &rmask));
+        ASSERT(pfd.revents != 0);
 
         /* Note because we handle as string we save one byte for null-termination */
         r = read(errfd, obuf, sizeof(obuf) - 1);
@@ -621,13 +666,74 @@ cleanup:
     return ret;
 }
 
+/* Wait on the filter socket, letting other connections run meanwhile */
+static int smtp_wait(int s, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = s;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	switch (sp_poll(&pfd, 1, TIMEOUT_MSECS)) {
+	case 0:
+		errno = ETIMEDOUT;
+		return -1;
+	case -1:
+		return -1;
+	}
+	return 0;
+}
+
+static int smtp_send(int s, const char* data, int len)
+{
+	int t;
+	while (len > 0) {
+		t = send(s, data, len, MSG_DONTWAIT);
+		if (t == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (smtp_wait(s, POLLOUT) == -1)
+				return -1;
+			continue;
+		}
+		if (t <= 0)
+			return -1;
+		data += t;
+		len -= t;
+	}
+	return 0;
+}
+
+static int smtp_connect(int s, struct sockaddr_in* remote)
+{
+	socklen_t len = sizeof(int);
+	int r, err = 0;
+
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	r = connect(s, (struct sockaddr *)remote, sizeof(struct sockaddr_in));
+	if (r == -1 && errno == EINPROGRESS) {
+		if (smtp_wait(s, POLLOUT) == -1)
+			return -1;
+		if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+			return -1;
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		r = 0;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) & ~O_NONBLOCK);
+	return r;
+}
+
 static int smtp_command(int s, char* data, char* resp, char** resp_data)
 {
 	char buf[4096];
 	int t;
-	if (data && send(s, data, strlen(data), 0) != strlen(data))
+	if (data && smtp_send(s, data, strlen(data)) == -1)
 		return -1;
-	if ((t=recv(s, buf, sizeof buf, 0)) > 0) {
+	if (smtp_wait(s, POLLIN) == -1)
+		return -1;
+	if ((t=recv(s, buf, sizeof buf - 1, 0)) > 0) {
 		buf[t] = '\0';
 		if (resp_data)
 			*resp_data = strdup(buf);
@@ -637,16 +743,73 @@ static int smtp_command(int s, char* data, char* resp, char** resp_data)
 	return -1;
 }
 
+/*
+ * The cache holds the message as it came, so lines starting with a dot
+ * get another one in front on the way to the filter. Otherwise a lone dot
+ * in the message would end the data early, and the filter would take what
+ * comes after it as commands. The last line is ended if it isn't already.
+ */
+static int smtp_send_dotted(int s, int fd)
+{
+	spscan_t scan;
+	char buf[4096];
+	char last = '\n';
+	size_t have = 0, off, n;
+	ssize_t t;
+	int found, final = 0;
+
+	spscan_init(&scan, 0, 1);
+	while (!final) {
+		t = read(fd, buf + have, sizeof buf - have);
+		if (t == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		final = (t == 0);
+		if (t > 0)
+			last = buf[have + t - 1];
+		have += t;
+
+		for (off = 0; off < have; ) {
+			n = spscan_block(&scan, buf + off, have - off, final, &found);
+			if (n > 0 && smtp_send(s, buf + off, n) == -1)
+				return -1;
+			off += n;
+
+			if (found == SPSCAN_END || found == SPSCAN_DOT) {
+				if (smtp_send(s, "..\r\n", 4) == -1)
+					return -1;
+				off += SPSCAN_DOT_LEN;
+			} else if (found == SPSCAN_STUFF) {
+				if (smtp_send(s, "..", 2) == -1)
+					return -1;
+				off += 1;
+			} else {
+				/* Nothing more here, or a line to finish next time */
+				break;
+			}
+		}
+
+		memmove(buf, buf + off, have - off);
+		have -= off;
+	}
+
+	if (last != '\n' && smtp_send(s, "\r\n", 2) == -1)
+		return -1;
+	return 0;
+}
+
 static int process_smtp_command(spctx_t* sp)
 {
 	int ret = 0;
 	int s = -1;
-	int fd = -1, t;
+	int fd = -1;
 	struct sockaddr_in remote;
 	char *last_line = NULL, *recipients = NULL;
 	char str[4096];
 
-	if(sp_cache_data(sp) == -1)
+	if(sp_cache_data(sp) == -1 || !sp_cache_file(sp))
 		RETURN(-1); /* message already printed */
 
 	if (!sp->sender || !sp->recipients) {
@@ -664,7 +827,7 @@ static int process_smtp_command(spctx_t* sp)
 	remote.sin_port = htons(25);
 	remote.sin_addr.s_addr = inet_addr(g_pxstate.command);
 
-	if (connect(s, (struct sockaddr *)&remote, sizeof(struct sockaddr_in)) == -1) {
+	if (smtp_connect(s, &remote) == -1) {
 		syslog(LOG_WARNING, "connect: %m");
 		RETURN(-1);
 	}
@@ -681,9 +844,9 @@ static int process_smtp_command(spctx_t* sp)
 	}
 
 	if (sp->helo)
-		snprintf(str, sizeof str, "XCLIENT ADDR=%s%s HELO=%s\r\n", strchr(sp->client.peername, ':') ? "IPv6:" : "", sp->client.peername, sp->helo);
+		snprintf(str, sizeof str, "XCLIENT ADDR=%s%s HELO=%s\r\n", strchr(spio_peername(&sp->client), ':') ? "IPv6:" : "", spio_peername(&sp->client), sp->helo);
 	else
-		snprintf(str, sizeof str, "XCLIENT ADDR=%s%s\r\n", strchr(sp->client.peername, ':') ? "IPv6:" : "", sp->client.peername);
+		snprintf(str, sizeof str, "XCLIENT ADDR=%s%s\r\n", strchr(spio_peername(&sp->client), ':') ? "IPv6:" : "", spio_peername(&sp->client));
 	if (smtp_command(s, str, "220", NULL) == -1) {
 		syslog(LOG_WARNING, "smtp_command(%s): %m", str);
 		RETURN(-1);
@@ -725,10 +888,10 @@ static int process_smtp_command(spctx_t* sp)
 		RETURN(-1);
 	}
 
-	char buf[4096];
-	while ((t=read(fd, buf, sizeof buf)) > 0)
-		if (send(s, buf, t, 0) != t)
-			RETURN(-1);
+	if (smtp_send_dotted(s, fd) == -1) {
+		syslog(LOG_WARNING, "sending %s: %m", sp->cachename);
+		RETURN(-1);
+	}
 
 	snprintf(str, sizeof str, ".\r\n");
 	if (smtp_command(s, str, NULL, &last_line) == -1) {
@@ -768,21 +931,20 @@ static int process_pipe_command(spctx_t* sp)
 {
     pid_t pid;
     int ret = 0, status, r;
-    struct timeval timeout;
 
     /* For sending data to the process */
     const char* ibuf = NULL;
     int ilen = 0;
     int infd;
     int icount = 0;
-    fd_set wmask;
 
     /* For reading data from the process */
-    int nfds = -1;
     int outfd;
     int errfd;
-    fd_set rmask;
     char obuf[1024];
+
+    /* In the order above */
+    struct pollfd fds[3];
     char ebuf[256];
     int ocount = 0;
 
@@ -790,7 +952,7 @@ static int process_pipe_command(spctx_t* sp)
 
     memset(ebuf, 0, sizeof(ebuf));
 
-    pid = fork_filter(sp, &infd, &outfd, &errfd);
+    pid = start_filter(sp, &infd, &outfd, &errfd);
     if(pid == (pid_t)-1)
         RETURN(-1);
 
@@ -801,26 +963,15 @@ static int process_pipe_command(spctx_t* sp)
     /* Main read write loop */
     while(infd != -1 || outfd != -1 || errfd != -1)
     {
-        FD_ZERO(&rmask);
-        FD_ZERO(&wmask);
-
-        /* We only select on those that are still open */
-        if(infd != -1)
-            FD_SET(infd, &wmask);
-        nfds = infd > nfds ? infd : nfds;
-
-        if(outfd != -1)
-            FD_SET(outfd, &rmask);
-        nfds = outfd > nfds ? outfd : nfds;
-
-        if(errfd != -1)
-            FD_SET(errfd, &rmask);
-        nfds = errfd > nfds ? errfd : nfds;
-
-        /* Select can modify the timeout argument so we copy */
-        memcpy(&timeout, &(g_pxstate.timeout), sizeof(timeout));
-
-        r = select(nfds + 1, &rmask, &wmask, NULL, &timeout);
+        /* Those that are closed are -1 and so ignored */
+        fds[0].fd = infd;
+        fds[0].events = POLLOUT;
+        fds[1].fd = outfd;
+        fds[1].events = POLLIN;
+        fds[2].fd = errfd;
+        fds[2].events = POLLIN;
+
+        r = sp_poll(fds, 3, TIMEOUT_MSECS);
         switch(r)
         {
         case -1:
@@ -832,12 +983,12 @@ static int process_pipe_command(spctx_t* sp)
         };
 
         /* Handling of process's stdin */
-        if(infd != -1 && FD_ISSET(infd, &wmask))
+        if(infd != -1 && fds[0].revents)
         {
             if(ilen <= 0)
             {
                 /* Read some more data into buffer */
-                switch(r = sp_read_data(sp, &ibuf))
+                switch(r = sp_read_data_block(sp, &ibuf))
                 {
                 case -1:
                     RETURN(-1);  /* Message already printed */
@@ -863,7 +1014,7 @@ static int process_pipe_command(spctx_t* sp)
                         sp_messagex(sp, LOG_INFO, "filter command closed input early");
 
                         /* Eat up the rest of the data */
-                        while(sp_read_data(sp, &ibuf) > 0)
+                        while(sp_read_data_block(sp, &ibuf) > 0)
                             ;
 
                         close(infd);
@@ -888,7 +1039,7 @@ static int process_pipe_command(spctx_t* sp)
         }
 
         /* Handling of stdout, which should be email data */
-        if(outfd != -1 && FD_ISSET(outfd, &rmask))
+        if(outfd != -1 && fds[1].revents)
         {
             r = read(outfd, obuf, sizeof(obuf));
             if(r > 0)
@@ -916,7 +1067,7 @@ static int process_pipe_command(spctx_t* sp)
         }
 
         /* Handling of stderr, the last line of which we use as an err message*/
-        if(errfd != -1 && FD_ISSET(errfd, &rmask))
+        if(errfd != -1 && fds[2].revents)
         {
             /* Note because we handle as string we save one byte for null-termination */
             r = read(errfd, obuf, sizeof(obuf) - 1);
@@ -1100,7 +1251,8 @@ static int wait_process(spctx_t* sp, pid_t pid, int* status)
             return 0;
         }
 
-        usleep(POLL_TIME * 1000);
+        /* Lets other connections run while we wait */
+        sp_poll(NULL, 0, POLL_TIME);
         waits--;
     }
 